@@ -0,0 +1,355 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Benchmarks of the public DelayQueue API.
+//
+//   bazel run -c opt //bench:delay_queue_benchmark
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "benchmark/benchmark.h"
+#include "src/delay_queue.h"
+#include "src/sharded_delay_queue.h"
+
+namespace {
+
+// The number of idle timers that are kept pending while one of them is reset
+// per iteration
+const int kPendingTimers = 100000;
+// Delay of the idle timers, long enough for none of them to fire
+const uint64_t kIdleTimeoutMilliseconds = 600000;
+
+DelayQueueOptions MakeOptions(const benchmark::State& state) {
+  DelayQueueOptions options;
+  options.timer_backend = static_cast<TimerBackend>(state.range(0));
+  return options;
+}
+
+// Reset idle timers by moving them in place
+void BM_ResetByReschedule(benchmark::State& state) {
+  DelayQueue delay_queue(MakeOptions(state));
+  std::vector<TaskFuture<void>> timers;
+  for (int i = 0; i < kPendingTimers; i++) {
+    timers.push_back(delay_queue.AddTask(kIdleTimeoutMilliseconds, [] () {}));
+  }
+
+  std::size_t next(0);
+  for (auto _ : state) {
+    delay_queue.Reschedule(timers[next].handle(), kIdleTimeoutMilliseconds);
+    next = (next + 1) % timers.size();
+  }
+}
+
+// Reset idle timers the old way: cancel the timer and add a new one
+void BM_ResetByCancelAndAdd(benchmark::State& state) {
+  DelayQueue delay_queue(MakeOptions(state));
+  std::vector<TaskFuture<void>> timers;
+  for (int i = 0; i < kPendingTimers; i++) {
+    timers.push_back(delay_queue.AddTask(kIdleTimeoutMilliseconds, [] () {}));
+  }
+
+  std::size_t next(0);
+  for (auto _ : state) {
+    delay_queue.Cancel(timers[next].handle());
+    timers[next] = delay_queue.AddTask(kIdleTimeoutMilliseconds, [] () {});
+    next = (next + 1) % timers.size();
+  }
+}
+
+// Producer threads adding tasks to the same delay queue at the same time.
+// Producers only push into the lock-free intake queue, so they do not wait
+// for the dispatch thread
+void BM_AddTask(benchmark::State& state) {
+  static DelayQueue* delay_queue;
+  if (state.thread_index() == 0) {
+    delay_queue = new DelayQueue();
+  }
+
+  for (auto _ : state) {
+    delay_queue->AddTask(kIdleTimeoutMilliseconds, [] () {});
+  }
+  state.SetItemsProcessed(state.iterations());
+
+  if (state.thread_index() == 0) {
+    delete delay_queue;
+  }
+}
+
+// Add a batch of tasks with a loop of AddTask, one intake push each
+void BM_AddTaskLoop(benchmark::State& state) {
+  DelayQueue delay_queue;
+  for (auto _ : state) {
+    for (int64_t i = 0; i < state.range(0); i++) {
+      delay_queue.AddTask(kIdleTimeoutMilliseconds + i, [] () {});
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Add the same batch with a single AddTasks call
+void BM_AddTasks(benchmark::State& state) {
+  DelayQueue delay_queue;
+  for (auto _ : state) {
+    std::vector<std::pair<uint64_t, std::function<void()>>> tasks;
+    tasks.reserve(state.range(0));
+    for (int64_t i = 0; i < state.range(0); i++) {
+      tasks.emplace_back(kIdleTimeoutMilliseconds + i, [] () {});
+    }
+    delay_queue.AddTasks(std::move(tasks));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Add tasks whose futures are dropped right away
+void BM_AddTaskWithFuture(benchmark::State& state) {
+  DelayQueue delay_queue;
+  for (auto _ : state) {
+    delay_queue.AddTask(kIdleTimeoutMilliseconds, [] () {});
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Post the same tasks, without a packaged_task and a future
+void BM_Post(benchmark::State& state) {
+  DelayQueue delay_queue;
+  for (auto _ : state) {
+    delay_queue.Post(kIdleTimeoutMilliseconds, [] () {});
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Post the same tasks at an absolute start time, which saves the clock read
+// of every call
+void BM_PostAt(benchmark::State& state) {
+  DelayQueue delay_queue;
+  auto start_time(TimerClock::now() +
+                  std::chrono::milliseconds(kIdleTimeoutMilliseconds));
+  for (auto _ : state) {
+    delay_queue.PostAt(start_time, [] () {});
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Dispatch throughput of a sharded delay queue with range(0) shards. Tasks
+// are spread over the shards by key and are all due right away, so the
+// dispatch threads are the bottleneck. On a machine with enough cores this
+// scales with the number of shards
+void BM_ShardedDispatch(benchmark::State& state) {
+  const int num_tasks(100000);
+  ShardedDelayQueueOptions options;
+  options.num_shards = state.range(0);
+  ShardedDelayQueue delay_queue(options);
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    for (int i = 0; i < num_tasks; i++) {
+      delay_queue.ShardForKey(i).Post(0, [&num_done, &all_done] () {
+        if (++num_done == num_tasks) {
+          all_done.set_value();
+        }
+      });
+    }
+    all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * num_tasks);
+}
+
+// Throughput of tasks that are due right away, from adding them until they
+// have run, with tracing off (argument 0) and on (argument 1)
+void BM_TracedDispatch(benchmark::State& state) {
+  const int num_tasks(100000);
+  TaskTracer tracer;
+  DelayQueueOptions options;
+  if (state.range(0) != 0) {
+    options.tracer = &tracer;
+  }
+  DelayQueue delay_queue(options);
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    for (int i = 0; i < num_tasks; i++) {
+      delay_queue.Post(0, [&num_done, &all_done] () {
+        if (++num_done == num_tasks) {
+          all_done.set_value();
+        }
+      });
+    }
+    all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * num_tasks);
+}
+
+// The number of heartbeat series and the runs that each of them makes per
+// iteration, at a period of a millisecond
+const int kHeartbeats = 1000;
+const int kHeartbeatRuns = 20;
+
+// Counts the runs of the heartbeats of one iteration
+struct HeartbeatCounter {
+  void Run() {
+    if (++num_runs == kHeartbeats * kHeartbeatRuns) {
+      all_done.set_value();
+    }
+  }
+
+  std::atomic<int> num_runs{0};
+  std::promise<void> all_done;
+};
+
+// Heartbeats as periodic tasks, which reuse their node for every run
+void BM_PeriodicHeartbeat(benchmark::State& state) {
+  DelayQueue delay_queue;
+  for (auto _ : state) {
+    auto counter(std::make_shared<HeartbeatCounter>());
+    std::vector<TaskHandle> handles;
+    for (int i = 0; i < kHeartbeats; i++) {
+      handles.push_back(delay_queue.PostPeriodic(
+          std::chrono::milliseconds(1), std::chrono::milliseconds(1),
+          [counter] () { counter->Run(); }));
+    }
+    counter->all_done.get_future().wait();
+    for (auto& handle : handles) {
+      delay_queue.Cancel(handle);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kHeartbeats * kHeartbeatRuns);
+}
+
+// Heartbeats that add themselves again from within every run, which costs a
+// new node, packaged_task and future per run, and drifts by the lateness of
+// every run
+struct SelfAddingHeartbeat {
+  void operator() () const {
+    if (counter->num_runs.load() < kHeartbeats * kHeartbeatRuns) {
+      counter->Run();
+      delay_queue->AddTask(1, *this);
+    }
+  }
+
+  DelayQueue* delay_queue;
+  std::shared_ptr<HeartbeatCounter> counter;
+};
+
+void BM_SelfAddingHeartbeat(benchmark::State& state) {
+  DelayQueue delay_queue;
+  for (auto _ : state) {
+    auto counter(std::make_shared<HeartbeatCounter>());
+    for (int i = 0; i < kHeartbeats; i++) {
+      delay_queue.AddTask(1, SelfAddingHeartbeat{&delay_queue, counter});
+    }
+    counter->all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kHeartbeats * kHeartbeatRuns);
+}
+
+// Number of voluntary context switches of the whole process so far, which
+// counts the times that the dispatch thread and the workers went to sleep
+int64_t VoluntaryContextSwitches() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw;
+}
+
+// Many timers whose start times are a few microseconds apart, each allowed
+// to start up to range(0) microseconds late. Reports the sleep/wakeup cycles
+// per second of the process; CPU time covers all threads
+void BM_TimerSlack(benchmark::State& state) {
+  const int num_tasks(20000);
+  std::chrono::microseconds slack(state.range(0));
+  DelayQueue delay_queue;
+  int64_t wakeups(0);
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    auto before(VoluntaryContextSwitches());
+    for (int i = 0; i < num_tasks; i++) {
+      delay_queue.Post(i % 100, [&num_done, &all_done] () {
+        if (++num_done == num_tasks) {
+          all_done.set_value();
+        }
+      }, slack);
+    }
+    all_done.get_future().wait();
+    wakeups += VoluntaryContextSwitches() - before;
+  }
+  state.counters["wakeups"] = benchmark::Counter(
+      wakeups, benchmark::Counter::kIsRate);
+  state.SetItemsProcessed(state.iterations() * num_tasks);
+}
+
+// Keep range(0) idle timers pending and measure how late a burst of tasks
+// that become due over a few milliseconds starts, from its start time to
+// the moment its callable runs on a worker. Reports percentiles in
+// microseconds over all iterations
+void BM_DispatchLateness(benchmark::State& state) {
+  const int num_probes(1000);
+  DelayQueue delay_queue;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    delay_queue.Post(kIdleTimeoutMilliseconds + i % 1000, [] () {});
+  }
+
+  std::vector<double> latenesses;
+  for (auto _ : state) {
+    std::vector<double> probes(num_probes);
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    auto first_start(TimerClock::now() + std::chrono::milliseconds(1));
+    for (int i = 0; i < num_probes; i++) {
+      auto start_time(first_start + std::chrono::microseconds(5 * i));
+      delay_queue.PostAt(start_time, [&, i, start_time] () {
+        probes[i] = std::chrono::duration<double, std::micro>(
+            TimerClock::now() - start_time).count();
+        if (++num_done == num_probes) {
+          all_done.set_value();
+        }
+      });
+    }
+    all_done.get_future().wait();
+    latenesses.insert(latenesses.end(), probes.begin(), probes.end());
+  }
+
+  std::sort(latenesses.begin(), latenesses.end());
+  state.counters["p50_us"] = latenesses[latenesses.size() / 2];
+  state.counters["p99_us"] = latenesses[latenesses.size() * 99 / 100];
+  state.counters["p999_us"] = latenesses[latenesses.size() * 999 / 1000];
+  state.counters["max_us"] = latenesses.back();
+  state.SetItemsProcessed(state.iterations() * num_probes);
+}
+
+}  // namespace
+
+BENCHMARK(BM_AddTaskLoop)->Arg(1000);
+BENCHMARK(BM_AddTasks)->Arg(1000);
+BENCHMARK(BM_AddTask)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_AddTaskWithFuture);
+BENCHMARK(BM_Post);
+BENCHMARK(BM_PostAt);
+BENCHMARK(BM_TimerSlack)->Arg(0)->Arg(100)->Arg(1000)->Arg(10000)
+    ->Unit(benchmark::kMillisecond)->UseRealTime()->MeasureProcessCPUTime();
+BENCHMARK(BM_ShardedDispatch)->RangeMultiplier(2)->Range(1, 8)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_TracedDispatch)->Arg(0)->Arg(1)
+    ->Unit(benchmark::kMillisecond)->UseRealTime()->MeasureProcessCPUTime();
+BENCHMARK(BM_PeriodicHeartbeat)->Unit(benchmark::kMillisecond)
+    ->UseRealTime()->MeasureProcessCPUTime();
+BENCHMARK(BM_SelfAddingHeartbeat)->Unit(benchmark::kMillisecond)
+    ->UseRealTime()->MeasureProcessCPUTime();
+BENCHMARK(BM_DispatchLateness)->Arg(0)->Arg(10000)->Arg(1000000)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ResetByReschedule)
+    ->Arg(static_cast<int>(TimerBackend::kBinaryHeap))
+    ->Arg(static_cast<int>(TimerBackend::kTimingWheel));
+BENCHMARK(BM_ResetByCancelAndAdd)
+    ->Arg(static_cast<int>(TimerBackend::kBinaryHeap))
+    ->Arg(static_cast<int>(TimerBackend::kTimingWheel));
@@ -0,0 +1,124 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Benchmarks of the task log and of the recovery of a durable delay queue.
+//
+//   bazel run -c opt //bench:durable_delay_queue_benchmark
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "benchmark/benchmark.h"
+#include "src/durable_delay_queue.h"
+#include "src/task_log.h"
+
+namespace {
+
+// The payload of every task, e.g. the key of a session that times out
+const std::string kPayload(16, 'p');
+
+// A scratch directory for a log, deleted with everything in it at the end
+class ScratchDirectory {
+ public:
+  ScratchDirectory() {
+    char path[] = "/tmp/durable_delay_queue_benchmark_XXXXXX";
+    path_ = mkdtemp(path);
+  }
+
+  ~ScratchDirectory() {
+    auto dir(opendir(path_.c_str()));
+    while (auto entry = readdir(dir)) {
+      unlink((path_ + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+    rmdir(path_.c_str());
+  }
+
+  const std::string& path() const {
+    return path_;
+  }
+
+ private:
+  std::string path_;
+};
+
+// Write a log of {num_tasks} pending tasks, due in an hour
+void WriteLog(const std::string& directory, int64_t num_tasks) {
+  auto log(TaskLog::Open(directory, 64 << 20, false,
+                         [] (const LogRecord&) {}));
+  auto deadline(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      (std::chrono::system_clock::now() + std::chrono::hours(1))
+          .time_since_epoch()).count());
+  for (int64_t i = 1; i <= num_tasks; i++) {
+    log->Append(LogRecord{LogRecord::kInsert, static_cast<uint64_t>(i), 1,
+                          deadline, kPayload.data(), kPayload.size()});
+  }
+}
+
+// Append the record of a scheduled task, with and without fdatasync()
+void BM_Append(benchmark::State& state) {
+  ScratchDirectory directory;
+  auto log(TaskLog::Open(directory.path(), 64 << 20, state.range(0) != 0,
+                         [] (const LogRecord&) {}));
+  uint64_t task_id(0);
+  for (auto _ : state) {
+    log->Append(LogRecord{LogRecord::kInsert, ++task_id, 1, 0,
+                          kPayload.data(), kPayload.size()});
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(log->Bytes());
+}
+
+// Read back a log of {range(0)} records, checking every checksum
+void BM_Replay(benchmark::State& state) {
+  ScratchDirectory directory;
+  WriteLog(directory.path(), state.range(0));
+  for (auto _ : state) {
+    int64_t num_records(0);
+    auto log(TaskLog::Open(directory.path(), 64 << 20, false,
+                           [&num_records] (const LogRecord&) {
+      num_records++;
+    }));
+    benchmark::DoNotOptimize(num_records);
+    state.PauseTiming();
+    log.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Open a durable delay queue with {range(0)} pending tasks in its log: replay
+// the log, rebuild the index of the tasks and schedule all of them again
+void BM_Recovery(benchmark::State& state) {
+  ScratchDirectory directory;
+  WriteLog(directory.path(), state.range(0));
+  DurableDelayQueueOptions options;
+  options.directory = directory.path();
+  std::unordered_map<uint32_t, DurableDelayQueue::Handler> handlers;
+  handlers[1] = [] (const std::string&) {};
+  for (auto _ : state) {
+    auto queue(DurableDelayQueue::Open(options, handlers));
+    benchmark::DoNotOptimize(queue->PendingTasks());
+    state.PauseTiming();
+    queue.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+}  // namespace
+
+BENCHMARK(BM_Append)->Arg(0)->Arg(1);
+BENCHMARK(BM_Replay)->Arg(1000000)->Arg(10000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Recovery)->Arg(1000000)->Arg(10000000)
+    ->Unit(benchmark::kMillisecond)->Iterations(1);
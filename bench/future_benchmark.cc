@@ -0,0 +1,102 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Benchmarks of Future against std::future: setting and reading a value on
+// one thread, handing a value from a worker of the thread pool to a waiting
+// thread, and running a chain of continuations.
+//
+//   bazel run -c opt //bench:future_benchmark
+
+#include <future>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/future.h"
+#include "src/threadpool.h"
+
+namespace {
+
+void BM_StdFutureSetGet(benchmark::State& state) {
+  for (auto _ : state) {
+    std::promise<int> promise;
+    auto future(promise.get_future());
+    promise.set_value(1);
+    benchmark::DoNotOptimize(future.get());
+  }
+}
+
+void BM_FutureSetGet(benchmark::State& state) {
+  for (auto _ : state) {
+    Promise<int> promise;
+    auto future(promise.GetFuture());
+    promise.SetValue(1);
+    benchmark::DoNotOptimize(future.Get());
+  }
+}
+
+// A worker sets the value while the benchmark thread waits for it
+void BM_StdFutureHandoff(benchmark::State& state) {
+  ThreadPool threadpool;
+  for (auto _ : state) {
+    auto promise(std::make_shared<std::promise<int>>());
+    auto future(promise->get_future());
+    threadpool.Post([promise] () { promise->set_value(1); });
+    benchmark::DoNotOptimize(future.get());
+  }
+}
+
+void BM_FutureHandoff(benchmark::State& state) {
+  ThreadPool threadpool;
+  for (auto _ : state) {
+    Promise<int> promise;
+    auto future(promise.GetFuture());
+    threadpool.Post([promise = std::move(promise)] () mutable {
+      promise.SetValue(1);
+    });
+    benchmark::DoNotOptimize(future.Get());
+  }
+}
+
+// A chain of {state.range(0)} steps, each adding one to the value. With
+// std::future every step is a job that blocks on the previous future, with
+// Future it is a continuation that runs once the previous value is set
+void BM_StdFutureChain(benchmark::State& state) {
+  ThreadPool threadpool;
+  for (auto _ : state) {
+    std::promise<int> promise;
+    auto future(promise.get_future().share());
+    std::vector<std::future<int>> steps;
+    for (int64_t i = 0; i < state.range(0); i++) {
+      auto step(std::make_shared<std::packaged_task<int()>>(
+          [future] () { return future.get() + 1; }));
+      auto next(step->get_future());
+      threadpool.Post([step] () { (*step)(); });
+      future = next.share();
+    }
+    promise.set_value(0);
+    benchmark::DoNotOptimize(future.get());
+  }
+}
+
+void BM_FutureChain(benchmark::State& state) {
+  ThreadPool threadpool;
+  for (auto _ : state) {
+    Promise<int> promise;
+    auto future(promise.GetFuture());
+    for (int64_t i = 0; i < state.range(0); i++) {
+      future = future.Then(threadpool, [] (int value) { return value + 1; });
+    }
+    promise.SetValue(0);
+    benchmark::DoNotOptimize(future.Get());
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_StdFutureSetGet);
+BENCHMARK(BM_FutureSetGet);
+BENCHMARK(BM_StdFutureHandoff)->UseRealTime();
+BENCHMARK(BM_FutureHandoff)->UseRealTime();
+BENCHMARK(BM_StdFutureChain)->Arg(1)->Arg(16)->UseRealTime();
+BENCHMARK(BM_FutureChain)->Arg(1)->Arg(16)->UseRealTime();
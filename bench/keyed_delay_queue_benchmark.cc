@@ -0,0 +1,65 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Benchmarks of requests for the same keys over and over: posting a task per
+// request against debouncing and coalescing them per key. Each iteration is
+// one request for one of {state.range(0)} keys, with a delay long enough for
+// the requests to pile up.
+//
+//   bazel run -c opt //bench:keyed_delay_queue_benchmark
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "benchmark/benchmark.h"
+#include "src/delay_queue.h"
+#include "src/keyed_delay_queue.h"
+
+namespace {
+
+const auto kDelay = std::chrono::seconds(10);
+
+// Every request adds a task, which runs the work once per request
+void BM_PostPerRequest(benchmark::State& state) {
+  DelayQueue delay_queue;
+  std::atomic<int64_t> sum{0};
+  int64_t i(0);
+  for (auto _ : state) {
+    auto key(i % state.range(0));
+    delay_queue.Post(kDelay, [&sum, key, i] () { sum += key + i; });
+    i++;
+  }
+}
+
+// The pending run of the key moves back in place
+void BM_Debounce(benchmark::State& state) {
+  std::atomic<int64_t> sum{0};
+  KeyedDelayQueue<int64_t, int64_t> queue(
+      [&sum] (const int64_t& key, int64_t payload) { sum += key + payload; });
+  int64_t i(0);
+  for (auto _ : state) {
+    queue.Debounce(i % state.range(0), kDelay, i);
+    i++;
+  }
+}
+
+// The payload is merged into the pending run of the key
+void BM_Coalesce(benchmark::State& state) {
+  std::atomic<int64_t> sum{0};
+  KeyedDelayQueue<int64_t, int64_t> queue(
+      [&sum] (const int64_t& key, int64_t payload) { sum += key + payload; },
+      [] (int64_t& pending, int64_t payload) { pending += payload; });
+  int64_t i(0);
+  for (auto _ : state) {
+    queue.Coalesce(i % state.range(0), kDelay, i);
+    i++;
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_PostPerRequest)->Arg(16)->Arg(4096);
+BENCHMARK(BM_Debounce)->Arg(16)->Arg(4096);
+BENCHMARK(BM_Coalesce)->Arg(16)->Arg(4096);
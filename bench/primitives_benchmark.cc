@@ -0,0 +1,77 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Benchmarks of the synchronization primitives under the thread pool: push
+// and pop on a ThreadsafeQueue shared by a growing number of threads, and
+// the round trip of a wakeup between two threads through a pair of
+// Semaphores.
+//
+//   bazel run -c opt //bench:primitives_benchmark
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "src/semaphore.h"
+#include "src/threadsafe_queue.h"
+
+namespace {
+
+// Threads that each push an item and pop one back on the same queue, so that
+// every operation takes the one lock of the queue. Reports how often a
+// thread found the lock taken, per operation
+void BM_QueuePushPop(benchmark::State& state) {
+  static ThreadsafeQueue<int64_t>* queue;
+  if (state.thread_index() == 0) {
+    queue = new ThreadsafeQueue<int64_t>();
+  }
+
+  int64_t value(0);
+  for (auto _ : state) {
+    queue->Push(value);
+    queue->TryPop(value);
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+
+  if (state.thread_index() == 0) {
+    state.counters["contentions"] = benchmark::Counter(
+        static_cast<double>(queue->Contentions()),
+        benchmark::Counter::kAvgIterations);
+    delete queue;
+  }
+}
+
+// One thread wakes up another through a semaphore and waits to be woken up
+// in return through a second one. An iteration is a round trip, which spins
+// as long as the other thread answers quickly and sleeps otherwise
+void BM_SemaphorePingPong(benchmark::State& state) {
+  Semaphore ping;
+  Semaphore pong;
+  std::atomic<bool> stop{false};
+  std::thread partner([&] () {
+    while (true) {
+      ping.Wait();
+      if (stop.load()) {
+        break;
+      }
+      pong.Notify();
+    }
+  });
+
+  for (auto _ : state) {
+    ping.Notify();
+    pong.Wait();
+  }
+  state.SetItemsProcessed(state.iterations());
+
+  stop = true;
+  ping.Notify();
+  partner.join();
+}
+
+}  // namespace
+
+BENCHMARK(BM_QueuePushPop)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_SemaphorePingPong)->UseRealTime();
@@ -0,0 +1,181 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Short-task throughput of ThreadPool, with the shared queue (argument 0)
+// and with work stealing queues (argument 1), and the cost of a future per
+// job compared with posting the job, the cost of collecting metrics
+// (second argument of BM_Post), the latency from submitting a job to
+// an idle pool until the job runs, and the start latency of a job of each
+// priority behind a backlog of bulk jobs.
+//
+//   bazel run -c opt //bench:threadpool_benchmark
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/threadpool.h"
+
+namespace {
+
+const int kJobsPerIteration = 10000;
+
+ThreadPoolOptions MakeOptions(const benchmark::State& state) {
+  ThreadPoolOptions options;
+  options.work_stealing = state.range(0) != 0;
+  return options;
+}
+
+// One thread outside the pool submits many tiny jobs, like the dispatch
+// thread of a delay queue does
+void BM_SubmitFromOutside(benchmark::State& state) {
+  ThreadPool threadpool(MakeOptions(state));
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    for (int i = 0; i < kJobsPerIteration; i++) {
+      threadpool.Submit(FunctionWrapper([&num_done, &all_done] () {
+        if (++num_done == kJobsPerIteration) {
+          all_done.set_value();
+        }
+      }));
+    }
+    all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kJobsPerIteration);
+}
+
+// Jobs fan out into more jobs from the worker threads
+void BM_SubmitFromWorkers(benchmark::State& state) {
+  ThreadPool threadpool(MakeOptions(state));
+  const int fan_out(100);
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    for (int i = 0; i < kJobsPerIteration / fan_out; i++) {
+      threadpool.Submit(FunctionWrapper([&] () {
+        for (int j = 0; j < fan_out; j++) {
+          threadpool.Submit(FunctionWrapper([&] () {
+            if (++num_done == kJobsPerIteration) {
+              all_done.set_value();
+            }
+          }));
+        }
+      }));
+    }
+    all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kJobsPerIteration);
+}
+
+// Submit jobs whose futures are dropped, which still pays for the
+// packaged_task and its shared state
+void BM_SubmitWithFuture(benchmark::State& state) {
+  ThreadPool threadpool(MakeOptions(state));
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    for (int i = 0; i < kJobsPerIteration; i++) {
+      threadpool.Submit([&num_done, &all_done] () {
+        if (++num_done == kJobsPerIteration) {
+          all_done.set_value();
+        }
+      });
+    }
+    all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kJobsPerIteration);
+}
+
+// Post the same jobs without a future, with metrics collected if range(1)
+// is set
+void BM_Post(benchmark::State& state) {
+  auto options(MakeOptions(state));
+  options.collect_metrics = state.range(1) != 0;
+  ThreadPool threadpool(options);
+  for (auto _ : state) {
+    std::atomic<int> num_done{0};
+    std::promise<void> all_done;
+    for (int i = 0; i < kJobsPerIteration; i++) {
+      threadpool.Post([&num_done, &all_done] () {
+        if (++num_done == kJobsPerIteration) {
+          all_done.set_value();
+        }
+      });
+    }
+    all_done.get_future().wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kJobsPerIteration);
+}
+
+// Submit one job at a time and wait for it, so that every job has to wake
+// up an idle worker. This measures the round trip from the submitting
+// thread to the worker and back, which is dominated by the semaphores
+void BM_WakeToRun(benchmark::State& state) {
+  ThreadPool threadpool(MakeOptions(state));
+  for (auto _ : state) {
+    threadpool.Submit([] () {}).wait();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Keep range(1) normal priority bulk jobs of about 10us queued, and measure
+// how long a probe job of priority range(0) waits until it starts. Reports
+// the median and the 99th percentile in microseconds
+void BM_PriorityLatency(benchmark::State& state) {
+  const int backlog(state.range(1));
+  auto priority(static_cast<TaskPriority>(state.range(0)));
+  std::atomic<int> queued_bulk_jobs{0};
+  std::vector<double> latencies;
+  ThreadPool threadpool;
+
+  for (auto _ : state) {
+    while (queued_bulk_jobs.load() < backlog) {
+      queued_bulk_jobs++;
+      threadpool.Post([&queued_bulk_jobs] () {
+        auto end(std::chrono::steady_clock::now() +
+                 std::chrono::microseconds(10));
+        while (std::chrono::steady_clock::now() < end) {
+        }
+        queued_bulk_jobs--;
+      });
+    }
+
+    std::promise<std::chrono::steady_clock::time_point> started;
+    auto submitted(std::chrono::steady_clock::now());
+    threadpool.Post([&started] () {
+      started.set_value(std::chrono::steady_clock::now());
+    }, priority);
+    auto latency(started.get_future().get() - submitted);
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(latency).count());
+  }
+
+  // Let the backlog drain before the counter goes away
+  while (queued_bulk_jobs.load() > 0) {
+    std::this_thread::yield();
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  state.counters["p50_us"] = latencies[latencies.size() / 2];
+  state.counters["p99_us"] = latencies[latencies.size() * 99 / 100];
+}
+
+}  // namespace
+
+BENCHMARK(BM_SubmitFromOutside)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_SubmitFromWorkers)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_SubmitWithFuture)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_Post)->Args({0, 0})->Args({0, 1})->Args({1, 0})->Args({1, 1})
+    ->UseRealTime();
+BENCHMARK(BM_WakeToRun)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_PriorityLatency)
+    ->Args({static_cast<int>(TaskPriority::kHigh), 100})
+    ->Args({static_cast<int>(TaskPriority::kNormal), 100})
+    ->Args({static_cast<int>(TaskPriority::kLow), 100})
+    ->UseRealTime();
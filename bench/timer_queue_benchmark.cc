@@ -0,0 +1,88 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Compare the timer structures behind DelayQueue with a large number of
+// pending tasks. Each iteration pushes N nodes whose start times spread over
+// the next 10 seconds, most of them within the first 2 seconds, and then
+// drains them by moving a simulated clock forward 1ms at a time, just like
+// the dispatch thread would. Nodes are allocated once up front so that the
+// numbers only reflect the timer structure itself.
+//
+//   bazel run -c opt //bench:timer_queue_benchmark
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/timer_queue.h"
+#include "src/timing_wheel.h"
+
+namespace {
+
+// Start time offsets of the benchmark nodes, in microseconds
+std::vector<int64_t> MakeOffsets(int64_t num_nodes) {
+  std::mt19937_64 generator(42);
+  std::exponential_distribution<double> near_future(1.0 / 500000);
+  std::vector<int64_t> offsets(num_nodes);
+  for (auto& offset : offsets) {
+    offset = std::min<int64_t>(near_future(generator), 10000000);
+  }
+  return offsets;
+}
+
+template <typename MakeQueue>
+void PushAndDrain(benchmark::State& state, MakeQueue make_queue) {
+  auto num_nodes(state.range(0));
+  auto offsets(MakeOffsets(num_nodes));
+  auto start(TimerClock::now());
+  std::vector<TimerNode*> nodes;
+  for (auto offset : offsets) {
+    nodes.push_back(new TimerNode(start + std::chrono::microseconds(offset),
+                                  FunctionWrapper([] () {})));
+  }
+
+  for (auto _ : state) {
+    std::unique_ptr<TimerQueue> queue(make_queue(start));
+    for (auto node : nodes) {
+      queue->Push(node);
+    }
+
+    // Drain the queue; nodes go back to the vector so that the queue does
+    // not release them
+    nodes.clear();
+    auto now(start);
+    while (!queue->Empty()) {
+      now += std::chrono::milliseconds(1);
+      while (auto node = queue->PopExpired(now)) {
+        nodes.push_back(node);
+      }
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_nodes);
+  for (auto node : nodes) {
+    node->Release();
+  }
+}
+
+void BM_TimerHeap(benchmark::State& state) {
+  PushAndDrain(state, [] (TimerClock::time_point) {
+    return new TimerHeap();
+  });
+}
+
+void BM_TimingWheel(benchmark::State& state) {
+  PushAndDrain(state, [] (TimerClock::time_point start) {
+    return new TimingWheel(std::chrono::milliseconds(1), start);
+  });
+}
+
+}  // namespace
+
+BENCHMARK(BM_TimerHeap)->Arg(1000000)->Arg(10000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TimingWheel)->Arg(1000000)->Arg(10000000)
+    ->Unit(benchmark::kMillisecond);
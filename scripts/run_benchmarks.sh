@@ -0,0 +1,25 @@
+# Run every benchmark under //bench and write the results as JSON, one file
+# per benchmark binary, so that runs of two releases can be compared.
+# Usage: ./scripts/run_benchmarks.sh [output directory] [benchmark flags...]
+# The output directory defaults to bench_results/<current commit>
+OUTPUT_DIR=${1:-bench_results/$(git rev-parse --short HEAD)}
+shift
+mkdir -p "${OUTPUT_DIR}"
+OUTPUT_DIR=$(cd "${OUTPUT_DIR}" && pwd)
+
+BENCHMARKS=$(bazel query 'kind(cc_binary, //bench:*)' 2>/dev/null)
+if [[ $? != 0 || -z "${BENCHMARKS}" ]]; then
+    echo "Failed to list the benchmarks under //bench"
+    exit 1
+fi
+for BENCHMARK in ${BENCHMARKS}; do
+    NAME=${BENCHMARK##*:}
+    bazel run -c opt "${BENCHMARK}" -- \
+        --benchmark_out="${OUTPUT_DIR}/${NAME}.json" \
+        --benchmark_out_format=json "$@"
+    if [[ $? != 0 ]]; then
+        echo "Failed to run ${BENCHMARK}"
+        exit 1
+    fi
+done
+echo "Results written to ${OUTPUT_DIR}"
@@ -0,0 +1,38 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef AWAITABLE_H_
+#define AWAITABLE_H_
+
+// Support for C++20 coroutines. DELAY_QUEUE_COROUTINES is defined when the
+// compiler implements coroutines and the standard library has <coroutine>,
+// e.g. with -std=c++20 on GCC 10 or Clang 14 and later. The awaitables of
+// ScheduleOn() in threadpool.h and SleepFor() and SleepUntil() in
+// delay_queue.h only exist then.
+//
+// They are free functions that only use the public interface of ThreadPool
+// and DelayQueue, which look the same in every language mode. So a target
+// that uses coroutines can be built with -std=c++20 on its own, and link
+// against the libraries built with an older standard
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define DELAY_QUEUE_COROUTINES 1
+#endif
+#endif
+
+#ifdef DELAY_QUEUE_COROUTINES
+
+// A job that resumes a suspended coroutine. It holds a single pointer, so it
+// is stored inside a FunctionWrapper or a timer node without an allocation
+struct ResumeCoroutine {
+  std::coroutine_handle<> coroutine;
+
+  void operator()() const {
+    coroutine.resume();
+  }
+};
+
+#endif
+
+#endif // AWAITABLE_H_
@@ -0,0 +1,96 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/capacity_limit.h"
+
+bool
+CapacityLimit::TryAcquire(std::size_t items, std::size_t bytes) {
+  if (!limited_) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!Fits(items, bytes)) {
+    return false;
+  }
+  Take(items, bytes);
+  return true;
+}
+
+void
+CapacityLimit::Acquire(std::size_t items, std::size_t bytes) {
+  if (!limited_) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!Fits(items, bytes)) {
+    // Announce the waiter before checking again, so that a Release() that
+    // the check misses sees the waiter and notifies it
+    waiters_.fetch_add(1);
+    room_available_.wait(lock, [&] () { return Fits(items, bytes); });
+    waiters_.fetch_sub(1);
+  }
+  Take(items, bytes);
+}
+
+bool
+CapacityLimit::AcquireUntil(std::size_t items, std::size_t bytes,
+                            std::chrono::steady_clock::time_point deadline) {
+  if (!limited_) {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!Fits(items, bytes)) {
+    waiters_.fetch_add(1);
+    auto fits(room_available_.wait_until(lock, deadline,
+        [&] () { return Fits(items, bytes); }));
+    waiters_.fetch_sub(1);
+    if (!fits) {
+      return false;
+    }
+  }
+  Take(items, bytes);
+  return true;
+}
+
+void
+CapacityLimit::ForceAcquire(std::size_t items, std::size_t bytes) {
+  if (limited_) {
+    Take(items, bytes);
+  }
+}
+
+void
+CapacityLimit::Release(std::size_t items, std::size_t bytes) {
+  if (!limited_) {
+    return;
+  }
+
+  items_.fetch_sub(items);
+  bytes_.fetch_sub(bytes);
+  if (waiters_.load() > 0) {
+    // Taking the lock orders this notification after a waiter that has
+    // just found no room has gone to sleep
+    std::lock_guard<std::mutex> lock(mutex_);
+    room_available_.notify_all();
+  }
+}
+
+bool
+CapacityLimit::Fits(std::size_t items, std::size_t bytes) const {
+  auto held_items(items_.load());
+  if (held_items == 0) {
+    return true;
+  }
+  return (max_items_ == 0 || held_items + items <= max_items_) &&
+         (max_bytes_ == 0 || bytes_.load() + bytes <= max_bytes_);
+}
+
+void
+CapacityLimit::Take(std::size_t items, std::size_t bytes) {
+  items_.fetch_add(items);
+  bytes_.fetch_add(bytes);
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef CAPACITY_LIMIT_H_
+#define CAPACITY_LIMIT_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// A budget of items and of bytes, which producers take from before they add
+// work to a queue and give back when the work leaves the queue. Once the
+// budget is used up, producers either wait for room, give up right away or
+// give up at a deadline, which pushes back on producers that outrun the
+// consumers instead of letting the queue grow without bound.
+//
+// A limit of zero means no limit. Without any limit, nothing is counted and
+// every call returns right away
+class CapacityLimit {
+ public:
+  CapacityLimit(std::size_t max_items, std::size_t max_bytes) :
+      max_items_(max_items), max_bytes_(max_bytes),
+      limited_(max_items != 0 || max_bytes != 0),
+      items_(0), bytes_(0), waiters_(0) {}
+
+  // Whether any limit is set
+  bool Limited() const {
+    return limited_;
+  }
+
+  // Take {items} and {bytes} from the budget if they fit, without waiting.
+  // Return false otherwise. A request that is larger than the whole budget
+  // fits once nothing else is held, so it does not wait forever
+  bool TryAcquire(std::size_t items, std::size_t bytes);
+
+  // Wait until {items} and {bytes} fit, and take them
+  void Acquire(std::size_t items, std::size_t bytes);
+
+  // Same as above, but give up at {deadline}. Return false if the request
+  // did not fit by then
+  bool AcquireUntil(std::size_t items, std::size_t bytes,
+                    std::chrono::steady_clock::time_point deadline);
+
+  // Take {items} and {bytes} whether they fit or not, e.g. for work that
+  // must not wait because waiting could deadlock
+  void ForceAcquire(std::size_t items, std::size_t bytes);
+
+  // Give back what an earlier acquisition took, and wake up the waiting
+  // producers
+  void Release(std::size_t items, std::size_t bytes);
+
+  // What is currently taken from the budget. Always zero without a limit
+  std::size_t Items() const {
+    return items_.load(std::memory_order_relaxed);
+  }
+  std::size_t Bytes() const {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+  CapacityLimit(const CapacityLimit&) = delete;
+  CapacityLimit& operator= (const CapacityLimit&) = delete;
+
+ private:
+  // Whether the request fits into what is left of the budget. Only called
+  // with mutex_ held, so that two requests cannot both take the last room
+  bool Fits(std::size_t items, std::size_t bytes) const;
+
+  // Take the request from the budget
+  void Take(std::size_t items, std::size_t bytes);
+
+  const std::size_t max_items_;
+  const std::size_t max_bytes_;
+  const bool limited_;
+
+  // What is taken from the budget. Releases decrement them without the lock
+  std::atomic<std::size_t> items_;
+  std::atomic<std::size_t> bytes_;
+
+  // Producers that wait for room sleep on the condition variable. Release()
+  // only takes the lock when waiters_ says that somebody is sleeping
+  std::mutex mutex_;
+  std::condition_variable room_available_;
+  std::atomic<int> waiters_;
+};
+
+#endif // CAPACITY_LIMIT_H_
@@ -4,55 +4,607 @@
 
 #include "src/delay_queue.h"
 
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+#include "src/timing_wheel.h"
+
+namespace {
+
+// Compaction only runs with at least this many cancelled nodes in the queue,
+// and Cancel() wakes the dispatch thread to consider a compaction every time
+// this many tasks have been cancelled
+const uint64_t kCompactionThreshold = 1024;
+
+// How often a shutdown checks whether the thread pool has run out of jobs
+const std::chrono::microseconds kShutdownPollInterval(200);
+
+}  // namespace
+
+DelayQueue::DelayQueue(const DelayQueueOptions& options) :
+    cancelled_tasks_(0), reclaimed_tasks_(0),
+    capacity_(std::make_shared<CapacityLimit>(options.max_pending_tasks,
+                                              options.max_pending_bytes)),
+    terminated_(false), tracer_(options.tracer),
+    running_periodic_tasks_(0), shutdown_called_(false),
+    shutting_down_(false), shutdown_mode_(ShutdownMode::kDrain),
+    dropped_jobs_(0),
+    worker_thread_pool_(options.thread_pool) {
+  if (options.collect_metrics) {
+    metrics_ = std::make_shared<Metrics>();
+  }
+  if (worker_thread_pool_ == nullptr) {
+    owned_thread_pool_.reset(new ThreadPool(options.thread_pool_options));
+    worker_thread_pool_ = owned_thread_pool_.get();
+  }
+
+  // Create the waiter and the timer structure before starting the dispatch
+  // thread, as the dispatch thread starts to use them right away
+  if (options.use_timerfd) {
+    waiter_ = TimerfdWaiter::Create();
+  }
+  if (waiter_ == nullptr) {
+    waiter_.reset(new SemaphoreWaiter());
+  }
+  switch (options.timer_backend) {
+    case TimerBackend::kBinaryHeap:
+      task_queue_.reset(new TimerHeap());
+      break;
+    case TimerBackend::kTimingWheel:
+      task_queue_.reset(new TimingWheel(options.wheel_tick, now()));
+      break;
+  }
+  dispatch_thread_ = std::thread([this] () { wait_and_dispatch(); });
+  if (!options.dispatch_thread_cpus.empty()) {
+    SetThreadAffinity(dispatch_thread_, options.dispatch_thread_cpus);
+  }
+}
+
 DelayQueue::~DelayQueue() {
   // Turn off the delay queue by setting the terminated flag and join the thread
   terminated_.store(true);
   // We need to wake up the dispatch thread in case it is stuck in the Wait() 
   // due to an empty queue
-  semaphore_.Notify();
+  waiter_->Notify();
   dispatch_thread_.join();
+
+  // Periodic runs that are still queued in or running on the thread pool
+  // arm their next run through the intake queue, so wait for them to finish
+  // before dropping what is in there. They see terminated_ and stop
+  while (running_periodic_tasks_.load() > 0) {
+    std::this_thread::yield();
+  }
+
+  // Drop the nodes that never made it to the task queue. Every node in the
+  // intake queue owns a reference, whatever the reason it is queued for
+  auto node(intake_.PopAll());
+  while (node != nullptr) {
+    auto next(node->intake_next_);
+    node->Release();
+    node = next;
+  }
+}
+
+bool
+DelayQueue::Cancel(const TaskHandle& handle) {
+  auto node(handle.node_);
+  if (node == nullptr) {
+    return false;
+  }
+  if (!node->TryCancel()) {
+    // A periodic task in the middle of a run. The running thread owns the
+    // function wrapper and drops the node instead of arming the next run
+    if (!node->TryCancelRunning()) {
+      return false;
+    }
+    capacity_->Release(1, node->footprint_);
+    return true;
+  }
+  capacity_->Release(1, node->footprint_);
+
+  // This thread now owns the function wrapper, free the captured state
+  // without waiting for the node to reach the top of the queue
+  node->function_wrapper_ = FunctionWrapper();
+  auto cancelled(cancelled_tasks_.fetch_add(1) + 1);
+  if (cancelled % kCompactionThreshold == 0) {
+    waiter_->Notify();
+  }
+  return true;
+}
+
+ShutdownReport
+DelayQueue::Shutdown(ShutdownMode mode, TimerClock::time_point deadline) {
+  if (shutdown_called_.exchange(true)) {
+    return ShutdownReport();
+  }
+  shutdown_mode_ = mode;
+  shutdown_deadline_ = deadline;
+  shutting_down_.store(true);
+  waiter_->Notify();
+  shutdown_done_.Wait();
+
+  auto report(shutdown_report_);
+  if (owned_thread_pool_) {
+    // Returns right away unless the dispatch thread has given up at the
+    // deadline, in which case the queued jobs would only start after it
+    report.dropped += owned_thread_pool_->Drain(deadline);
+    report.running = owned_thread_pool_->ActiveJobs();
+  }
+  return report;
+}
+
+std::string
+DelayQueue::MetricsText() const {
+  PrometheusWriter writer;
+  WriteMetrics(&writer);
+  return writer.Text();
+}
+
+void
+DelayQueue::WriteMetrics(PrometheusWriter* writer) const {
+  if (metrics_) {
+    writer->WriteCounter("delay_queue_tasks_added_total",
+                         "Tasks added to the delay queue",
+                         metrics_->added.Value());
+    writer->WriteCounter("delay_queue_tasks_dispatched_total",
+                         "Tasks handed to the thread pool, counting every "
+                         "run of a periodic task",
+                         metrics_->dispatched.Value());
+    writer->WriteCounter("delay_queue_tasks_completed_total",
+                         "Dispatched tasks that have finished running",
+                         metrics_->completed.Value());
+    writer->WriteCounter("delay_queue_tasks_cancelled_total",
+                         "Tasks cancelled before they were dispatched",
+                         cancelled_tasks_.load());
+    writer->WriteGauge("delay_queue_timer_queue_size",
+                       "Nodes in the timer structure, including cancelled "
+                       "nodes that have not been reclaimed yet",
+                       metrics_->timer_queue_size.load(
+                           std::memory_order_relaxed));
+    writer->WriteHistogram("delay_queue_dispatch_lateness_seconds",
+                           "Time from the start time of a task until it is "
+                           "handed to the thread pool",
+                           metrics_->dispatch_lateness);
+  }
+  if (owned_thread_pool_) {
+    owned_thread_pool_->WriteMetrics(writer);
+  }
+}
+
+bool
+DelayQueue::RescheduleAt(const TaskHandle& handle,
+                         TimerClock::time_point start_time) {
+  auto node(handle.node_);
+  if (node == nullptr) {
+    return false;
+  }
+
+  if (node->state_.load() != TimerNode::kPending) {
+    return false;
+  }
+
+  // Record the new start time and queue the node for the dispatch thread,
+  // unless it is queued already, in which case the dispatch thread will
+  // pick up the latest start time anyway
+  node->requested_start_.store(
+      CoalesceStartTime(start_time, node->slack_).time_since_epoch().count());
+  if (!node->in_intake_.exchange(true)) {
+    node->Acquire();
+    enqueue(node);
+  }
+  return true;
+}
+
+void
+DelayQueue::acquire(std::size_t tasks, std::size_t bytes) {
+  if (worker_thread_pool_->InWorkerThread()) {
+    capacity_->ForceAcquire(tasks, bytes);
+  } else {
+    capacity_->Acquire(tasks, bytes);
+  }
 }
 
 void
 DelayQueue::wait_and_dispatch() {
   while (!terminated_.load()) {
+    if (shutting_down_.load()) {
+      shut_down();
+      return;
+    }
+
+    // Take in the nodes from the producers and dispatch as many as possible
+    drain_intake();
+    dispatch();
+    if (metrics_) {
+      metrics_->timer_queue_size.store(task_queue_->Size(),
+                                       std::memory_order_relaxed);
+    }
+
     auto next_time_point(compute_next_wait_until_time());
-    // If there is a task in the queue, we call WaitUntil from the semaphore
+    // If there is a task in the queue, we call WaitUntil from the waiter
     // This lets this thread to sleep up to next_wait_time before either 
     // woken up by a new task, or when the top task is ready to run
     if (next_time_point.first) {
-      semaphore_.WaitUntil(next_time_point.second);
+      waiter_->WaitUntil(next_time_point.second);
     } else {
-      semaphore_.Wait();
+      waiter_->Wait();
     }
-    
-    // After waking up, dispatch as many as possible
-    dispatch();
   }
 }
 
-std::pair<bool, std::chrono::high_resolution_clock::time_point>
+void
+DelayQueue::shut_down() {
+  auto mode(shutdown_mode_);
+  auto deadline(shutdown_deadline_);
+  ShutdownReport report;
+  report.timed_out = true;
+  while (now() < deadline) {
+    drain_intake();
+    switch (mode) {
+      case ShutdownMode::kDrain:
+        report.dispatched += dispatch();
+        // Cancelled nodes would keep the task queue from running empty
+        if (cancelled_tasks_.load() != reclaimed_tasks_) {
+          reclaimed_tasks_ += task_queue_->Compact();
+        }
+        break;
+      case ShutdownMode::kRunPending:
+        report.dispatched += dispatch(true);
+        break;
+      case ShutdownMode::kDiscard:
+        report.dropped += discard_pending();
+        break;
+    }
+
+    // Done once nothing is left to run before the deadline and the thread
+    // pool is idle. The pool is checked before the intake queue, as a job
+    // adds its tasks before it finishes
+    auto left(!task_queue_->Empty() &&
+              task_queue_->NextWakeupTime() <= deadline);
+    if (!left && worker_thread_pool_->ActiveJobs() == 0) {
+      drain_intake();
+      if (task_queue_->Empty() ||
+          task_queue_->NextWakeupTime() > deadline) {
+        report.timed_out = false;
+        break;
+      }
+      continue;
+    }
+
+    // Wait for the next task to come due or for a new task, and poll the
+    // thread pool in the meantime, which does not report when it goes idle
+    auto wakeup(std::min(deadline, now() + kShutdownPollInterval));
+    if (left) {
+      wakeup = std::min(wakeup, task_queue_->NextWakeupTime());
+    }
+    waiter_->WaitUntil(wakeup);
+  }
+
+  // Whatever is left can only start after the deadline
+  drain_intake();
+  report.dropped += discard_pending() + dropped_jobs_;
+  shutdown_report_ = report;
+  shutdown_done_.Notify();
+}
+
+void
+DelayQueue::drain_intake() {
+  auto node(intake_.PopAll());
+  while (node != nullptr) {
+    auto next(node->intake_next_);
+    // Clear the flag before reading the requested start time, so that a
+    // producer that sets a newer start time after this point queues the
+    // node again
+    node->in_intake_.store(false);
+    TimerClock::time_point start_time(
+        TimerClock::duration(node->requested_start_.load()));
+    auto pending(node->state_.load() == TimerNode::kPending);
+
+    switch (node->location_) {
+      case TimerNode::kUnscheduled:
+        if (metrics_) {
+          metrics_->added.Add(1);
+        }
+        // A new node, its reference goes to the task queue
+        if (pending) {
+          node->start_time_ = start_time;
+          node->location_ = TimerNode::kScheduled;
+          task_queue_->Push(node);
+        } else {
+          // It got cancelled before it ever reached the task queue
+          node->location_ = TimerNode::kRetired;
+          reclaimed_tasks_++;
+          node->Release();
+        }
+        break;
+      case TimerNode::kScheduled:
+        // A rescheduled node. A node that is not pending anymore may have
+        // been compacted away already, so leave it alone
+        if (pending) {
+          task_queue_->Reschedule(node, start_time);
+        }
+        node->Release();
+        break;
+      case TimerNode::kRetired:
+        // A node that was rescheduled while being dispatched
+        node->Release();
+        break;
+      case TimerNode::kInFlight:
+        // A periodic node that is pending again after a run goes back into
+        // the task queue. Otherwise it was rescheduled before the run, or
+        // cancelled during it, and the run itself holds on to the node
+        if (pending) {
+          node->start_time_ = start_time;
+          node->location_ = TimerNode::kScheduled;
+          task_queue_->Push(node);
+        } else {
+          node->Release();
+        }
+        break;
+    }
+    node = next;
+  }
+}
+
+void
+DelayQueue::trace_enqueued(TimerNode* newest, TimerNode* oldest) {
+  auto current_time(now());
+  for (auto node(newest); ; node = node->intake_next_) {
+    if (node->trace_id_ == 0) {
+      node->trace_id_ = tracer_->NewTaskId();
+    }
+    tracer_->Record(node->trace_id_, TraceEvent::kEnqueued, current_time);
+    // A single node may still link to the nodes of an earlier intake pass
+    if (node == oldest) {
+      break;
+    }
+  }
+}
+
+std::pair<bool, TimerClock::time_point>
 DelayQueue::compute_next_wait_until_time() {
-  // Lock the mutex and return the start_time
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (!task_queue_.empty()) {
-    return std::make_pair(true, task_queue_.top().start_time_);
+  if (!task_queue_->Empty()) {
+    return std::make_pair(true, task_queue_->NextWakeupTime());
+  }
+
+  return std::make_pair(false, TimerClock::time_point());
+}
+
+std::size_t
+DelayQueue::dispatch(bool all_pending) {
+  // Keep popping the task on top of the task queue until the start_time is
+  // after now. The clock is read once for the whole pass, as popping a batch
+  // of due tasks takes far less time than the resolution that matters here
+  auto current_time(now());
+  std::size_t dispatched(0);
+  while (auto node = all_pending ? pop_next()
+                                 : task_queue_->PopExpired(current_time)) {
+    if (node->Periodic()) {
+      if (dispatch_periodic(node, current_time)) {
+        dispatched++;
+      }
+      continue;
+    }
+    node->location_ = TimerNode::kRetired;
+    if (node->TryDispatch()) {
+      if (metrics_) {
+        metrics_->dispatched.Add(1);
+        metrics_->dispatch_lateness.Observe(current_time - node->start_time_);
+      }
+      if (tracer_ != nullptr) {
+        tracer_->Record(node->trace_id_, TraceEvent::kDispatched,
+                        current_time, node->start_time_);
+      }
+      if (metrics_ || tracer_ != nullptr || capacity_->Limited()) {
+        // The job runs the task from the node, so that it only holds a few
+        // pointers and fits into a function wrapper without an allocation.
+        // It keeps the room of the task until a worker starts it
+        std::shared_ptr<CapacityLimit> capacity;
+        if (capacity_->Limited()) {
+          capacity = capacity_;
+        }
+        node->Acquire();
+        if (submit(FunctionWrapper(NodeRun(metrics_, tracer_, capacity,
+                                           node)),
+                   node->priority_)) {
+          dispatched++;
+        }
+      } else if (submit(std::move(node->function_wrapper_),
+                        node->priority_)) {
+        dispatched++;
+      }
+    } else {
+      reclaimed_tasks_++;
+    }
+    node->Release();
+  }
+
+  compact_if_needed();
+  return dispatched;
+}
+
+bool
+DelayQueue::submit(FunctionWrapper&& job, TaskPriority priority) {
+  if (!shutting_down_.load()) {
+    worker_thread_pool_->ForceSubmit(std::move(job), priority);
+    return true;
+  }
+  if (worker_thread_pool_->SubmitUntil(std::move(job), priority,
+                                       shutdown_deadline_)) {
+    return true;
+  }
+  // Drop the job here, which breaks the promise of a task, or gives back
+  // the node of an observed or periodic run
+  FunctionWrapper dropped(std::move(job));
+  dropped_jobs_++;
+  return false;
+}
+
+TimerNode*
+DelayQueue::pop_next() {
+  while (!task_queue_->Empty()) {
+    // A timing wheel may only cascade its nodes towards the lowest level on
+    // the way to the next wakeup, so it can take a few rounds
+    auto node(task_queue_->PopExpired(task_queue_->NextWakeupTime()));
+    if (node != nullptr) {
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+std::size_t
+DelayQueue::discard_pending() {
+  std::size_t dropped(0);
+  while (auto node = pop_next()) {
+    node->location_ = TimerNode::kRetired;
+    if (node->TryCancel()) {
+      // Like Cancel(), which breaks the promise of the task
+      capacity_->Release(1, node->footprint_);
+      node->function_wrapper_ = FunctionWrapper();
+      dropped++;
+    } else {
+      reclaimed_tasks_++;
+    }
+    node->Release();
+  }
+  return dropped;
+}
+
+bool
+DelayQueue::dispatch_periodic(TimerNode* node,
+                              TimerClock::time_point current_time) {
+  if (!node->TryRun()) {
+    node->location_ = TimerNode::kRetired;
+    reclaimed_tasks_++;
+    node->Release();
+    return false;
   }
 
-  return std::make_pair(false, std::chrono::high_resolution_clock::time_point());
+  if (metrics_) {
+    metrics_->dispatched.Add(1);
+    metrics_->dispatch_lateness.Observe(current_time - node->start_time_);
+  }
+  if (tracer_ != nullptr) {
+    tracer_->Record(node->trace_id_, TraceEvent::kDispatched, current_time,
+                    node->start_time_);
+  }
+
+  // The reference of the task queue goes to the run
+  node->location_ = TimerNode::kInFlight;
+  running_periodic_tasks_.fetch_add(1);
+  return submit(FunctionWrapper(PeriodicRun(this, node)), node->priority_);
 }
 
 void
-DelayQueue::dispatch() {
-  // Lock the mutex and keep popping the task on top of the task queue until 
-  // the start_time is after now
-  std::lock_guard<std::mutex> lock(mutex_);
-  while (!task_queue_.empty() && task_queue_.top().start_time_ <= now()) {
-    // There is no easy way to move the top item out of the priority queue's 
-    // top element without performing the following const cast. This is mainly
-    // because top() returns a const T&, which cannot bind to T&&. 
-    auto task(std::move(const_cast<Task&>(task_queue_.top())));
-    task_queue_.pop();
-    worker_thread_pool_.Submit(std::move(task.function_wrapper_));
+DelayQueue::run_periodic(TimerNode* node) {
+  // Catch the exception of the task, so that it does not skip the
+  // bookkeeping below, and let the thread pool handle it afterwards
+  std::exception_ptr error;
+  if (tracer_ != nullptr) {
+    tracer_->Record(node->trace_id_, TraceEvent::kStarted, now());
+  }
+  try {
+    node->function_wrapper_();
+  } catch (...) {
+    error = std::current_exception();
   }
+  if (metrics_) {
+    metrics_->completed.Add(1);
+  }
+  // Before the next run is armed, which records its own kEnqueued
+  if (tracer_ != nullptr) {
+    tracer_->Record(node->trace_id_, TraceEvent::kFinished, now());
+  }
+
+  if (terminated_.load() || shutting_down_.load()) {
+    retire_periodic(node);
+  } else {
+    // The dispatch thread does not touch start_time_ while the node is in
+    // flight, so it still holds the start time of this run
+    auto current_time(now());
+    auto start_time(current_time + node->period_);
+    if (!node->fixed_delay_) {
+      start_time = node->start_time_ + node->period_;
+      if (start_time <= current_time) {
+        auto missed((current_time - start_time) / node->period_ + 1);
+        start_time += missed * node->period_;
+      }
+    }
+
+    // Record the start time before the node turns pending, as a concurrent
+    // RescheduleAt() may overwrite it from then on
+    node->requested_start_.store(start_time.time_since_epoch().count());
+    if (!node->TryRearm()) {
+      // Cancelled during the run, this thread owns the function wrapper
+      node->function_wrapper_ = FunctionWrapper();
+      node->Release();
+    } else if (!node->in_intake_.exchange(true)) {
+      enqueue(node);
+    } else {
+      // A RescheduleAt() has queued the node already, with its own reference
+      node->Release();
+    }
+  }
+
+  // The last access to the delay queue, which may be destroyed right after
+  running_periodic_tasks_.fetch_sub(1);
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void
+DelayQueue::retire_periodic(TimerNode* node) {
+  // Give the capacity of the series back, unless a Cancel() during the run
+  // has done so already. Either way this thread owns the function wrapper
+  if (node->TryCancelRunning()) {
+    capacity_->Release(1, node->footprint_);
+  }
+  node->function_wrapper_ = FunctionWrapper();
+  node->Release();
+}
+
+void
+DelayQueue::run_node(const std::shared_ptr<Metrics>& metrics,
+                     TaskTracer* tracer, CapacityLimit* capacity,
+                     TimerNode* node) {
+  if (capacity != nullptr) {
+    capacity->Release(1, node->footprint_);
+  }
+  if (tracer != nullptr) {
+    tracer->Record(node->trace_id_, TraceEvent::kStarted, TimerClock::now());
+  }
+  std::exception_ptr error;
+  try {
+    node->function_wrapper_();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  if (metrics) {
+    metrics->completed.Add(1);
+  }
+  if (tracer != nullptr) {
+    tracer->Record(node->trace_id_, TraceEvent::kFinished,
+                   TimerClock::now());
+  }
+  node->Release();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void
+DelayQueue::compact_if_needed() {
+  // Cancel() counts a node right after cancelling it, so the counter may
+  // briefly lag behind the number of nodes reclaimed
+  auto tombstones(static_cast<int64_t>(cancelled_tasks_.load() -
+                                       reclaimed_tasks_));
+  if (tombstones < static_cast<int64_t>(kCompactionThreshold) ||
+      static_cast<std::size_t>(tombstones) * 2 < task_queue_->Size()) {
+    return;
+  }
+
+  reclaimed_tasks_ += task_queue_->Compact();
 }
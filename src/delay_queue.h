@@ -6,66 +6,678 @@
 
 #include <atomic>
 #include <chrono>
+#include <cstddef>
 #include <functional>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "src/capacity_limit.h"
+#include "src/dispatch_waiter.h"
+#include "src/future.h"
+#include "src/metrics.h"
+#include "src/mpsc_queue.h"
 #include "src/semaphore.h"
+#include "src/task_tracer.h"
+#include "src/thread_affinity.h"
 #include "src/threadpool.h"
+#include "src/timer_queue.h"
 
-class DelayQueue {
-  // A Task class that allows one to pass an arbitrary function that
-  // takes an arbitrary number of parameters. The constructor takes the function
-  // address, followed by a list of arguments that the function will call upon.
-  // To execute the task, one submits its function_wrapper to the thread pool
-  struct Task {
-    // Create a delayed task by specifying the delay duration in milliseconds,
-    // followed by the function pointer and a list of arguments
-    Task(uint64_t delay_milliseconds, FunctionWrapper&& function_wrapper) : 
-        function_wrapper_(std::move(function_wrapper)) {
-      auto now = std::chrono::high_resolution_clock::now();
-      start_time_ = now + std::chrono::milliseconds(delay_milliseconds);
-    }
-
-    bool operator>(const Task& other) const {
-      return start_time_ > other.start_time_;
-    }
-
-    // Indicate the timepoint for this task to start
-    std::chrono::high_resolution_clock::time_point start_time_;
-    // Function wrapper for the task's function
-    FunctionWrapper function_wrapper_;
-  };
+// The structure that a delay queue uses to keep its pending tasks
+enum class TimerBackend {
+  // A binary min-heap, O(log n) per insertion and per expiry
+  kBinaryHeap,
+  // A hierarchical timing wheel, O(1) per insertion and amortized O(1) per
+  // expiry, at the cost of rounding start times up to a tick boundary
+  kTimingWheel
+};
+
+// How a periodic task spaces its runs, see DelayQueue::PostPeriodic()
+enum class PeriodicMode {
+  // Runs start at the first start time plus whole multiples of the period,
+  // so the schedule does not drift however long each run takes
+  kFixedRate,
+  // Each run starts one period after the previous run has finished
+  kFixedDelay
+};
+
+// What DelayQueue::Shutdown() does with the pending tasks
+enum class ShutdownMode {
+  // Keep running tasks as they come due until the deadline, and drop the
+  // tasks that are due after it
+  kDrain,
+  // Run every pending task right away, regardless of its start time
+  kRunPending,
+  // Drop every pending task without running it
+  kDiscard
+};
+
+// The outcome of DelayQueue::Shutdown()
+struct ShutdownReport {
+  // Tasks handed to the thread pool during the shutdown, counting each run
+  // of a periodic task
+  std::size_t dispatched = 0;
+  // Tasks dropped without running, which breaks the promises of their
+  // futures: the pending tasks that the mode or the deadline ruled out, and
+  // the jobs of the delay queue's own thread pool that no worker had
+  // started by the deadline
+  std::size_t dropped = 0;
+  // Jobs still running on the delay queue's own thread pool when the
+  // deadline passed. The destructor waits for them
+  std::size_t running = 0;
+  // Whether the deadline passed before the tasks to run had finished
+  bool timed_out = false;
+};
+
+// Options that configure a delay queue at construction
+struct DelayQueueOptions {
+  TimerBackend timer_backend = TimerBackend::kBinaryHeap;
+  // The resolution of the timing wheel, only used by kTimingWheel
+  TimerClock::duration wheel_tick = std::chrono::milliseconds(1);
+  // Options of the thread pool that runs the tasks, e.g. its size and the
+  // CPUs of its workers, and the handler for the exceptions of posted tasks
+  ThreadPoolOptions thread_pool_options;
+  // Run the tasks on this thread pool instead of a pool of the delay queue's
+  // own, so that several delay queues can share one pool. The pool must
+  // outlive the delay queue, and thread_pool_options is ignored
+  ThreadPool* thread_pool = nullptr;
+  // Pin the dispatch thread to these CPUs, e.g. to keep it off the CPUs of
+  // the workers. Empty leaves it unpinned. Best effort, Linux only
+  CpuSet dispatch_thread_cpus;
+  // Let the dispatch thread sleep on a timerfd with epoll instead of a
+  // semaphore, which wakes it up more precisely for sub-millisecond delays.
+  // Only available on Linux, ignored elsewhere. See TimerfdWaiter
+  bool use_timerfd = false;
+  // Collect metrics of the tasks: how many are added, dispatched and
+  // completed, how late they are dispatched, and the size of the timer
+  // structure. Tasks then run from their node, which costs a reference
+  // count and a clock read per task. See DelayQueue::MetricsText(). The
+  // metrics of the thread pool are set by thread_pool_options
+  bool collect_metrics = false;
+  // Record when each task is enqueued, dispatched, started and finished
+  // into this tracer, together with the start time it was due at. Like
+  // collect_metrics, tasks then run from their node. The tracer must
+  // outlive the delay queue and the jobs that it hands to the thread pool.
+  // nullptr turns tracing off
+  TaskTracer* tracer = nullptr;
+  // The most tasks that may be pending, i.e. added and not started by a
+  // worker nor cancelled yet, which counts the due tasks that wait in the
+  // thread pool. A periodic task stays pending until it is cancelled. Once
+  // the limit is reached, AddTask(), Post() and the like wait for room and
+  // TryAddTask() and TryPost() fail. Like ThreadPool::Submit(), the workers
+  // of the pool do not wait, but go over the limit, as the room may only
+  // come from the jobs queued behind them, and so does ForcePost(). 0 means
+  // no limit.
+  //
+  // The dispatch thread hands due tasks to the thread pool even if it
+  // holds max_queued_jobs jobs, see ThreadPool::ForceSubmit(), so that it
+  // never waits for the workers. The tasks that it hands over still count
+  // here until they start, so the pool queue stays within these limits
+  // plus what other producers queue
+  std::size_t max_pending_tasks = 0;
+  // The most bytes that pending tasks may hold, counting each task's node
+  // and its callable object, but not what the callable points to. Works
+  // like max_pending_tasks, and both limits can be combined. 0 means no
+  // limit
+  std::size_t max_pending_bytes = 0;
+};
 
+// The future returned by DelayQueue::AddTask. It is a std::future that also
+// carries the handle of its pending task, so it can still be stored in a
+// plain std::future when cancellation is not needed
+template <typename T>
+class TaskFuture : public std::future<T> {
  public:
-  DelayQueue() : terminated_(false), 
-      dispatch_thread_(std::thread([this] () { wait_and_dispatch(); })) {
+  TaskFuture() = default;
+  TaskFuture(std::future<T>&& future, TaskHandle handle) :
+      std::future<T>(std::move(future)), handle_(std::move(handle)) {}
+
+  // The handle to pass to DelayQueue::Cancel()
+  const TaskHandle& handle() const {
+    return handle_;
   }
 
+ private:
+  TaskHandle handle_;
+};
+
+// The future returned by DelayQueue::Defer(). Like TaskFuture, it carries
+// the handle of its pending task. Cancelling the task breaks the promise of
+// the future, which then holds a std::future_error
+template <typename T>
+class DeferredFuture : public Future<T> {
+ public:
+  DeferredFuture() = default;
+  DeferredFuture(Future<T>&& future, TaskHandle handle) :
+      Future<T>(std::move(future)), handle_(std::move(handle)) {}
+
+  // The handle to pass to DelayQueue::Cancel()
+  const TaskHandle& handle() const {
+    return handle_;
+  }
+
+ private:
+  TaskHandle handle_;
+};
+
+class DelayQueue {
+ public:
+  explicit DelayQueue(const DelayQueueOptions& options = DelayQueueOptions());
+
   ~DelayQueue();
 
   // Add a task, which is specified by a delay period and a callable object
   // Return a future object so that the caller of this function can wait for
-  // the task and fetch results
+  // the task and fetch results. The future also holds the handle that can
+  // cancel the task. The delay can be given in any std::chrono unit down to
+  // the resolution of TimerClock, e.g. std::chrono::microseconds(250).
+  //
+  // A task that does not need to start exactly on time can pass a {slack}:
+  // it then starts at some point within {slack} after its delay, chosen so
+  // that tasks with overlapping windows start together, which saves wakeups
+  // of the dispatch thread. See CoalesceStartTime().
+  //
+  // Once due, the task waits in the lane of {priority} of the thread pool,
+  // so that e.g. latency-critical timeouts do not queue behind bulk jobs
+  // that are due at the same time. See ThreadPoolOptions::starvation_limit.
+  //
+  // If the delay queue is full, see DelayQueueOptions::max_pending_tasks,
+  // this waits for room first, and the delay counts from then on
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type> 
+      AddTask(TimerClock::duration delay, Function function,
+              TimerClock::duration slack = TimerClock::duration::zero(),
+              TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(task_footprint<Function>());
+    acquire(1, footprint);
+    return add_task(now() + delay, slack, priority, footprint,
+                    std::move(function));
+  }
+
+  // Same as above, with the delay in milliseconds
   template <typename Function>
-  std::future<typename std::result_of<Function()>::type> 
-      AddTask(uint64_t delay_milliseconds, Function function) {
+  TaskFuture<typename std::result_of<Function()>::type> 
+      AddTask(uint64_t delay_milliseconds, Function function,
+              TimerClock::duration slack = TimerClock::duration::zero(),
+              TaskPriority priority = TaskPriority::kNormal) {
+    return AddTask(std::chrono::milliseconds(delay_milliseconds),
+                   std::move(function), slack, priority);
+  }
+
+  // Same as above, with an absolute start time instead of a delay. This
+  // saves the clock read for callers that already know the time, e.g. when
+  // a deadline is derived from a timestamp that they have taken anyway. A
+  // start time in the past runs the task right away
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type> 
+      AddTaskAt(TimerClock::time_point start_time, Function function,
+                TimerClock::duration slack = TimerClock::duration::zero(),
+                TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(task_footprint<Function>());
+    acquire(1, footprint);
+    return add_task(start_time, slack, priority, footprint,
+                    std::move(function));
+  }
+
+  // Same as AddTask(), but fail right away instead of waiting if the delay
+  // queue is full. A failed call returns a future that is not valid() and
+  // drops {function}
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type> 
+      TryAddTask(TimerClock::duration delay, Function function,
+                 TimerClock::duration slack = TimerClock::duration::zero(),
+                 TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(task_footprint<Function>());
+    if (!capacity_->TryAcquire(1, footprint)) {
+      return TaskFuture<typename std::result_of<Function()>::type>();
+    }
+    return add_task(now() + delay, slack, priority, footprint,
+                    std::move(function));
+  }
+
+  // Same as above, with the delay in milliseconds
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type> 
+      TryAddTask(uint64_t delay_milliseconds, Function function,
+                 TimerClock::duration slack = TimerClock::duration::zero(),
+                 TaskPriority priority = TaskPriority::kNormal) {
+    return TryAddTask(std::chrono::milliseconds(delay_milliseconds),
+                      std::move(function), slack, priority);
+  }
+
+  // Same as above, but wait up to {timeout} for room before failing
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type> 
+      TryAddTaskFor(TimerClock::duration timeout, TimerClock::duration delay,
+                    Function function,
+                    TimerClock::duration slack = TimerClock::duration::zero(),
+                    TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(task_footprint<Function>());
+    if (!capacity_->AcquireUntil(1, footprint, now() + timeout)) {
+      return TaskFuture<typename std::result_of<Function()>::type>();
+    }
+    return add_task(now() + delay, slack, priority, footprint,
+                    std::move(function));
+  }
+
+  // Add a task whose result nobody waits for. The callable goes into the
+  // timer node as it is, without a packaged_task and a future, so a small
+  // callable costs a single allocation for the node. An exception thrown by
+  // the task goes to the error handler in
+  // DelayQueueOptions::thread_pool_options. Return the handle of the task,
+  // which can be dropped if the task is never cancelled or rescheduled.
+  // {slack} and {priority}, and the wait for room in a full delay queue,
+  // work like for AddTask()
+  template <typename Function>
+  TaskHandle Post(TimerClock::duration delay, Function function,
+                  TimerClock::duration slack = TimerClock::duration::zero(),
+                  TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(post_footprint<Function>());
+    acquire(1, footprint);
+    return schedule(now() + delay, slack, priority, footprint,
+                    FunctionWrapper(std::move(function)));
+  }
+
+  // Same as above, with the delay in milliseconds
+  template <typename Function>
+  TaskHandle Post(uint64_t delay_milliseconds, Function function,
+                  TimerClock::duration slack = TimerClock::duration::zero(),
+                  TaskPriority priority = TaskPriority::kNormal) {
+    return Post(std::chrono::milliseconds(delay_milliseconds),
+                std::move(function), slack, priority);
+  }
+
+  // Same as above, with an absolute start time, see AddTaskAt()
+  template <typename Function>
+  TaskHandle PostAt(TimerClock::time_point start_time, Function function,
+                    TimerClock::duration slack = TimerClock::duration::zero(),
+                    TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(post_footprint<Function>());
+    acquire(1, footprint);
+    return schedule(start_time, slack, priority, footprint,
+                    FunctionWrapper(std::move(function)));
+  }
+
+  // Same as Post(), but never wait for room: the task goes over the limits
+  // of a full delay queue instead, like the jobs of
+  // ThreadPool::ForceSubmit(). This is for callers that must not block,
+  // e.g. the continuations of Future::ThenAfter(), which run on whatever
+  // thread sets the value
+  template <typename Function>
+  TaskHandle ForcePost(TimerClock::duration delay, Function function,
+                       TimerClock::duration slack =
+                           TimerClock::duration::zero(),
+                       TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(post_footprint<Function>());
+    capacity_->ForceAcquire(1, footprint);
+    return schedule(now() + delay, slack, priority, footprint,
+                    FunctionWrapper(std::move(function)));
+  }
+
+  // Same as Post(), but fail right away instead of waiting if the delay
+  // queue is full. A failed call returns a handle that is not Valid() and
+  // drops {function}
+  template <typename Function>
+  TaskHandle TryPost(TimerClock::duration delay, Function function,
+                     TimerClock::duration slack = TimerClock::duration::zero(),
+                     TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(post_footprint<Function>());
+    if (!capacity_->TryAcquire(1, footprint)) {
+      return TaskHandle();
+    }
+    return schedule(now() + delay, slack, priority, footprint,
+                    FunctionWrapper(std::move(function)));
+  }
+
+  // Same as above, with the delay in milliseconds
+  template <typename Function>
+  TaskHandle TryPost(uint64_t delay_milliseconds, Function function,
+                     TimerClock::duration slack = TimerClock::duration::zero(),
+                     TaskPriority priority = TaskPriority::kNormal) {
+    return TryPost(std::chrono::milliseconds(delay_milliseconds),
+                   std::move(function), slack, priority);
+  }
+
+  // Same as above, but wait up to {timeout} for room before failing
+  template <typename Function>
+  TaskHandle TryPostFor(TimerClock::duration timeout,
+                        TimerClock::duration delay, Function function,
+                        TimerClock::duration slack =
+                            TimerClock::duration::zero(),
+                        TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(post_footprint<Function>());
+    if (!capacity_->AcquireUntil(1, footprint, now() + timeout)) {
+      return TaskHandle();
+    }
+    return schedule(now() + delay, slack, priority, footprint,
+                    FunctionWrapper(std::move(function)));
+  }
+
+  // Same as AddTask(), but return a Future instead of a std::future, see
+  // future.h. Continuations chained with Future::Then() run as soon as the
+  // task has finished, on the worker that ran it, without a thread blocking
+  // on the result. Like for Post(), the task is stored in its node without
+  // a packaged_task
+  template <typename Function>
+  DeferredFuture<typename std::result_of<Function()>::type>
+      Defer(TimerClock::duration delay, Function function,
+            TimerClock::duration slack = TimerClock::duration::zero(),
+            TaskPriority priority = TaskPriority::kNormal) {
+    typedef typename std::result_of<Function()>::type result_type;
+    Promise<result_type> promise;
+    auto res(promise.GetFuture());
+    auto handle(Post(delay, deferred_job(std::move(promise),
+                                         std::move(function)),
+                     slack, priority));
+    return DeferredFuture<result_type>(std::move(res), std::move(handle));
+  }
+
+  // Same as above, with an absolute start time, see AddTaskAt()
+  template <typename Function>
+  DeferredFuture<typename std::result_of<Function()>::type>
+      DeferAt(TimerClock::time_point start_time, Function function,
+              TimerClock::duration slack = TimerClock::duration::zero(),
+              TaskPriority priority = TaskPriority::kNormal) {
+    typedef typename std::result_of<Function()>::type result_type;
+    Promise<result_type> promise;
+    auto res(promise.GetFuture());
+    auto handle(PostAt(start_time, deferred_job(std::move(promise),
+                                                std::move(function)),
+                       slack, priority));
+    return DeferredFuture<result_type>(std::move(res), std::move(handle));
+  }
+
+  // Add a task that runs every {period}, the first time after
+  // {initial_delay}, until it is cancelled. Like Post(), there is no future
+  // and exceptions go to the error handler, which does not stop the series.
+  // The task keeps a single node and function wrapper for all of its runs,
+  // so a run costs no allocation. Runs of a task never overlap: the next run
+  // is armed when a run has finished. With kFixedRate, the start times that
+  // have passed by then are skipped rather than run late one after another,
+  // so a task that falls behind catches up with a single run.
+  //
+  // Cancel(handle) stops the series, but a run that has already started
+  // completes. Reschedule(handle, ...) moves the next run while the task
+  // waits for it, and a fixed-rate task then keeps its period from there on.
+  // {period} must be positive. {priority}, and the wait for room in a full
+  // delay queue, work like for AddTask()
+  template <typename Function>
+  TaskHandle PostPeriodic(TimerClock::duration initial_delay,
+                          TimerClock::duration period, Function function,
+                          PeriodicMode mode = PeriodicMode::kFixedRate,
+                          TaskPriority priority = TaskPriority::kNormal) {
+    auto footprint(post_footprint<Function>());
+    acquire(1, footprint);
+    auto node(new TimerNode(now() + initial_delay,
+                            FunctionWrapper(std::move(function))));
+    node->footprint_ = footprint;
+    node->period_ = period;
+    node->fixed_delay_ = mode == PeriodicMode::kFixedDelay;
+    node->priority_ = priority;
+    TaskHandle handle(node);
+    node->in_intake_.store(true, std::memory_order_relaxed);
+    enqueue(node);
+    return handle;
+  }
+
+  // Same as above, with the delay and the period in milliseconds
+  template <typename Function>
+  TaskHandle PostPeriodic(uint64_t initial_delay_milliseconds,
+                          uint64_t period_milliseconds, Function function,
+                          PeriodicMode mode = PeriodicMode::kFixedRate,
+                          TaskPriority priority = TaskPriority::kNormal) {
+    return PostPeriodic(std::chrono::milliseconds(initial_delay_milliseconds),
+                        std::chrono::milliseconds(period_milliseconds),
+                        std::move(function), mode, priority);
+  }
+
+  // Add a batch of tasks, each specified by a delay period and a callable
+  // object. The whole batch is stamped with a single clock read and handed
+  // over to the dispatch thread in one step, which wakes it up at most once.
+  // If the delay queue is full, this waits for room for the whole batch.
+  // Return the futures in the order of the tasks
+  template <typename Function>
+  std::vector<TaskFuture<typename std::result_of<Function()>::type>>
+      AddTasks(std::vector<std::pair<uint64_t, Function>> tasks) {
+    typedef typename std::result_of<Function()>::type result_type;
+    std::vector<TaskFuture<result_type>> res;
+    if (tasks.empty()) {
+      return res;
+    }
+    res.reserve(tasks.size());
+    auto footprint(task_footprint<Function>());
+    acquire(tasks.size(), tasks.size() * footprint);
+
+    // Chain the nodes from the newest to the oldest, which is the order in
+    // which the intake queue takes a batch
+    auto current_time(now());
+    TimerNode* newest(nullptr);
+    TimerNode* oldest(nullptr);
+    for (auto& task : tasks) {
+      std::packaged_task<result_type()> packaged_task(std::move(task.second));
+      std::future<result_type> future(packaged_task.get_future());
+      auto node(new TimerNode(
+          current_time + std::chrono::milliseconds(task.first),
+          std::move(packaged_task)));
+      node->footprint_ = footprint;
+      res.emplace_back(std::move(future), TaskHandle(node));
+      node->in_intake_.store(true, std::memory_order_relaxed);
+      node->intake_next_ = newest;
+      newest = node;
+      if (oldest == nullptr) {
+        oldest = node;
+      }
+    }
+
+    enqueue(newest, oldest);
+    return res;
+  }
+
+  // Post a batch of tasks, each specified by an absolute start time and a
+  // callable object, in one step like AddTasks(). This is meant for loading
+  // many tasks at once, e.g. when restoring them from a log. Return the
+  // handles in the order of the tasks
+  template <typename Function>
+  std::vector<TaskHandle> PostTasksAt(
+      std::vector<std::pair<TimerClock::time_point, Function>> tasks,
+      TaskPriority priority = TaskPriority::kNormal) {
+    std::vector<TaskHandle> res;
+    if (tasks.empty()) {
+      return res;
+    }
+    res.reserve(tasks.size());
+    auto footprint(post_footprint<Function>());
+    acquire(tasks.size(), tasks.size() * footprint);
+
+    TimerNode* newest(nullptr);
+    TimerNode* oldest(nullptr);
+    for (auto& task : tasks) {
+      auto node(new TimerNode(task.first,
+                              FunctionWrapper(std::move(task.second))));
+      node->footprint_ = footprint;
+      node->priority_ = priority;
+      res.emplace_back(node);
+      node->in_intake_.store(true, std::memory_order_relaxed);
+      node->intake_next_ = newest;
+      newest = node;
+      if (oldest == nullptr) {
+        oldest = node;
+      }
+    }
+
+    enqueue(newest, oldest);
+    return res;
+  }
+
+  // Cancel a pending task in O(1) without taking the queue lock. The task's
+  // packaged_task is destroyed right away, so the future of a cancelled task
+  // reports std::future_errc::broken_promise, and the callable is freed as
+  // soon as the future is gone too. The remaining node is dropped by the
+  // dispatch thread instead of being dispatched. Return false if the task
+  // has already been dispatched or cancelled. See PostPeriodic() for
+  // cancelling a periodic task
+  bool Cancel(const TaskHandle& handle);
+
+  // Stop the delay queue: handle the pending tasks as {mode} says, wait for
+  // the tasks that run to finish, and return by {deadline} at the latest.
+  // The due tasks are handed to the thread pool as they are dispatched
+  // normally, so they run in parallel on all workers. Tasks that the
+  // running tasks add are handled the same way. Periodic tasks end after
+  // the run that is pending or in flight.
+  //
+  // Once the deadline has passed, the tasks that are still pending are
+  // dropped, and so are the jobs that wait for a worker of the delay
+  // queue's own thread pool. Running jobs cannot be interrupted, they are
+  // only counted. Unlike normal dispatching, which goes over
+  // ThreadPoolOptions::max_queued_jobs, the dispatch thread waits for room
+  // in a full thread pool until the deadline, and drops the tasks that
+  // still do not fit then. Without a deadline that matters, pass
+  // TimerClock::time_point::max().
+  //
+  // A thread pool given by DelayQueueOptions::thread_pool is waited for
+  // until it has no jobs at all, including those of other users, and none
+  // of its jobs are dropped.
+  //
+  // The dispatch thread stops afterwards: tasks added later are never run,
+  // and are dropped when the delay queue is destroyed. Call this at most
+  // once, and not from a task of the delay queue
+  ShutdownReport Shutdown(ShutdownMode mode, TimerClock::time_point deadline);
+
+  // Move the start time of a pending task to {delay} from now,
+  // which can be earlier or later than its current start time. The task
+  // keeps its node and its function wrapper, only its position in the timer
+  // structure changes. This is meant for timers that are pushed back over
+  // and over, e.g. idle timeouts. Return false if the task has already been
+  // dispatched or cancelled. A task that is dispatched concurrently with
+  // this call runs at its old start time. The task keeps the slack it was
+  // added with. A periodic task can only be rescheduled between its runs
+  bool Reschedule(const TaskHandle& handle, TimerClock::duration delay) {
+    return RescheduleAt(handle, now() + delay);
+  }
+
+  // Same as above, with the delay in milliseconds
+  bool Reschedule(const TaskHandle& handle, uint64_t delay_milliseconds) {
+    return Reschedule(handle, std::chrono::milliseconds(delay_milliseconds));
+  }
+
+  // Same as above, with an absolute start time, see AddTaskAt()
+  bool RescheduleAt(const TaskHandle& handle,
+                    TimerClock::time_point start_time);
+
+  // The metrics of the delay queue, followed by the metrics of its own
+  // thread pool, in the Prometheus text format. Empty unless
+  // DelayQueueOptions::collect_metrics or
+  // thread_pool_options.collect_metrics is set
+  std::string MetricsText() const;
+
+  // Same as above, but add the metrics to {writer}
+  void WriteMetrics(PrometheusWriter* writer) const;
+
+ private:
+  // See DelayQueueOptions::collect_metrics
+  struct Metrics {
+    Metrics() : timer_queue_size(0) {}
+
+    Counter added;
+    Counter dispatched;
+    Counter completed;
+    Histogram dispatch_lateness;
+    // Only written by the dispatch thread, after every pass
+    std::atomic<std::size_t> timer_queue_size;
+  };
+
+  // The bytes that DelayQueueOptions::max_pending_bytes charges for a task:
+  // its node, plus its callable unless the callable is stored inside the
+  // node. The callable of a packaged_task lives in the shared state of its
+  // future, next to the node
+  template <typename Function>
+  static std::size_t task_footprint() {
+    return sizeof(TimerNode) + sizeof(Function);
+  }
+  template <typename Function>
+  static std::size_t post_footprint() {
+    return sizeof(TimerNode) +
+           (FunctionWrapper::StoredInline<Function>() ? 0 : sizeof(Function));
+  }
+
+  // Wrap {function} into a packaged_task, and schedule it like below. Return
+  // the future of the packaged_task together with the handle of the task
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type>
+      add_task(TimerClock::time_point start_time, TimerClock::duration slack,
+               TaskPriority priority, std::size_t footprint,
+               Function function) {
     // Create a packaged_task and prepare the future object that a user gets
     // to use, and to wait for this task
     typedef typename std::result_of<Function()>::type result_type;
     std::packaged_task<result_type()> task(std::move(function));
     std::future<result_type> res(task.get_future());
 
-    // Lock the task queue and insert a task underneath
-    std::unique_lock<std::mutex> lock(mutex_);
-    task_queue_.emplace(delay_milliseconds, std::move(task)); 
+    auto handle(schedule(start_time, slack, priority, footprint,
+                         std::move(task)));
+    return TaskFuture<result_type>(std::move(res), std::move(handle));
+  }
 
-    // Notify the dispatch thread as a new task is created
-    semaphore_.Notify();
-    return res;
+  // The job of Defer(), which fulfills {promise} with the result of
+  // {function}. A job that is dropped without running breaks the promise
+  template <typename R, typename Function>
+  static auto deferred_job(Promise<R>&& promise, Function function) {
+    return [promise = std::move(promise),
+            function = std::move(function)] () mutable {
+      FulfillPromise<R>::Run(promise, std::move(function));
+    };
   }
-  
- private:
+
+  // Wait until {tasks} and {bytes} fit into capacity_, and take them. A
+  // worker of the thread pool takes them right away instead, as the room
+  // it would wait for may only come from the jobs queued behind it
+  void acquire(std::size_t tasks, std::size_t bytes);
+
+  // Create the node of a task that starts at {start_time}, or within {slack}
+  // after it, and runs from the lane of {priority}. {footprint} is what the
+  // task has taken from capacity_. Hand it over to the dispatch thread,
+  // which inserts it into the task queue
+  TaskHandle schedule(TimerClock::time_point start_time,
+                      TimerClock::duration slack, TaskPriority priority,
+                      std::size_t footprint,
+                      FunctionWrapper&& function_wrapper) {
+    auto node(new TimerNode(CoalesceStartTime(start_time, slack),
+                            std::move(function_wrapper)));
+    node->slack_ = slack;
+    node->priority_ = priority;
+    node->footprint_ = footprint;
+    TaskHandle handle(node);
+    node->in_intake_.store(true, std::memory_order_relaxed);
+    enqueue(node);
+    return handle;
+  }
+
+  // Push a node into the intake queue, and wake up the dispatch thread if
+  // the intake queue was empty. Otherwise an earlier producer has already
+  // woken it up, and it has not taken the intake queue yet
+  void enqueue(TimerNode* node) {
+    enqueue(node, node);
+  }
+
+  // Same as above, for a chain of nodes linked from the newest to the oldest
+  void enqueue(TimerNode* newest, TimerNode* oldest) {
+    if (tracer_ != nullptr) {
+      trace_enqueued(newest, oldest);
+    }
+    if (intake_.Push(newest, oldest)) {
+      waiter_->Notify();
+    }
+  }
+
+  // Record the kEnqueued events of a chain of nodes that is about to be
+  // pushed into the intake queue, giving new nodes their trace id
+  void trace_enqueued(TimerNode* newest, TimerNode* oldest);
+
+  // Helper function for the dispatch thread to take every node from the
+  // intake queue, and to insert or move each of them in the task queue
+  void drain_intake();
+
   // The dispatching thread runs this function to wait for new tasks to come
   // and to dispatch them when their delay time has elapsed
   void wait_and_dispatch();
@@ -74,39 +686,237 @@ class DelayQueue {
   // again. If the first field is false, it means there is currently no task
   // in the queue, otherwise, the second field represents the time duration
   // between now and the task's start time on top of the queue
-  std::pair<bool, std::chrono::high_resolution_clock::time_point>
-      compute_next_wait_until_time();
+  std::pair<bool, TimerClock::time_point> compute_next_wait_until_time();
 
   // Helper function to dispatch the tasks on top of the queue to the 
   // threadpool as much as possible, as long as the tasks' start_time is 
-  // before now
-  void dispatch();
+  // before now, or every pending task with {all_pending}. Return the number
+  // of dispatched tasks
+  std::size_t dispatch(bool all_pending = false);
+
+  // Hand the job of a due task to the thread pool. This never waits for
+  // room in the pool, see ThreadPool::ForceSubmit(), except during
+  // Shutdown(), which keeps to the limit of the pool until its deadline.
+  // A job that is not queued by then is dropped and counted in
+  // dropped_jobs_. Return whether the job was queued
+  bool submit(FunctionWrapper&& job, TaskPriority priority);
+
+  // Pop the node with the earliest start time from the task queue, however
+  // far ahead that is. Return nullptr once the task queue is empty
+  TimerNode* pop_next();
+
+  // Drop every node in the task queue, cancelling the pending ones. Return
+  // the number of tasks that were pending
+  std::size_t discard_pending();
+
+  // The dispatch thread runs this instead of wait_and_dispatch() once
+  // Shutdown() has been called, until the tasks are handled or the
+  // deadline has passed, and then hands the report over to Shutdown()
+  void shut_down();
+
+  // Helper function for the dispatch thread to hand a due periodic node to
+  // the thread pool, which runs it with run_periodic(). {current_time} is
+  // the time of the dispatch pass. Return false if the node was cancelled,
+  // or if its run was dropped, see submit()
+  bool dispatch_periodic(TimerNode* node,
+                         TimerClock::time_point current_time);
+
+  // Run a periodic node on a worker thread, and arm its next run by queueing
+  // the node again, unless it got cancelled during the run
+  void run_periodic(TimerNode* node);
+
+  // End the series of a periodic node that is in flight without arming
+  // another run, and drop the reference of the run
+  void retire_periodic(TimerNode* node);
+
+  // The job that runs a periodic node, see dispatch_periodic(). It holds
+  // the reference of the run, and retires the node if the thread pool drops
+  // the job without running it. Only two pointers, so it fits into a
+  // function wrapper without an allocation
+  struct PeriodicRun {
+    PeriodicRun(DelayQueue* queue, TimerNode* node) :
+        queue(queue), node(node) {}
+    PeriodicRun(PeriodicRun&& other) noexcept :
+        queue(other.queue), node(other.node) {
+      other.node = nullptr;
+    }
+    ~PeriodicRun() {
+      if (node != nullptr) {
+        queue->retire_periodic(node);
+        queue->running_periodic_tasks_.fetch_sub(1);
+      }
+    }
+
+    void operator() () {
+      auto run(node);
+      node = nullptr;
+      queue->run_periodic(run);
+    }
+
+    DelayQueue* queue;
+    TimerNode* node;
+  };
+
+  // Run a dispatched node on a worker thread, count it as completed, trace
+  // its start and finish and drop its reference. Only used with metrics,
+  // tracing or capacity limits. A node with {capacity} gives its room back
+  // as it starts, so that the tasks queued in the thread pool count against
+  // the limits of the delay queue until a worker takes them. The job shares
+  // the metrics and the capacity and takes the tracer along, as the delay
+  // queue may be gone by the time a job on a shared pool runs
+  static void run_node(const std::shared_ptr<Metrics>& metrics,
+                       TaskTracer* tracer, CapacityLimit* capacity,
+                       TimerNode* node);
+
+  // The job of run_node(). It holds a reference to the node, which it drops
+  // whether or not the job runs, and gives the room of the task back either
+  // way. Fits into a function wrapper without an allocation
+  struct NodeRun {
+    NodeRun(const std::shared_ptr<Metrics>& metrics, TaskTracer* tracer,
+            const std::shared_ptr<CapacityLimit>& capacity, TimerNode* node) :
+        metrics(metrics), tracer(tracer), capacity(capacity), node(node) {}
+    NodeRun(NodeRun&& other) noexcept :
+        metrics(std::move(other.metrics)), tracer(other.tracer),
+        capacity(std::move(other.capacity)), node(other.node) {
+      other.node = nullptr;
+    }
+    ~NodeRun() {
+      if (node != nullptr) {
+        // Dropped unrun, which breaks the promise of the task like Cancel()
+        if (capacity) {
+          capacity->Release(1, node->footprint_);
+        }
+        node->function_wrapper_ = FunctionWrapper();
+        node->Release();
+      }
+    }
+
+    void operator() () {
+      auto run(node);
+      node = nullptr;
+      run_node(metrics, tracer, capacity.get(), run);
+    }
+
+    std::shared_ptr<Metrics> metrics;
+    TaskTracer* tracer;
+    // nullptr unless the delay queue has capacity limits
+    std::shared_ptr<CapacityLimit> capacity;
+    TimerNode* node;
+  };
+
+  // Helper function to drop the cancelled nodes from the task queue once they
+  // make up most of it, which keeps the cost amortized O(1) per cancellation
+  void compact_if_needed();
 
   // Just an alias of computing now timepoint
-  std::chrono::high_resolution_clock::time_point now() const {
-    return std::chrono::high_resolution_clock::now();
+  TimerClock::time_point now() const {
+    return TimerClock::now();
   }
 
-  // A mutex to protect the whole delay queue
-  std::mutex mutex_;
-  // A semaphore used by the delay queue to synchronize task insertion
-  Semaphore semaphore_;
+  // What the dispatch thread sleeps on, and what producers wake it up with
+  std::unique_ptr<DispatchWaiter> waiter_;
+
+  // The lock-free queue through which producers hand new and rescheduled
+  // nodes over to the dispatch thread. Each node in it owns one reference
+  MpscQueue<TimerNode, &TimerNode::intake_next_> intake_;
+
+  // The timer structure that is used for delay queue, which hands out the
+  // task that is assigned for the nearest future, i.e. the minimal
+  // start_time. Only the dispatch thread touches it, so it needs no lock
+  std::unique_ptr<TimerQueue> task_queue_;
 
-  // A priority queue that is used for delay queue, and the top task in the
-  // priority queue is the task that is assigned for the nearest future, i.e.
-  // the minimal start_time
-  std::priority_queue<Task, std::vector<Task>, std::greater<Task>> task_queue_;
+  // Cancelled nodes are counted by Cancel() and reclaimed by the dispatch
+  // thread. The difference is the number of cancelled nodes that are still
+  // in the task queue. reclaimed_tasks_ is only used by the dispatch thread
+  std::atomic<uint64_t> cancelled_tasks_;
+  uint64_t reclaimed_tasks_;
+
+  // The budget of DelayQueueOptions::max_pending_tasks and
+  // max_pending_bytes. A task takes from it when it is added, and gives back
+  // when a worker starts it, or when it is cancelled or dropped. Shared with
+  // the jobs in the thread pool, see NodeRun
+  const std::shared_ptr<CapacityLimit> capacity_;
 
   // A flag to indiate whether the delay queue has been terminated
   std::atomic<bool> terminated_;
 
+  // nullptr unless DelayQueueOptions::collect_metrics is set
+  std::shared_ptr<Metrics> metrics_;
+
+  // See DelayQueueOptions::tracer
+  TaskTracer* const tracer_;
+
+  // Number of periodic runs that have been handed to the thread pool and
+  // have not finished yet. Those runs still use the delay queue to arm their
+  // next run, so the destructor waits for them
+  std::atomic<int> running_periodic_tasks_;
+
+  // The state of Shutdown(). The mode and the deadline are written before
+  // shutting_down_ is set, and the report before shutdown_done_ is
+  // notified. shutting_down_ also tells periodic runs not to arm the next
+  std::atomic<bool> shutdown_called_;
+  std::atomic<bool> shutting_down_;
+  ShutdownMode shutdown_mode_;
+  TimerClock::time_point shutdown_deadline_;
+  ShutdownReport shutdown_report_;
+  // Jobs that submit() dropped during Shutdown(). Only used by the dispatch
+  // thread
+  std::size_t dropped_jobs_;
+  Semaphore shutdown_done_;
+
   // The thread that reacts to the addition of tasks and is responsible for 
   // popping the next task at the right time and dispatch to working 
   // thread pool
   std::thread dispatch_thread_;
 
-  // The threadpool that executes the tasks
-  ThreadPool worker_thread_pool_;
+  // The threadpool that executes the tasks, which is either owned by the
+  // delay queue or given by DelayQueueOptions::thread_pool
+  std::unique_ptr<ThreadPool> owned_thread_pool_;
+  ThreadPool* worker_thread_pool_;
+};
+
+#ifdef DELAY_QUEUE_COROUTINES
+// Awaited by a coroutine to sleep until {start_time}, see SleepFor()
+struct SleepAwaiter {
+  bool await_ready() const noexcept {
+    return start_time <= TimerClock::now();
+  }
+  void await_suspend(std::coroutine_handle<> coroutine) {
+    queue->PostAt(start_time, ResumeCoroutine{coroutine}, slack, priority);
+  }
+  void await_resume() const noexcept {}
+
+  DelayQueue* queue;
+  TimerClock::time_point start_time;
+  TimerClock::duration slack;
+  TaskPriority priority;
 };
 
+// co_await SleepFor(delay_queue, delay) suspends the calling coroutine, and
+// resumes it on a worker of the thread pool of {delay_queue} once {delay}
+// has passed. The coroutine goes into the timer structure like a task of
+// DelayQueue::Post(), which costs the node and no packaged_task or future,
+// and no thread waits for it meanwhile. A delay that has already passed
+// continues right away on the calling thread. {slack} and {priority}, and
+// the wait for room in a full delay queue, work like for
+// DelayQueue::AddTask(). A coroutine that is still asleep when the delay
+// queue is destroyed is neither resumed nor destroyed. Only available with
+// C++20 coroutines, see awaitable.h
+inline SleepAwaiter SleepFor(
+    DelayQueue& delay_queue, TimerClock::duration delay,
+    TimerClock::duration slack = TimerClock::duration::zero(),
+    TaskPriority priority = TaskPriority::kNormal) {
+  return SleepAwaiter{&delay_queue, TimerClock::now() + delay, slack,
+                      priority};
+}
+
+// Same as above, with an absolute start time, see DelayQueue::AddTaskAt()
+inline SleepAwaiter SleepUntil(
+    DelayQueue& delay_queue, TimerClock::time_point start_time,
+    TimerClock::duration slack = TimerClock::duration::zero(),
+    TaskPriority priority = TaskPriority::kNormal) {
+  return SleepAwaiter{&delay_queue, start_time, slack, priority};
+}
+#endif
+
 #endif // DELAY_QUEUE_H_
@@ -0,0 +1,109 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/dispatch_waiter.h"
+
+#include <cerrno>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+std::unique_ptr<TimerfdWaiter> TimerfdWaiter::Create() {
+  auto epoll_fd(epoll_create1(EPOLL_CLOEXEC));
+  auto timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  auto event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+  auto registered(epoll_fd >= 0 && timer_fd >= 0 && event_fd >= 0);
+  for (auto fd : {timer_fd, event_fd}) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    registered = registered &&
+                 epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+  }
+  if (!registered) {
+    for (auto fd : {epoll_fd, timer_fd, event_fd}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return nullptr;
+  }
+
+  return std::unique_ptr<TimerfdWaiter>(
+      new TimerfdWaiter(epoll_fd, timer_fd, event_fd));
+}
+
+TimerfdWaiter::~TimerfdWaiter() {
+  close(epoll_fd_);
+  close(timer_fd_);
+  close(event_fd_);
+}
+
+void TimerfdWaiter::Notify() {
+  uint64_t one(1);
+  auto written(write(event_fd_, &one, sizeof(one)));
+  (void)written;
+}
+
+void TimerfdWaiter::Wait() {
+  // Disarm the timer, so that a deadline of an earlier wait does not wake
+  // up the dispatch thread for nothing
+  itimerspec disarmed = {};
+  timerfd_settime(timer_fd_, 0, &disarmed, nullptr);
+  Poll();
+}
+
+void TimerfdWaiter::WaitUntil(TimerClock::time_point deadline) {
+  // TimerClock is std::chrono::steady_clock, which reads CLOCK_MONOTONIC on
+  // Linux, so the deadline arms the timer as an absolute time as it is
+  auto expiry(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      deadline.time_since_epoch()).count());
+  if (expiry <= 0) {
+    return;
+  }
+
+  itimerspec timer = {};
+  timer.it_value.tv_sec = expiry / 1000000000;
+  timer.it_value.tv_nsec = expiry % 1000000000;
+  timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &timer, nullptr);
+  Poll();
+}
+
+void TimerfdWaiter::Poll() {
+  epoll_event events[2];
+  while (epoll_wait(epoll_fd_, events, 2, -1) < 0 && errno == EINTR) {
+    // Interrupted by a signal, go back to sleep
+  }
+
+  // Both file descriptors are non-blocking, so reading one that did not
+  // fire simply fails
+  uint64_t count;
+  auto read_count(read(timer_fd_, &count, sizeof(count)));
+  read_count = read(event_fd_, &count, sizeof(count));
+  (void)read_count;
+}
+
+#else
+
+std::unique_ptr<TimerfdWaiter> TimerfdWaiter::Create() {
+  return nullptr;
+}
+
+TimerfdWaiter::~TimerfdWaiter() {}
+
+void TimerfdWaiter::Notify() {}
+
+void TimerfdWaiter::Wait() {}
+
+void TimerfdWaiter::WaitUntil(TimerClock::time_point) {}
+
+#endif
@@ -0,0 +1,83 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef DISPATCH_WAITER_H_
+#define DISPATCH_WAITER_H_
+
+#include <chrono>
+#include <memory>
+#include <type_traits>
+
+#include "src/semaphore.h"
+#include "src/timer_queue.h"
+
+// How the dispatch thread of a delay queue sleeps until its next task is due
+// or until a producer wakes it up. Wakeups may be spurious and may be merged,
+// as the dispatch thread always looks at the whole intake queue and at the
+// whole timer structure after waking up
+class DispatchWaiter {
+ public:
+  virtual ~DispatchWaiter() {}
+
+  // Wake up the dispatch thread, or make its next wait return right away
+  virtual void Notify() = 0;
+
+  // Sleep until Notify() is called
+  virtual void Wait() = 0;
+
+  // Sleep until Notify() is called or until {deadline}
+  virtual void WaitUntil(TimerClock::time_point deadline) = 0;
+};
+
+// The default waiter, which sleeps on a Semaphore
+class SemaphoreWaiter : public DispatchWaiter {
+ public:
+  void Notify() override {
+    semaphore_.Notify();
+  }
+
+  void Wait() override {
+    semaphore_.Wait();
+  }
+
+  void WaitUntil(TimerClock::time_point deadline) override {
+    semaphore_.WaitUntil(deadline);
+  }
+
+ private:
+  Semaphore semaphore_;
+};
+
+// A waiter for Linux that sleeps in epoll on a timerfd, armed with the
+// absolute CLOCK_MONOTONIC deadline, and on an eventfd that producers write
+// to. The kernel fires a timerfd from a high resolution timer, so the
+// dispatch thread wakes up closer to the deadline than from a futex or a
+// condition variable timeout, which the kernel may round up with timer slack
+class TimerfdWaiter : public DispatchWaiter {
+  static_assert(std::is_same<TimerClock, std::chrono::steady_clock>::value,
+                "TimerfdWaiter arms CLOCK_MONOTONIC with TimerClock times");
+
+ public:
+  // Return nullptr if timerfd is not supported or the file descriptors
+  // cannot be created
+  static std::unique_ptr<TimerfdWaiter> Create();
+
+  ~TimerfdWaiter() override;
+
+  void Notify() override;
+  void Wait() override;
+  void WaitUntil(TimerClock::time_point deadline) override;
+
+ private:
+  TimerfdWaiter(int epoll_fd, int timer_fd, int event_fd) :
+      epoll_fd_(epoll_fd), timer_fd_(timer_fd), event_fd_(event_fd) {}
+
+  // Sleep in epoll until either file descriptor is readable, then reset both
+  void Poll();
+
+  int epoll_fd_;
+  int timer_fd_;
+  int event_fd_;
+};
+
+#endif // DISPATCH_WAITER_H_
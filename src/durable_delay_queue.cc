@@ -0,0 +1,280 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/durable_delay_queue.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Replayed tasks are handed over to the delay queue in batches of this size,
+// which saves a wakeup of the dispatch thread per task
+const std::size_t kReplayBatch = 4096;
+
+// The delay queue options of a durable delay queue, whose tasks must not
+// outlive it on a shared pool. Tasks are posted under the lock of the index,
+// which must not wait for room in the delay queue, so the delay queue is
+// unbounded; the log and the index hold every pending task anyway
+DelayQueueOptions InnerDelayQueueOptions(DelayQueueOptions options) {
+  options.thread_pool = nullptr;
+  options.max_pending_tasks = 0;
+  options.max_pending_bytes = 0;
+  return options;
+}
+
+int64_t ToDeadline(std::chrono::system_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      time.time_since_epoch()).count();
+}
+
+// The time on TimerClock minus the time on the system clock, to convert
+// deadlines to start times
+std::chrono::nanoseconds ClockOffset() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      TimerClock::now().time_since_epoch() -
+      std::chrono::system_clock::now().time_since_epoch());
+}
+
+TimerClock::time_point ToStartTime(int64_t deadline,
+                                   std::chrono::nanoseconds clock_offset) {
+  return TimerClock::time_point(std::chrono::duration_cast<
+      TimerClock::duration>(std::chrono::nanoseconds(deadline) +
+                            clock_offset));
+}
+
+// The bytes that a pending task with {payload} takes in a compacted log
+std::size_t LoggedSize(const std::string& payload) {
+  return TaskLog::RecordSize(LogRecord{LogRecord::kInsert, 0, 0, 0,
+                                       payload.data(), payload.size()});
+}
+
+}  // namespace
+
+std::unique_ptr<DurableDelayQueue>
+DurableDelayQueue::Open(const DurableDelayQueueOptions& options,
+                        std::unordered_map<uint32_t, Handler> handlers) {
+  std::unique_ptr<DurableDelayQueue> queue(
+      new DurableDelayQueue(options, std::move(handlers)));
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex_);
+    auto& tasks(queue->tasks_);
+    auto& live_bytes(queue->live_bytes_);
+    auto& next_task_id(queue->next_task_id_);
+    queue->log_ = TaskLog::Open(options.directory, options.segment_bytes,
+                                options.sync, [&] (const LogRecord& record) {
+      next_task_id = std::max(next_task_id, record.task_id + 1);
+      auto it(tasks.find(record.task_id));
+      if (it != tasks.end()) {
+        // A record that was replayed twice, as compaction crashed before it
+        // could delete the older segments
+        live_bytes -= LoggedSize(it->second.payload);
+        tasks.erase(it);
+      }
+      if (record.type == LogRecord::kInsert) {
+        Task task{record.handler_id, record.deadline,
+                  std::string(record.payload, record.payload_size),
+                  TaskHandle()};
+        tasks.emplace(record.task_id, std::move(task));
+        live_bytes += TaskLog::RecordSize(record);
+      }
+    });
+    if (queue->log_ == nullptr) {
+      return nullptr;
+    }
+    queue->PostReplayed();
+  }
+
+  queue->MaybeCompact();
+  auto raw_queue(queue.get());
+  queue->delay_queue_.PostPeriodic(options.compaction_interval,
+      options.compaction_interval,
+      [raw_queue] () { raw_queue->MaybeCompact(); },
+      PeriodicMode::kFixedDelay, TaskPriority::kLow);
+  return queue;
+}
+
+DurableDelayQueue::DurableDelayQueue(
+    const DurableDelayQueueOptions& options,
+    std::unordered_map<uint32_t, Handler> handlers) :
+    options_(options), handlers_(std::move(handlers)), next_task_id_(1),
+    live_bytes_(0),
+    delay_queue_(InnerDelayQueueOptions(options.delay_queue_options)) {}
+
+DurableDelayQueue::~DurableDelayQueue() {
+  // The delay queue is destroyed first and joins the running tasks. Tasks
+  // that have not run stay in the log for the next open
+}
+
+uint64_t
+DurableDelayQueue::Schedule(uint32_t handler_id, TimerClock::duration delay,
+                            std::string payload) {
+  return ScheduleAt(handler_id, std::chrono::system_clock::now() +
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(delay),
+      std::move(payload));
+}
+
+uint64_t
+DurableDelayQueue::ScheduleAt(uint32_t handler_id,
+                              std::chrono::system_clock::time_point deadline,
+                              std::string payload) {
+  if (handlers_.find(handler_id) == handlers_.end()) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto task_id(next_task_id_);
+  LogRecord record{LogRecord::kInsert, task_id, handler_id,
+                   ToDeadline(deadline), payload.data(), payload.size()};
+  if (!log_->Append(record)) {
+    return 0;
+  }
+  next_task_id_++;
+  live_bytes_ += TaskLog::RecordSize(record);
+  auto& task(tasks_[task_id]);
+  task.handler_id = handler_id;
+  task.deadline = record.deadline;
+  task.payload = std::move(payload);
+  Post(task_id, &task);
+  return task_id;
+}
+
+bool
+DurableDelayQueue::Cancel(uint64_t task_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it(tasks_.find(task_id));
+  if (it == tasks_.end()) {
+    return false;
+  }
+  // A task of an unknown handler was never added to the delay queue
+  if (it->second.handle.Valid() && !delay_queue_.Cancel(it->second.handle)) {
+    return false;
+  }
+  RemoveLocked(it);
+  return true;
+}
+
+bool
+DurableDelayQueue::Compact() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return CompactLocked();
+}
+
+std::size_t
+DurableDelayQueue::PendingTasks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tasks_.size();
+}
+
+std::size_t
+DurableDelayQueue::LogBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return log_->Bytes();
+}
+
+void
+DurableDelayQueue::Post(uint64_t task_id, Task* task) {
+  if (handlers_.find(task->handler_id) == handlers_.end()) {
+    return;
+  }
+  task->handle = delay_queue_.PostAt(
+      ToStartTime(task->deadline, ClockOffset()), RunTask{this, task_id});
+}
+
+void
+DurableDelayQueue::PostReplayed() {
+  auto clock_offset(ClockOffset());
+  std::vector<std::pair<TimerClock::time_point, RunTask>> batch;
+  std::vector<Task*> batch_tasks;
+  auto post_batch = [&] () {
+    auto handles(delay_queue_.PostTasksAt(std::move(batch)));
+    for (std::size_t i = 0; i < handles.size(); i++) {
+      batch_tasks[i]->handle = std::move(handles[i]);
+    }
+    batch.clear();
+    batch_tasks.clear();
+  };
+
+  for (auto& task : tasks_) {
+    if (handlers_.find(task.second.handler_id) == handlers_.end()) {
+      continue;
+    }
+    batch.emplace_back(ToStartTime(task.second.deadline, clock_offset),
+                       RunTask{this, task.first});
+    batch_tasks.push_back(&task.second);
+    if (batch.size() == kReplayBatch) {
+      post_batch();
+    }
+  }
+  post_batch();
+}
+
+void
+DurableDelayQueue::Run(uint64_t task_id) {
+  const Handler* handler;
+  const std::string* payload;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it(tasks_.find(task_id));
+    if (it == tasks_.end()) {
+      return;
+    }
+    handler = &handlers_.at(it->second.handler_id);
+    // Only Run() removes a task that has been dispatched, and the nodes of
+    // the map stay in place, so the payload can be used without the lock
+    payload = &it->second.payload;
+  }
+
+  try {
+    (*handler)(*payload);
+  } catch (...) {
+    // A handler that throws is done all the same, the exception goes to the
+    // error handler of the thread pool
+    Remove(task_id);
+    throw;
+  }
+  Remove(task_id);
+}
+
+void
+DurableDelayQueue::Remove(uint64_t task_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it(tasks_.find(task_id));
+  if (it != tasks_.end()) {
+    RemoveLocked(it);
+  }
+}
+
+void
+DurableDelayQueue::RemoveLocked(
+    std::unordered_map<uint64_t, Task>::iterator it) {
+  live_bytes_ -= LoggedSize(it->second.payload);
+  // A removal that fails to be logged only makes the task run again after a
+  // restart
+  log_->Append(LogRecord{LogRecord::kRemove, it->first, 0, 0, nullptr, 0});
+  tasks_.erase(it);
+}
+
+void
+DurableDelayQueue::MaybeCompact() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto log_bytes(log_->Bytes());
+  if (log_bytes > options_.segment_bytes &&
+      log_bytes > options_.compaction_ratio * live_bytes_) {
+    CompactLocked();
+  }
+}
+
+bool
+DurableDelayQueue::CompactLocked() {
+  std::vector<LogRecord> records;
+  records.reserve(tasks_.size());
+  for (auto& task : tasks_) {
+    records.push_back(LogRecord{LogRecord::kInsert, task.first,
+        task.second.handler_id, task.second.deadline,
+        task.second.payload.data(), task.second.payload.size()});
+  }
+  return log_->Compact(records);
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef DURABLE_DELAY_QUEUE_H_
+#define DURABLE_DELAY_QUEUE_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "src/delay_queue.h"
+#include "src/task_log.h"
+
+// Options that configure a durable delay queue at open
+struct DurableDelayQueueOptions {
+  // The directory of the task log, created if it does not exist
+  std::string directory;
+  // Start a new segment of the log once the current one reaches this size
+  std::size_t segment_bytes = 64 << 20;
+  // Flush every change to the disk before returning, which survives a power
+  // loss and not only a crash of the process, at the cost of an fdatasync()
+  // per change
+  bool sync = false;
+  // How often to check whether the log needs compacting
+  TimerClock::duration compaction_interval = std::chrono::seconds(10);
+  // Compact the log once it holds more than this many times the bytes of the
+  // tasks that are still pending, and more than one segment's worth
+  double compaction_ratio = 4.0;
+  // Options of the delay queue that runs the tasks. thread_pool is ignored,
+  // the tasks always run on a pool of the durable delay queue's own.
+  // max_pending_tasks and max_pending_bytes are ignored too: tasks are
+  // posted under the lock of the index, where waiting for room would stall
+  // every other call, and Open() has to schedule all replayed tasks
+  DelayQueueOptions delay_queue_options;
+};
+
+// A delay queue whose pending tasks survive a restart of the process. As a
+// callable object cannot be written to the disk, a task is given by the id of
+// a handler, which is registered when the queue is opened, and a payload of
+// bytes that is passed to the handler.
+//
+// Every scheduled task is appended to a TaskLog before it is added to the
+// delay queue, and its removal is appended once its handler has returned or
+// it has been cancelled. Opening the queue replays the log and schedules the
+// pending tasks again, at their original deadlines; the tasks that became
+// due while the process was down run right away. A task whose handler was
+// running during a crash runs again after the restart, so handlers are
+// expected to be idempotent. The log is compacted periodically in the
+// background, see DurableDelayQueueOptions::compaction_ratio.
+//
+// Deadlines are kept in the system clock, so that they keep their meaning
+// across restarts. A task that is already pending when its handler id is not
+// registered stays in the log, but does not run until the queue is opened
+// again with that handler.
+//
+// All methods are thread-safe. Changes to the log are serialized by a single
+// lock, which is also held while the log is compacted
+class DurableDelayQueue {
+ public:
+  using Handler = std::function<void(const std::string& payload)>;
+
+  // Open the queue in options.directory, replaying the tasks that are still
+  // pending. Return nullptr if the log cannot be opened
+  static std::unique_ptr<DurableDelayQueue> Open(
+      const DurableDelayQueueOptions& options,
+      std::unordered_map<uint32_t, Handler> handlers);
+
+  ~DurableDelayQueue();
+
+  // Schedule a run of handler {handler_id} with {payload} after {delay}.
+  // Return the id of the task, or 0 if the handler is not registered or the
+  // task could not be written to the log
+  uint64_t Schedule(uint32_t handler_id, TimerClock::duration delay,
+                    std::string payload);
+
+  // Same as above, with an absolute deadline
+  uint64_t ScheduleAt(uint32_t handler_id,
+                      std::chrono::system_clock::time_point deadline,
+                      std::string payload);
+
+  // Cancel a pending task. Return false if the task has already started or
+  // has been cancelled
+  bool Cancel(uint64_t task_id);
+
+  // Compact the log right away. Return false if it could not be written, in
+  // which case the old log is kept
+  bool Compact();
+
+  // The number of tasks that have been scheduled and have neither finished
+  // nor been cancelled
+  std::size_t PendingTasks() const;
+
+  // The bytes in the log on the disk
+  std::size_t LogBytes() const;
+
+  DurableDelayQueue(const DurableDelayQueue&) = delete;
+  DurableDelayQueue& operator= (const DurableDelayQueue&) = delete;
+
+ private:
+  struct Task {
+    uint32_t handler_id;
+    // Nanoseconds of the system clock, like LogRecord::deadline
+    int64_t deadline;
+    std::string payload;
+    TaskHandle handle;
+  };
+
+  // The callable of a task in the delay queue
+  struct RunTask {
+    DurableDelayQueue* queue;
+    uint64_t task_id;
+
+    void operator()() const {
+      queue->Run(task_id);
+    }
+  };
+
+  DurableDelayQueue(const DurableDelayQueueOptions& options,
+                    std::unordered_map<uint32_t, Handler> handlers);
+
+  // Add a task to the delay queue, which must be locked. Tasks of unknown
+  // handlers are left out
+  void Post(uint64_t task_id, Task* task);
+
+  // Add all replayed tasks to the delay queue, which must be locked
+  void PostReplayed();
+
+  // Run the handler of a task that has become due, then remove the task
+  void Run(uint64_t task_id);
+
+  // Remove a task that has finished, which must not be locked
+  void Remove(uint64_t task_id);
+
+  // Remove a task and log its removal, the queue must be locked
+  void RemoveLocked(std::unordered_map<uint64_t, Task>::iterator it);
+
+  // Compact the log if it has grown past the compaction ratio
+  void MaybeCompact();
+
+  // Compact the log, which must be locked
+  bool CompactLocked();
+
+  DurableDelayQueueOptions options_;
+  const std::unordered_map<uint32_t, Handler> handlers_;
+
+  // Guards everything below
+  mutable std::mutex mutex_;
+  std::unique_ptr<TaskLog> log_;
+  std::unordered_map<uint64_t, Task> tasks_;
+  uint64_t next_task_id_;
+  // The bytes that the pending tasks take in a compacted log
+  std::size_t live_bytes_;
+
+  // Declared last, so that its dispatch thread and workers are stopped
+  // before anything that the tasks use goes away
+  DelayQueue delay_queue_;
+};
+
+#endif // DURABLE_DELAY_QUEUE_H_
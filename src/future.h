@@ -0,0 +1,543 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef FUTURE_H_
+#define FUTURE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "src/semaphore.h"
+#include "src/threadpool.h"
+#include "src/timer_queue.h"
+
+template <typename T> class Future;
+template <typename T> class Promise;
+
+// What a Future<void> stores in place of a value
+struct FutureVoid {};
+
+// How a future of T stores its value and passes it on to a continuation
+template <typename T>
+struct FutureTraits {
+  typedef T Stored;
+  template <typename Function>
+  using Result = typename std::result_of<Function(T)>::type;
+
+  template <typename Function>
+  static Result<Function> Call(Function& function, Stored& value) {
+    return function(std::move(value));
+  }
+  static T Take(Stored& value) {
+    return std::move(value);
+  }
+};
+
+template <>
+struct FutureTraits<void> {
+  typedef FutureVoid Stored;
+  template <typename Function>
+  using Result = typename std::result_of<Function()>::type;
+
+  template <typename Function>
+  static Result<Function> Call(Function& function, Stored&) {
+    return function();
+  }
+  static void Take(Stored&) {}
+};
+
+// The state that a Promise shares with its Future: the value or the
+// exception, and the continuation to run once either is set. A single
+// atomic tells whether the state is ready, or whether a continuation waits
+// for it, which replaces the mutex and the condition variable of the
+// shared state of a std::future. The state is reference counted by the
+// promise, the future and the jobs that read the value
+template <typename T>
+class FutureState {
+ public:
+  typedef typename FutureTraits<T>::Stored Stored;
+
+  // The state starts with the reference of its promise
+  FutureState() : has_value_(false), state_(kEmpty), ref_count_(1) {}
+
+  ~FutureState() {
+    if (has_value_) {
+      storage_.value.~Stored();
+    }
+  }
+
+  void Acquire() {
+    ref_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Drop one reference and delete the state once the last one is gone
+  void Release() {
+    if (ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  // Store the value or the exception, then run the continuation if there is
+  // one. Only called once, by the promise
+  template <typename... Args>
+  void SetValue(Args&&... args) {
+    new (&storage_.value) Stored(std::forward<Args>(args)...);
+    has_value_ = true;
+    Complete();
+  }
+  void SetException(std::exception_ptr error) {
+    error_ = error;
+    Complete();
+  }
+
+  // Run {continuation} once the state is ready, right away if it is ready
+  // already. Only one continuation can wait at a time, a second one throws
+  // std::logic_error. The state may be gone when this returns, unless the
+  // caller holds a reference
+  void SetContinuation(FunctionWrapper&& continuation) {
+    // Claim the slot of the continuation before filling it, so that
+    // neither a second continuation nor Complete() can touch it meanwhile
+    int expected(kEmpty);
+    if (!state_.compare_exchange_strong(expected, kClaimed,
+                                        std::memory_order_acq_rel)) {
+      if (expected != kReady) {
+        throw std::logic_error("A continuation already waits on the future");
+      }
+      continuation();
+      return;
+    }
+    continuation_ = std::move(continuation);
+    expected = kClaimed;
+    if (!state_.compare_exchange_strong(expected, kWaiting,
+                                        std::memory_order_acq_rel)) {
+      // Completed in the meantime, which left the continuation to this call
+      FunctionWrapper ready_continuation(std::move(continuation_));
+      ready_continuation();
+    }
+  }
+
+  bool Ready() const {
+    return state_.load(std::memory_order_acquire) == kReady;
+  }
+
+  // Only valid once the state is ready
+  const std::exception_ptr& Error() const {
+    return error_;
+  }
+  Stored& Value() {
+    return storage_.value;
+  }
+
+  FutureState(const FutureState&) = delete;
+  FutureState& operator= (const FutureState&) = delete;
+
+ private:
+  enum {
+    kEmpty,
+    // SetContinuation() is storing the continuation
+    kClaimed,
+    kWaiting,
+    kReady
+  };
+
+  // Turn ready and run the continuation that waits, if any. The
+  // continuation is moved out first, as it may drop the last reference
+  // other than the promise's. A continuation that is still being stored is
+  // run by SetContinuation() instead
+  void Complete() {
+    if (state_.exchange(kReady, std::memory_order_acq_rel) == kWaiting) {
+      FunctionWrapper continuation(std::move(continuation_));
+      continuation();
+    }
+  }
+
+  union Storage {
+    Storage() {}
+    ~Storage() {}
+    Stored value;
+  };
+
+  Storage storage_;
+  bool has_value_;
+  std::exception_ptr error_;
+  FunctionWrapper continuation_;
+  std::atomic<int> state_;
+  std::atomic<int> ref_count_;
+};
+
+// The producing side of a Future. The value is set once with SetValue() or
+// SetException(). A promise that is destroyed before either has been called
+// sets a std::future_error with std::future_errc::broken_promise, like
+// std::promise does
+template <typename T>
+class Promise {
+ public:
+  Promise() : state_(new FutureState<T>()), future_retrieved_(false) {}
+
+  Promise(Promise&& other) noexcept :
+      state_(other.state_), future_retrieved_(other.future_retrieved_) {
+    other.state_ = nullptr;
+  }
+
+  Promise& operator= (Promise&& other) noexcept {
+    if (this != &other) {
+      Abandon();
+      state_ = other.state_;
+      future_retrieved_ = other.future_retrieved_;
+      other.state_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~Promise() {
+    Abandon();
+  }
+
+  // The future of this promise, which can only be taken once
+  Future<T> GetFuture() {
+    future_retrieved_ = true;
+    state_->Acquire();
+    return Future<T>(state_);
+  }
+
+  // Set the value, or nothing for a Promise<void>, and run the continuation
+  // of the future on this thread if it has one
+  template <typename... Args>
+  void SetValue(Args&&... args) {
+    auto state(state_);
+    state_ = nullptr;
+    state->SetValue(std::forward<Args>(args)...);
+    state->Release();
+  }
+
+  // Same as above, with an exception that the future rethrows
+  void SetException(std::exception_ptr error) {
+    auto state(state_);
+    state_ = nullptr;
+    state->SetException(error);
+    state->Release();
+  }
+
+  Promise(const Promise&) = delete;
+  Promise& operator= (const Promise&) = delete;
+
+ private:
+  // Break the promise if its value has not been set
+  void Abandon() {
+    if (state_ == nullptr) {
+      return;
+    }
+    if (future_retrieved_) {
+      SetException(std::make_exception_ptr(
+          std::future_error(std::future_errc::broken_promise)));
+    } else {
+      state_->Release();
+      state_ = nullptr;
+    }
+  }
+
+  FutureState<T>* state_;
+  bool future_retrieved_;
+};
+
+// Fulfill {promise} with the result of {call}, or with the exception that
+// it throws
+template <typename R>
+struct FulfillPromise {
+  template <typename Call>
+  static void Run(Promise<R>& promise, Call call) {
+    try {
+      promise.SetValue(call());
+    } catch (...) {
+      promise.SetException(std::current_exception());
+    }
+  }
+};
+
+template <>
+struct FulfillPromise<void> {
+  template <typename Call>
+  static void Run(Promise<void>& promise, Call call) {
+    try {
+      call();
+      promise.SetValue();
+    } catch (...) {
+      promise.SetException(std::current_exception());
+    }
+  }
+};
+
+// A future whose value can be passed on to a continuation without blocking
+// a thread. A continuation added by Then() runs on the thread that sets the
+// value, or right away if the value is already set; Then(pool, ...) and
+// ThenAfter() hand it to a thread pool or a delay queue instead. Each
+// continuation gets the value and returns a new future of its own result,
+// so continuations can be chained. If a future holds an exception instead,
+// its continuations are skipped and the exception goes on to the futures
+// that they return.
+//
+// A future has a single consumer: Then(), ThenAfter() and Get() take its
+// state, after which it is no longer Valid(). Wait() and Ready() leave it
+// valid. Only Wait() and Get() block
+template <typename T>
+class Future {
+ public:
+  Future() : state_(nullptr) {}
+
+  Future(Future&& other) noexcept : state_(other.state_) {
+    other.state_ = nullptr;
+  }
+
+  Future& operator= (Future&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      state_ = other.state_;
+      other.state_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~Future() {
+    Reset();
+  }
+
+  // Whether this future has a state, i.e. has not been consumed
+  bool Valid() const {
+    return state_ != nullptr;
+  }
+
+  // Whether the value or an exception has been set
+  bool Ready() const {
+    return state_->Ready();
+  }
+
+  // Block until the value or an exception has been set. The waiting thread
+  // sleeps on a semaphore that is only created by this call. Throws
+  // std::logic_error if a callback of OnReady() is still pending, as the
+  // future can only notify one
+  void Wait() const {
+    if (state_->Ready()) {
+      return;
+    }
+    auto ready(std::make_shared<Semaphore>());
+    state_->SetContinuation(FunctionWrapper([ready] () { ready->Notify(); }));
+    ready->Wait();
+  }
+
+  // Wait for the value and return it, or rethrow the exception
+  T Get() {
+    Wait();
+    StateReference state(state_);
+    state_ = nullptr;
+    if (state->Error()) {
+      std::rethrow_exception(state->Error());
+    }
+    return FutureTraits<T>::Take(state->Value());
+  }
+
+  // Call {function} with the value once it is set, on the thread that sets
+  // it, or right away on this thread if it is set already. This is meant
+  // for short continuations, as it holds up the thread that sets the
+  // value. Return the future of the result of {function}
+  template <typename Function>
+  Future<typename FutureTraits<T>::template Result<Function>>
+      Then(Function function) {
+    return Chain(std::move(function), [] (FunctionWrapper&& job) {
+      job();
+    });
+  }
+
+  // Same as above, but run {function} as a job of {pool} in the lane of
+  // {priority}. The pool must outlive the future
+  template <typename Function>
+  Future<typename FutureTraits<T>::template Result<Function>>
+      Then(ThreadPool& pool, Function function,
+           TaskPriority priority = TaskPriority::kNormal) {
+    auto pool_pointer(&pool);
+    return Chain(std::move(function),
+                 [pool_pointer, priority] (FunctionWrapper&& job) {
+      pool_pointer->Post(std::move(job), priority);
+    });
+  }
+
+  // Same as above, but run {function} on {delay_queue}, a DelayQueue, once
+  // {delay} has passed after the value was set. An exception skips the
+  // delay and is passed on right away. The delay queue must outlive the
+  // future. The task goes over the capacity limits of a full delay queue,
+  // see DelayQueue::ForcePost(), as waiting for room would hold up the
+  // thread that sets the value, often a worker of that same delay queue
+  template <typename Queue, typename Function>
+  Future<typename FutureTraits<T>::template Result<Function>>
+      ThenAfter(Queue& delay_queue, TimerClock::duration delay,
+                Function function,
+                TaskPriority priority = TaskPriority::kNormal) {
+    auto queue_pointer(&delay_queue);
+    return Chain(std::move(function),
+                 [queue_pointer, delay, priority] (FunctionWrapper&& job) {
+      queue_pointer->ForcePost(delay, std::move(job),
+                               TimerClock::duration::zero(), priority);
+    });
+  }
+
+  // Call {callback} once the value or an exception has been set, on the
+  // thread that sets it, or right away if it is set already. The future
+  // stays valid, and {callback} may consume it. Only one callback or Wait()
+  // can be pending on a future at a time, which is how WhenAll() and
+  // WhenAny() watch their futures. Another one, or Get(), while {callback}
+  // is pending throws std::logic_error
+  template <typename Callback>
+  void OnReady(Callback callback) {
+    state_->SetContinuation(FunctionWrapper(std::move(callback)));
+  }
+
+  Future(const Future&) = delete;
+  Future& operator= (const Future&) = delete;
+
+ private:
+  friend class Promise<T>;
+
+  struct Releaser {
+    void operator() (FutureState<T>* state) const {
+      state->Release();
+    }
+  };
+  // A reference to a state that is dropped along with the job holding it,
+  // whether or not the job has run
+  typedef std::unique_ptr<FutureState<T>, Releaser> StateReference;
+
+  explicit Future(FutureState<T>* state) : state_(state) {}
+
+  // Add a continuation that hands a job, which calls {function} with the
+  // value, to {schedule}. The job takes over the reference of this future
+  template <typename Function, typename Schedule>
+  Future<typename FutureTraits<T>::template Result<Function>>
+      Chain(Function function, Schedule schedule) {
+    typedef typename FutureTraits<T>::template Result<Function> R;
+    Promise<R> promise;
+    auto res(promise.GetFuture());
+    // The job gets a reference of its own, so that this future stays valid
+    // if SetContinuation() throws
+    state_->Acquire();
+    StateReference state(state_);
+    auto pointer(state.get());
+    pointer->SetContinuation(FunctionWrapper(
+        [promise = std::move(promise), function = std::move(function),
+         schedule, state = std::move(state)] () mutable {
+      if (state->Error()) {
+        promise.SetException(state->Error());
+        return;
+      }
+      schedule(FunctionWrapper([promise = std::move(promise),
+                                function = std::move(function),
+                                state = std::move(state)] () mutable {
+        auto& value(state->Value());
+        FulfillPromise<R>::Run(promise, [&function, &value] () {
+          return FutureTraits<T>::Call(function, value);
+        });
+      }));
+    }));
+    Reset();
+    return res;
+  }
+
+  void Reset() {
+    if (state_ != nullptr) {
+      state_->Release();
+      state_ = nullptr;
+    }
+  }
+
+  FutureState<T>* state_;
+};
+
+// A future that is ready with {value}
+template <typename T>
+Future<typename std::decay<T>::type> MakeReadyFuture(T&& value) {
+  Promise<typename std::decay<T>::type> promise;
+  auto res(promise.GetFuture());
+  promise.SetValue(std::forward<T>(value));
+  return res;
+}
+
+// A future that turns ready once all {futures} are, with those futures,
+// whose values can then be taken with Get() without blocking. Futures that
+// are not valid count as ready
+template <typename T>
+Future<std::vector<Future<T>>> WhenAll(std::vector<Future<T>> futures) {
+  struct All {
+    std::vector<Future<T>> futures;
+    std::atomic<std::size_t> pending;
+    Promise<std::vector<Future<T>>> promise;
+  };
+
+  auto all(std::make_shared<All>());
+  auto res(all->promise.GetFuture());
+  all->futures = std::move(futures);
+  // One more than the futures, so that a future that turns ready while
+  // the callbacks are being added cannot complete early
+  all->pending.store(all->futures.size() + 1);
+  auto arrive([] (const std::shared_ptr<All>& all) {
+    if (all->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      all->promise.SetValue(std::move(all->futures));
+    }
+  });
+  for (auto& future : all->futures) {
+    if (!future.Valid()) {
+      arrive(all);
+      continue;
+    }
+    // The callback keeps the aggregate alive until the future is ready
+    future.OnReady([all, arrive] () {
+      arrive(all);
+    });
+  }
+  arrive(all);
+  return res;
+}
+
+// The first of the futures passed to WhenAny() that turned ready, and its
+// index
+template <typename T>
+struct WhenAnyResult {
+  std::size_t index;
+  Future<T> future;
+};
+
+// A future that turns ready as soon as any of {futures} is, e.g. when a
+// task races against a timeout. The other futures are dropped once they
+// turn ready themselves. {futures} must not be empty, and all of them must
+// be valid
+template <typename T>
+Future<WhenAnyResult<T>> WhenAny(std::vector<Future<T>> futures) {
+  struct Any {
+    std::vector<Future<T>> futures;
+    std::atomic<bool> done;
+    Promise<WhenAnyResult<T>> promise;
+  };
+
+  auto any(std::make_shared<Any>());
+  auto res(any->promise.GetFuture());
+  any->futures = std::move(futures);
+  any->done.store(false);
+  for (std::size_t i = 0; i < any->futures.size(); i++) {
+    // Each callback only touches its own future, while the others may
+    // still be watched
+    any->futures[i].OnReady([any, i] () {
+      if (!any->done.exchange(true, std::memory_order_acq_rel)) {
+        any->promise.SetValue(
+            WhenAnyResult<T>{i, std::move(any->futures[i])});
+      }
+    });
+  }
+  return res;
+}
+
+#endif // FUTURE_H_
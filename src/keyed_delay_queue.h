@@ -0,0 +1,266 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef KEYED_DELAY_QUEUE_H_
+#define KEYED_DELAY_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "src/delay_queue.h"
+
+// How the pending run of a key in a KeyedDelayQueue treats later calls
+enum class KeyedMode {
+  // The run moves to {delay} after the latest call, with its payload
+  kDebounce,
+  // Runs start at most once per window, the last of them with the latest
+  // payload
+  kThrottle,
+  // The run stays {delay} after the first call, with the payloads of all
+  // calls merged
+  kCoalesce
+};
+
+// A delay queue for work that is requested over and over for the same key,
+// e.g. "flush key K in 50ms" from every write to K. Each key has at most one
+// pending run, which later calls for the key update in place instead of
+// adding a task each: they replace or merge its payload, and Debounce()
+// moves its node in the timer structure with DelayQueue::RescheduleAt(). A
+// run calls the handler with the key and the payload on a worker of the
+// delay queue. Key must be copyable, and Payload default-constructible and
+// movable.
+//
+// A hash index maps each key to its pending run, and is dropped from once
+// the run has started, or for a throttled key, once its window has passed
+// without calls. A key is meant to be used with one mode at a time; a call
+// of another mode applies its own rule to the pending run.
+//
+// All methods are thread-safe. Calls serialize on the lock of the index,
+// which is held for a lookup and a small update, but never while a handler
+// runs. Since a call could not wait for room in the delay queue under that
+// lock, max_pending_tasks and max_pending_bytes of the options are ignored;
+// the index bounds the live tasks to one per key instead. thread_pool is
+// ignored as well, as the runs call back into the KeyedDelayQueue and must
+// not outlive it on a shared pool
+template <typename Key, typename Payload, typename Hash = std::hash<Key>>
+class KeyedDelayQueue {
+ public:
+  using Handler = std::function<void(const Key& key, Payload payload)>;
+  // Folds the payload of a call into the pending payload, see Coalesce()
+  using Merge = std::function<void(Payload& pending, Payload payload)>;
+
+  explicit KeyedDelayQueue(
+      Handler handler, Merge merge = Merge(),
+      const DelayQueueOptions& options = DelayQueueOptions()) :
+      handler_(std::move(handler)), merge_(std::move(merge)),
+      next_generation_(1), delay_queue_(InnerOptions(options)) {}
+
+  // Run the handler {delay} after the latest call for {key}, with the
+  // latest payload. A call while the run is pending replaces the payload
+  // and pushes the run back, so a burst of calls runs the handler once
+  void Debounce(const Key& key, TimerClock::duration delay,
+                Payload payload) {
+    auto start_time(TimerClock::now() + delay);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it(entries_.find(key));
+    if (it == entries_.end()) {
+      Add(key, KeyedMode::kDebounce, start_time, std::move(payload));
+      return;
+    }
+    auto& entry(it->second);
+    entry.payload = std::move(payload);
+    entry.has_payload = true;
+    // A run that has been dispatched already waits for the lock, and finds
+    // that it has been superseded. One that is dispatched concurrently at
+    // its old start time finds that it is early, see Run()
+    if (delay_queue_.RescheduleAt(entry.handle, start_time)) {
+      entry.start_time = start_time;
+    } else {
+      Schedule(key, &entry, start_time);
+    }
+  }
+
+  // Run the handler at most once per {window} for {key}. A call outside of
+  // a window runs the handler right away and opens a window; calls within
+  // the window replace the payload of a single run at its end, which opens
+  // the next window
+  void Throttle(const Key& key, TimerClock::duration window,
+                Payload payload) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it(entries_.find(key));
+    if (it == entries_.end()) {
+      auto& entry(Add(key, KeyedMode::kThrottle, TimerClock::now(),
+                      std::move(payload)));
+      entry.window = window;
+      return;
+    }
+    auto& entry(it->second);
+    entry.payload = std::move(payload);
+    entry.has_payload = true;
+  }
+
+  // Run the handler {delay} after the first call for {key} since its last
+  // run, with the payloads of all calls in between folded together by the
+  // Merge function, in the order of the calls. Without a Merge function,
+  // the latest payload wins
+  void Coalesce(const Key& key, TimerClock::duration delay,
+                Payload payload) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it(entries_.find(key));
+    if (it == entries_.end()) {
+      Add(key, KeyedMode::kCoalesce, TimerClock::now() + delay,
+          std::move(payload));
+      return;
+    }
+    auto& entry(it->second);
+    if (merge_ && entry.has_payload) {
+      merge_(entry.payload, std::move(payload));
+    } else {
+      entry.payload = std::move(payload);
+    }
+    entry.has_payload = true;
+  }
+
+  // Drop the pending run of {key}, and forget its throttle window. Return
+  // false if the key had no pending run
+  bool Cancel(const Key& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it(entries_.find(key));
+    if (it == entries_.end()) {
+      return false;
+    }
+    auto had_payload(it->second.has_payload);
+    delay_queue_.Cancel(it->second.handle);
+    entries_.erase(it);
+    return had_payload;
+  }
+
+  // The number of keys in the index, i.e. with a pending run or an open
+  // throttle window
+  std::size_t PendingKeys() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+  // The delay queue that runs the handler, e.g. for its metrics
+  DelayQueue& delay_queue() {
+    return delay_queue_;
+  }
+
+  KeyedDelayQueue(const KeyedDelayQueue&) = delete;
+  KeyedDelayQueue& operator= (const KeyedDelayQueue&) = delete;
+
+ private:
+  // The pending run of a key
+  struct Entry {
+    KeyedMode mode;
+    Payload payload;
+    // Whether the run has a payload to run the handler with. A throttled
+    // key keeps its entry without one until its window has passed
+    bool has_payload;
+    // Only for kThrottle
+    TimerClock::duration window;
+    // When the run is due. The task of the run may start before, if it was
+    // dispatched while a call moved it
+    TimerClock::time_point start_time;
+    // Tells the task of the current run apart from tasks that have been
+    // superseded, but were dispatched already
+    uint64_t generation;
+    TaskHandle handle;
+  };
+
+  // The task of a run in the delay queue
+  struct RunKey {
+    KeyedDelayQueue* queue;
+    Key key;
+    uint64_t generation;
+
+    void operator() () {
+      queue->Run(key, generation);
+    }
+  };
+
+  // The options of the delay queue that runs the handler, see above
+  static DelayQueueOptions InnerOptions(DelayQueueOptions options) {
+    options.thread_pool = nullptr;
+    options.max_pending_tasks = 0;
+    options.max_pending_bytes = 0;
+    return options;
+  }
+
+  // Add the entry of {key} and schedule its run. The index must be locked
+  Entry& Add(const Key& key, KeyedMode mode,
+             TimerClock::time_point start_time, Payload payload) {
+    auto& entry(entries_[key]);
+    entry.mode = mode;
+    entry.payload = std::move(payload);
+    entry.has_payload = true;
+    entry.window = TimerClock::duration::zero();
+    Schedule(key, &entry, start_time);
+    return entry;
+  }
+
+  // Give {entry} a new generation and a task that runs it at {start_time}.
+  // The index must be locked
+  void Schedule(const Key& key, Entry* entry,
+                TimerClock::time_point start_time) {
+    entry->generation = next_generation_++;
+    entry->start_time = start_time;
+    entry->handle = delay_queue_.PostAt(
+        start_time, RunKey{this, key, entry->generation});
+  }
+
+  // Called by the task of a run. Take the payload and call the handler with
+  // it, unless the run has been superseded or cancelled
+  void Run(const Key& key, uint64_t generation) {
+    Payload payload;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it(entries_.find(key));
+      if (it == entries_.end() || it->second.generation != generation) {
+        return;
+      }
+      auto& entry(it->second);
+      if (TimerClock::now() < entry.start_time) {
+        // The task was dispatched at its old start time while Debounce()
+        // moved it, as the delay queue never runs a task early otherwise.
+        // Run at the new start time with a task of a new generation
+        Schedule(key, &entry, entry.start_time);
+        return;
+      }
+      if (entry.mode != KeyedMode::kThrottle) {
+        payload = std::move(entry.payload);
+        entries_.erase(it);
+      } else if (entry.has_payload) {
+        // Open the next window, which ends with a run if calls come in
+        payload = std::move(entry.payload);
+        entry.payload = Payload();
+        entry.has_payload = false;
+        Schedule(key, &entry, TimerClock::now() + entry.window);
+      } else {
+        // A window without calls closes the key
+        entries_.erase(it);
+        return;
+      }
+    }
+    handler_(key, std::move(payload));
+  }
+
+  const Handler handler_;
+  const Merge merge_;
+
+  // Guards everything below
+  mutable std::mutex mutex_;
+  std::unordered_map<Key, Entry, Hash> entries_;
+  uint64_t next_generation_;
+
+  // Declared last, so that its dispatch thread and its own workers are
+  // stopped before anything that the runs use goes away
+  DelayQueue delay_queue_;
+};
+
+#endif // KEYED_DELAY_QUEUE_H_
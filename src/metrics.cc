@@ -0,0 +1,80 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/metrics.h"
+
+#include <cmath>
+#include <cstdio>
+
+Histogram::Snapshot
+Histogram::Read() const {
+  Snapshot snapshot = {};
+  for (auto& shard : shards_) {
+    for (int i = 0; i < kNumBuckets; i++) {
+      auto count(shard.buckets[i].load(std::memory_order_relaxed));
+      snapshot.buckets[i] += count;
+      snapshot.count += count;
+    }
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+double
+Histogram::UpperBound(int index) {
+  if (index >= kNumBuckets - 1) {
+    return INFINITY;
+  }
+  return std::ldexp(1e-6, index);
+}
+
+void
+PrometheusWriter::WriteCounter(const std::string& name,
+                               const std::string& help, double value) {
+  WriteHeader(name, help, "counter");
+  WriteSample(name, value);
+}
+
+void
+PrometheusWriter::WriteGauge(const std::string& name, const std::string& help,
+                             double value) {
+  WriteHeader(name, help, "gauge");
+  WriteSample(name, value);
+}
+
+void
+PrometheusWriter::WriteHistogram(const std::string& name,
+                                 const std::string& help,
+                                 const Histogram& histogram) {
+  WriteHeader(name, help, "histogram");
+  auto snapshot(histogram.Read());
+  uint64_t cumulative(0);
+  for (int i = 0; i < Histogram::kNumBuckets; i++) {
+    cumulative += snapshot.buckets[i];
+    char bucket[64];
+    if (i < Histogram::kNumBuckets - 1) {
+      std::snprintf(bucket, sizeof(bucket), "_bucket{le=\"%g\"}",
+                    Histogram::UpperBound(i));
+    } else {
+      std::snprintf(bucket, sizeof(bucket), "_bucket{le=\"+Inf\"}");
+    }
+    WriteSample(name + bucket, static_cast<double>(cumulative));
+  }
+  WriteSample(name + "_sum", snapshot.sum * 1e-9);
+  WriteSample(name + "_count", static_cast<double>(snapshot.count));
+}
+
+void
+PrometheusWriter::WriteHeader(const std::string& name, const std::string& help,
+                              const char* type) {
+  text_ += "# HELP " + name + " " + help + "\n";
+  text_ += "# TYPE " + name + " " + type + "\n";
+}
+
+void
+PrometheusWriter::WriteSample(const std::string& name, double value) {
+  char number[32];
+  std::snprintf(number, sizeof(number), "%.15g", value);
+  text_ += name + " " + number + "\n";
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Number of shards of every metric. Each thread updates the shard of its own
+// index, so threads only share a cache line once there are more of them
+const std::size_t kMetricShards = 16;
+
+// Padding after the data of a shard, which keeps the next shard off its
+// cache lines without over-aligned types, which C++14 cannot allocate
+const std::size_t kMetricPadding = 64;
+
+// The shard of the current thread. Threads get their index on their first
+// update, round-robin
+inline std::size_t CurrentMetricShard() {
+  static std::atomic<std::size_t> num_threads(0);
+  thread_local std::size_t shard(num_threads.fetch_add(1) % kMetricShards);
+  return shard;
+}
+
+// A value that threads add to without contending with each other, e.g. a
+// number of events, or a number of items that also goes down. Updates go to
+// the shard of the current thread, and Value() sums all shards up
+class Counter {
+ public:
+  Counter() {
+    for (auto& shard : shards_) {
+      shard.value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void Add(int64_t delta) {
+    shards_[CurrentMetricShard()].value.fetch_add(delta,
+                                                   std::memory_order_relaxed);
+  }
+
+  int64_t Value() const {
+    int64_t sum(0);
+    for (auto& shard : shards_) {
+      sum += shard.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  Counter(const Counter&) = delete;
+  Counter& operator= (const Counter&) = delete;
+
+ private:
+  struct Shard {
+    std::atomic<int64_t> value;
+    char padding[kMetricPadding];
+  };
+
+  Shard shards_[kMetricShards];
+};
+
+// A distribution of durations, kept as counts in buckets whose upper bounds
+// double from 1us up to about 8.4s, plus one bucket for everything above.
+// Sharded like Counter
+class Histogram {
+ public:
+  // Number of buckets, including the one without an upper bound
+  static const int kNumBuckets = 25;
+
+  // The sums of all shards
+  struct Snapshot {
+    uint64_t buckets[kNumBuckets];
+    uint64_t count;
+    // In nanoseconds
+    int64_t sum;
+  };
+
+  Histogram() {
+    for (auto& shard : shards_) {
+      for (auto& bucket : shard.buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      shard.sum.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Record a duration. Negative durations count as zero
+  void Observe(std::chrono::nanoseconds duration) {
+    auto nanoseconds(duration.count() > 0 ? duration.count() : 0);
+    auto& shard(shards_[CurrentMetricShard()]);
+    shard.buckets[Bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+  }
+
+  Snapshot Read() const;
+
+  // The upper bound of bucket {index} in seconds, which is infinite for the
+  // last bucket
+  static double UpperBound(int index);
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator= (const Histogram&) = delete;
+
+ private:
+  struct Shard {
+    std::atomic<uint64_t> buckets[kNumBuckets];
+    std::atomic<int64_t> sum;
+    char padding[kMetricPadding];
+  };
+
+  // The bucket of a duration: 0 up to 1us, then one bucket per power of two
+  static int Bucket(int64_t nanoseconds) {
+    auto microseconds(static_cast<uint64_t>(nanoseconds) / 1000);
+    int bucket(0);
+    while (microseconds != 0 && bucket < kNumBuckets - 1) {
+      microseconds >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  Shard shards_[kMetricShards];
+};
+
+// Collects metrics in the Prometheus text exposition format, see
+// https://prometheus.io/docs/instrumenting/exposition_formats/
+class PrometheusWriter {
+ public:
+  void WriteCounter(const std::string& name, const std::string& help,
+                    double value);
+  void WriteGauge(const std::string& name, const std::string& help,
+                  double value);
+  // A histogram of durations, written in seconds
+  void WriteHistogram(const std::string& name, const std::string& help,
+                      const Histogram& histogram);
+
+  const std::string& Text() const {
+    return text_;
+  }
+
+ private:
+  void WriteHeader(const std::string& name, const std::string& help,
+                   const char* type);
+  void WriteSample(const std::string& name, double value);
+
+  std::string text_;
+};
+
+#endif // METRICS_H_
@@ -0,0 +1,66 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+#include <atomic>
+
+// A lock-free, intrusive multi-producer/single-consumer queue. Producers link
+// items through the {Next} member of T with a single compare-and-swap, and
+// the consumer takes every queued item at once with a single exchange. This
+// is a Treiber stack whose content is reversed when the consumer takes it,
+// so items come out in the order they went in. Because the consumer never
+// pops items one at a time, the stack does not suffer from the ABA problem.
+//
+// The queue never owns the items. An item must stay alive, and must not be
+// pushed again, until the consumer has taken it
+template <typename T, T* T::*Next>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(nullptr) {}
+
+  // Push a single item. Return true if the queue was empty, which tells the
+  // producer that the consumer may need a wakeup
+  bool Push(T* item) {
+    return Push(item, item);
+  }
+
+  // Push a chain of items in a single step. The chain is linked through
+  // {Next} from {newest} to {oldest}, and comes out oldest first. Return true
+  // if the queue was empty
+  bool Push(T* newest, T* oldest) {
+    auto head(head_.load(std::memory_order_relaxed));
+    do {
+      oldest->*Next = head;
+    } while (!head_.compare_exchange_weak(head, newest,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+    return head == nullptr;
+  }
+
+  // Take every queued item, in the order they were pushed, as a list linked
+  // through {Next}. Only the consumer thread may call this
+  T* PopAll() {
+    auto item(head_.exchange(nullptr, std::memory_order_acquire));
+    T* reversed(nullptr);
+    while (item != nullptr) {
+      auto next(item->*Next);
+      item->*Next = reversed;
+      reversed = item;
+      item = next;
+    }
+    return reversed;
+  }
+
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) == nullptr;
+  }
+
+ private:
+  // The most recently pushed item
+  std::atomic<T*> head_;
+};
+
+#endif // MPSC_QUEUE_H_
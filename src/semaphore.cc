@@ -2,19 +2,159 @@
 // Use of this source code is governed by a Apache License 2.0 that can be
 // found in the LICENSE file.
 //
-// Credit: this file has been inspired by the following article:
-// https://www.crazygaze.com/blog/2016/03/24/portable-c-timer-queue/
+// A semaphore that spins with an adaptive limit before it parks the thread
+// on a futex, or on a condition variable off Linux, see semaphore.h.
+//
+// Credit: the atomic count that goes negative for each sleeping thread, and
+// the spin before sleeping, follow Jeff Preshing's lightweight semaphore:
+// https://preshing.com/20150316/semaphores-are-surprisingly-versatile/
 
 #include "src/semaphore.h"
 
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Spinning gives up on a waiter's time slice in steps of this many
+// iterations at least, so that the spin limit can grow back after it has
+// shrunk
+const int kMinSpins = 16;
+
+// Tell the CPU that this is a spin loop, which saves power and frees up the
+// pipeline for the other hardware thread of the core
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+#ifdef __linux__
+int Futex(std::atomic<int>* word, int op, int value,
+          const timespec* timeout) {
+  return syscall(SYS_futex, reinterpret_cast<int*>(word), op, value, timeout,
+                 nullptr, 0);
+}
+#endif
+
+}  // namespace
+
+int Semaphore::MaxSpins() {
+  static const int max_spins(
+      std::thread::hardware_concurrency() > 1 ? 4000 : 0);
+  return max_spins;
+}
+
 void Semaphore::Notify() {
+  // Only a negative count means that a thread is going to sleep, or is
+  // sleeping already
+  if (count_.fetch_add(1, std::memory_order_release) < 0) {
+    parker_.Unpark();
+  }
+}
+
+void Semaphore::Wait() {
+  if (Spin()) {
+    return;
+  }
+  if (count_.fetch_sub(1, std::memory_order_acquire) > 0) {
+    return;
+  }
+  parker_.Park();
+}
+
+bool Semaphore::Spin() {
+  auto limit(spin_limit_.load(std::memory_order_relaxed));
+  int i(0);
+  do {
+    auto count(count_.load(std::memory_order_relaxed));
+    if (count > 0 && count_.compare_exchange_weak(count, count - 1,
+                                                  std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+      if (i > 0) {
+        spin_limit_.store(std::min(MaxSpins(), std::max(limit * 2, kMinSpins)),
+                          std::memory_order_relaxed);
+      }
+      return true;
+    }
+    CpuRelax();
+  } while (++i < limit);
+
+  if (limit > kMinSpins) {
+    spin_limit_.store(limit / 2, std::memory_order_relaxed);
+  }
+  return false;
+}
+
+#ifdef __linux__
+
+void Semaphore::Parker::Unpark() {
+  wakeups_.fetch_add(1, std::memory_order_release);
+  Futex(&wakeups_, FUTEX_WAKE_PRIVATE, 1, nullptr);
+}
+
+void Semaphore::Parker::Park() {
+  // The futex only puts this thread to sleep if there is still no wakeup
+  while (!TryConsume()) {
+    Futex(&wakeups_, FUTEX_WAIT_PRIVATE, 0, nullptr);
+  }
+}
+
+bool Semaphore::Parker::Park(std::chrono::nanoseconds timeout) {
+  if (TryConsume()) {
+    return true;
+  }
+
+  timespec relative;
+  relative.tv_sec = timeout.count() / 1000000000;
+  relative.tv_nsec = timeout.count() % 1000000000;
+  Futex(&wakeups_, FUTEX_WAIT_PRIVATE, 0, &relative);
+  return TryConsume();
+}
+
+bool Semaphore::Parker::TryConsume() {
+  auto wakeups(wakeups_.load(std::memory_order_relaxed));
+  while (wakeups > 0) {
+    if (wakeups_.compare_exchange_weak(wakeups, wakeups - 1,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#else
+
+void Semaphore::Parker::Unpark() {
   std::unique_lock<std::mutex> lock(mutex_);
-  count_++;
+  wakeups_++;
   condition_variable_.notify_one();
 }
 
-void Semaphore::Wait() {
+void Semaphore::Parker::Park() {
   std::unique_lock<std::mutex> lock(mutex_);
-  condition_variable_.wait(lock, [this]() { return count_ > 0; });
-  count_--;
+  condition_variable_.wait(lock, [this]() { return wakeups_ > 0; });
+  wakeups_--;
 }
+
+bool Semaphore::Parker::Park(std::chrono::nanoseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!condition_variable_.wait_for(lock, timeout, [this]() {
+      return wakeups_ > 0; })) {
+    return false;
+  }
+  wakeups_--;
+  return true;
+}
+
+#endif
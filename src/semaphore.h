@@ -4,19 +4,34 @@
 #ifndef SEMAPHORE_H_
 #define SEMAPHORE_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifndef __linux__
 #include <condition_variable>
 #include <mutex>
+#endif
 
 // Definition of a Semaphore class that one can use for notifying, wait and
 // and wait for a period of time. Because C++ does not have a built-in semaphore
-// until C++20, it is necessary to define one if it is convenient to use it. 
+// until C++20, it is necessary to define one if it is convenient to use it.
+//
+// The count lives in an atomic integer, which goes negative while threads
+// are waiting for it. Notify() only makes a system call when a thread is
+// actually asleep, and Wait() spins for a while before it goes to sleep,
+// which saves both threads the system calls when the notification comes in
+// shortly. Sleeping threads park on a futex on Linux, and on a condition
+// variable elsewhere. This design follows the lightweight semaphore by
+// Jeff Preshing, "Semaphores are Surprisingly Versatile"
 class Semaphore {
  public:
   // Default count is zero, which means calling Wait() immediately after
   // constructor this thread will go to sleep (waiting for count > 0)
-  Semaphore(unsigned int count = 0) : count_(count) {}
- 
-  // Increment the counter and notify one of the thread that there is one 
+  Semaphore(unsigned int count = 0) : count_(count),
+      spin_limit_(MaxSpins()) {}
+
+  // Increment the counter and notify one of the thread that there is one
   // available
   void Notify();
 
@@ -28,20 +43,85 @@ class Semaphore {
   // otherwise return false
   template <class Clock, class Duration>
   bool WaitUntil(const std::chrono::time_point<Clock, Duration>& deadline) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (!condition_variable_.wait_until(lock, deadline, [this]() { 
-        return count_ > 0; })) {
-       return false;
+    if (Spin()) {
+      return true;
+    }
+    if (count_.fetch_sub(1, std::memory_order_acquire) > 0) {
+      return true;
+    }
+
+    // Sleep until a Notify() wakes this thread up or the deadline passes.
+    // The parker may also return early, e.g. on a spurious wakeup
+    while (true) {
+      auto now(Clock::now());
+      if (now >= deadline) {
+        break;
+      }
+      if (parker_.Park(std::chrono::duration_cast<std::chrono::nanoseconds>(
+              deadline - now))) {
+        return true;
+      }
+    }
+
+    // Timed out. Take this thread back out of the count, unless a Notify()
+    // has already counted it as woken up, in which case its wakeup is on
+    // the way and has to be consumed
+    auto count(count_.load(std::memory_order_relaxed));
+    while (count < 0) {
+      if (count_.compare_exchange_weak(count, count + 1,
+                                       std::memory_order_relaxed)) {
+        return false;
+      }
     }
-   
-    count_--;
+    parker_.Park();
     return true;
   }
- 
-private:
+
+ private:
+  // The most iterations that a waiter spins before going to sleep. Spinning
+  // is pointless with a single hardware thread, and is skipped then
+  static int MaxSpins();
+
+  // The operating system primitive that waiters sleep on. It counts the
+  // wakeups that Notify() hands out, so that none of them gets lost
+  class Parker {
+   public:
+    Parker() : wakeups_(0) {}
+
+    // Wake up one sleeping thread, or the next one to sleep
+    void Unpark();
+
+    // Sleep until a wakeup is available, and consume it
+    void Park();
+
+    // Same as above, but give up after about {timeout}. Return false if no
+    // wakeup has been consumed
+    bool Park(std::chrono::nanoseconds timeout);
+
+   private:
+#ifdef __linux__
+    // Consume one wakeup if there is any
+    bool TryConsume();
+
+    // The futex word, holding the number of wakeups not consumed yet
+    std::atomic<int> wakeups_;
+#else
     std::mutex mutex_;
     std::condition_variable condition_variable_;
-    unsigned int count_;
+    int wakeups_;
+#endif
+  };
+
+  // Spin on the counter for a while, and consume one if it becomes positive.
+  // Return false if the counter stayed empty
+  bool Spin();
+
+  // The available count if positive, or minus the number of waiters
+  std::atomic<int64_t> count_;
+  // How long Spin() currently spins. It grows when spinning pays off and
+  // shrinks when waiters end up sleeping anyway
+  std::atomic<int> spin_limit_;
+  Parker parker_;
 };
 
 #endif // SEMAPHORE_H_
@@ -0,0 +1,63 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/sharded_delay_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace {
+
+// Every producer thread gets a sequence number on its first task, which
+// spreads the producer threads round-robin over the shards
+std::atomic<std::size_t> num_producer_threads{0};
+thread_local std::size_t producer_index = num_producer_threads.fetch_add(1);
+
+// Mix the bits of a key, so that keys with a common stride do not all land
+// on the same few shards
+uint64_t MixKey(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+}  // namespace
+
+ShardedDelayQueue::ShardedDelayQueue(const ShardedDelayQueueOptions& options) {
+  auto num_shards(options.num_shards);
+  if (num_shards == 0) {
+    num_shards = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  auto shard_options(options.shard_options);
+  if (options.shared_thread_pool && shard_options.thread_pool == nullptr) {
+    shared_thread_pool_.reset(
+        new ThreadPool(shard_options.thread_pool_options));
+    shard_options.thread_pool = shared_thread_pool_.get();
+  }
+  for (unsigned int i = 0; i < num_shards; i++) {
+    if (!options.shard_dispatch_cpus.empty()) {
+      shard_options.dispatch_thread_cpus = options.shard_dispatch_cpus[
+          i % options.shard_dispatch_cpus.size()];
+    }
+    shards_.emplace_back(new DelayQueue(shard_options));
+  }
+}
+
+ShardedDelayQueue::~ShardedDelayQueue() {
+  // Stop the dispatch threads before the shared pool goes away
+  shards_.clear();
+}
+
+DelayQueue&
+ShardedDelayQueue::ShardForKey(uint64_t key) {
+  return *shards_[MixKey(key) % shards_.size()];
+}
+
+DelayQueue&
+ShardedDelayQueue::ShardForThread() {
+  return *shards_[producer_index % shards_.size()];
+}
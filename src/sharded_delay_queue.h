@@ -0,0 +1,136 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef SHARDED_DELAY_QUEUE_H_
+#define SHARDED_DELAY_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "src/delay_queue.h"
+#include "src/threadpool.h"
+
+// Options that configure a sharded delay queue at construction
+struct ShardedDelayQueueOptions {
+  // Number of shards, or 0 for one shard per hardware thread
+  unsigned int num_shards = 0;
+  // Run the tasks of all shards on one thread pool, instead of giving each
+  // shard a pool of its own
+  bool shared_thread_pool = true;
+  // Options of every shard. With a shared thread pool, its
+  // thread_pool_options configure the shared pool
+  DelayQueueOptions shard_options;
+  // Pin the dispatch thread of shard i to
+  // shard_dispatch_cpus[i % shard_dispatch_cpus.size()], instead of pinning
+  // all of them to shard_options.dispatch_thread_cpus
+  std::vector<CpuSet> shard_dispatch_cpus;
+};
+
+// A set of independent delay queues, each with its own timer structure and
+// its own dispatch thread, for timer rates that a single dispatch thread
+// cannot keep up with. A task goes to one shard, picked either by the
+// producer thread or by a key given by the user.
+//
+// Ordering: tasks on one shard are dispatched in the order of their start
+// times, exactly like with a single DelayQueue. So tasks with the same key,
+// and tasks added by the same producer thread, keep that order. Tasks on
+// different shards are dispatched independently of each other, and a task
+// may be dispatched before a task of another shard with an earlier start
+// time. In every case, tasks dispatched in order may still run concurrently
+// on the worker threads.
+//
+// Cancel() and Reschedule() must be called on the shard that the task was
+// added to, which ShardForKey() or ShardForThread() returns again
+class ShardedDelayQueue {
+ public:
+  explicit ShardedDelayQueue(
+      const ShardedDelayQueueOptions& options = ShardedDelayQueueOptions());
+
+  ~ShardedDelayQueue();
+
+  std::size_t NumShards() const {
+    return shards_.size();
+  }
+
+  // The shard for the tasks with {key}. The same key always picks the same
+  // shard
+  DelayQueue& ShardForKey(uint64_t key);
+
+  // The shard for the tasks added by the current thread. The same thread
+  // always picks the same shard, and producer threads are spread evenly
+  // over the shards
+  DelayQueue& ShardForThread();
+
+  // Add a task to the shard of the current thread, see DelayQueue::AddTask
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type>
+      AddTask(TimerClock::duration delay, Function function,
+              TimerClock::duration slack = TimerClock::duration::zero(),
+              TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().AddTask(delay, std::move(function), slack,
+                                    priority);
+  }
+
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type>
+      AddTask(uint64_t delay_milliseconds, Function function,
+              TimerClock::duration slack = TimerClock::duration::zero(),
+              TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().AddTask(delay_milliseconds, std::move(function),
+                                    slack, priority);
+  }
+
+  template <typename Function>
+  TaskFuture<typename std::result_of<Function()>::type>
+      AddTaskAt(TimerClock::time_point start_time, Function function,
+                TimerClock::duration slack = TimerClock::duration::zero(),
+                TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().AddTaskAt(start_time, std::move(function), slack,
+                                      priority);
+  }
+
+  // Post a task to the shard of the current thread, see DelayQueue::Post
+  template <typename Function>
+  TaskHandle Post(TimerClock::duration delay, Function function,
+                  TimerClock::duration slack = TimerClock::duration::zero(),
+                  TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().Post(delay, std::move(function), slack, priority);
+  }
+
+  template <typename Function>
+  TaskHandle Post(uint64_t delay_milliseconds, Function function,
+                  TimerClock::duration slack = TimerClock::duration::zero(),
+                  TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().Post(delay_milliseconds, std::move(function),
+                                 slack, priority);
+  }
+
+  template <typename Function>
+  TaskHandle PostAt(TimerClock::time_point start_time, Function function,
+                    TimerClock::duration slack = TimerClock::duration::zero(),
+                    TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().PostAt(start_time, std::move(function), slack,
+                                   priority);
+  }
+
+  // Post a periodic task to the shard of the current thread, see
+  // DelayQueue::PostPeriodic
+  template <typename Function>
+  TaskHandle PostPeriodic(TimerClock::duration initial_delay,
+                          TimerClock::duration period, Function function,
+                          PeriodicMode mode = PeriodicMode::kFixedRate,
+                          TaskPriority priority = TaskPriority::kNormal) {
+    return ShardForThread().PostPeriodic(initial_delay, period,
+                                         std::move(function), mode, priority);
+  }
+
+ private:
+  // The pool shared by all shards, if any. It is declared before the shards
+  // so that it outlives them
+  std::unique_ptr<ThreadPool> shared_thread_pool_;
+  std::vector<std::unique_ptr<DelayQueue>> shards_;
+};
+
+#endif // SHARDED_DELAY_QUEUE_H_
@@ -0,0 +1,357 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/task_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Every record starts with the checksum and the length of its body
+const std::size_t kHeaderSize = 2 * sizeof(uint32_t);
+// The body of a kRemove record, and the fixed part of a kInsert record
+const std::size_t kRemoveSize = sizeof(uint8_t) + sizeof(uint64_t);
+const std::size_t kInsertSize = kRemoveSize + sizeof(uint32_t) +
+                                sizeof(int64_t);
+// Compaction writes the new segment in chunks of about this size
+const std::size_t kCompactionChunk = 1 << 20;
+
+// The lookup tables of CRC-32 (the polynomial of zlib and Ethernet), for
+// the slicing-by-4 algorithm, which handles four bytes per step
+struct Crc32Tables {
+  Crc32Tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc(i);
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+      }
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int slice = 1; slice < 4; slice++) {
+        table[slice][i] = (table[slice - 1][i] >> 8) ^
+                          table[0][table[slice - 1][i] & 0xff];
+      }
+    }
+  }
+
+  uint32_t table[4][256];
+};
+
+uint32_t Crc32(const char* data, std::size_t size) {
+  static const Crc32Tables tables;
+  auto& table(tables.table);
+  auto bytes(reinterpret_cast<const unsigned char*>(data));
+  uint32_t crc(0xffffffffu);
+  for (; size >= 4; size -= 4, bytes += 4) {
+    crc ^= static_cast<uint32_t>(bytes[0]) |
+           static_cast<uint32_t>(bytes[1]) << 8 |
+           static_cast<uint32_t>(bytes[2]) << 16 |
+           static_cast<uint32_t>(bytes[3]) << 24;
+    crc = table[3][crc & 0xff] ^ table[2][(crc >> 8) & 0xff] ^
+          table[1][(crc >> 16) & 0xff] ^ table[0][crc >> 24];
+  }
+  for (; size > 0; size--, bytes++) {
+    crc = (crc >> 8) ^ table[0][(crc ^ *bytes) & 0xff];
+  }
+  return ~crc;
+}
+
+template <typename T>
+void Put(std::string* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T Get(const char* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Append the encoding of {record} to {out}
+void Encode(const LogRecord& record, std::string* out) {
+  auto start(out->size());
+  out->append(kHeaderSize, '\0');
+  Put<uint8_t>(out, record.type);
+  Put<uint64_t>(out, record.task_id);
+  if (record.type == LogRecord::kInsert) {
+    Put<uint32_t>(out, record.handler_id);
+    Put<int64_t>(out, record.deadline);
+    out->append(record.payload, record.payload_size);
+  }
+
+  auto body(&(*out)[start + kHeaderSize]);
+  auto body_size(static_cast<uint32_t>(out->size() - start - kHeaderSize));
+  auto crc(Crc32(body, body_size));
+  std::memcpy(&(*out)[start], &crc, sizeof(crc));
+  std::memcpy(&(*out)[start + sizeof(crc)], &body_size, sizeof(body_size));
+}
+
+// Decode the record at the start of {data}. Return the bytes it takes, or 0
+// if it is cut short, fails its checksum or is malformed
+std::size_t Decode(const char* data, std::size_t size, LogRecord* record) {
+  if (size < kHeaderSize) {
+    return 0;
+  }
+  auto crc(Get<uint32_t>(data));
+  auto body_size(Get<uint32_t>(data + sizeof(crc)));
+  auto body(data + kHeaderSize);
+  if (body_size < kRemoveSize || body_size > size - kHeaderSize ||
+      Crc32(body, body_size) != crc) {
+    return 0;
+  }
+
+  record->type = static_cast<LogRecord::Type>(Get<uint8_t>(body));
+  record->task_id = Get<uint64_t>(body + sizeof(uint8_t));
+  switch (record->type) {
+    case LogRecord::kInsert:
+      if (body_size < kInsertSize) {
+        return 0;
+      }
+      record->handler_id = Get<uint32_t>(body + kRemoveSize);
+      record->deadline = Get<int64_t>(body + kRemoveSize + sizeof(uint32_t));
+      record->payload = body + kInsertSize;
+      record->payload_size = body_size - kInsertSize;
+      break;
+    case LogRecord::kRemove:
+      if (body_size != kRemoveSize) {
+        return 0;
+      }
+      break;
+    default:
+      return 0;
+  }
+  return kHeaderSize + body_size;
+}
+
+// Visit the valid records of the segment at {path}. Return the size of the
+// file
+std::size_t ReplaySegment(const std::string& path,
+                          const std::function<void(const LogRecord&)>& visit) {
+  auto fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  auto size(static_cast<std::size_t>(file_stat.st_size));
+  auto mapped(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return size;
+  }
+  // The segment is read once from the start to the end
+  madvise(mapped, size, MADV_SEQUENTIAL);
+
+  auto data(static_cast<const char*>(mapped));
+  std::size_t offset(0);
+  LogRecord record;
+  while (auto record_size = Decode(data + offset, size - offset, &record)) {
+    visit(record);
+    offset += record_size;
+  }
+  munmap(mapped, size);
+  return size;
+}
+
+// Parse the number of a segment file name. Return false for other files
+bool ParseSegmentName(const char* name, uint64_t* number) {
+  auto length(std::strlen(name));
+  if (length <= 4 || std::strcmp(name + length - 4, ".wal") != 0) {
+    return false;
+  }
+  *number = 0;
+  for (std::size_t i = 0; i + 4 < length; i++) {
+    if (name[i] < '0' || name[i] > '9') {
+      return false;
+    }
+    *number = *number * 10 + (name[i] - '0');
+  }
+  return true;
+}
+
+// Flush the entries of {directory}, e.g. a new or a deleted segment
+void SyncDirectory(const std::string& directory) {
+  auto fd(open(directory.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<TaskLog>
+TaskLog::Open(const std::string& directory, std::size_t segment_bytes,
+              bool sync, const std::function<void(const LogRecord&)>& visit) {
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    return nullptr;
+  }
+  auto dir(opendir(directory.c_str()));
+  if (dir == nullptr) {
+    return nullptr;
+  }
+  std::unique_ptr<TaskLog> log(new TaskLog(directory, segment_bytes, sync));
+  while (auto entry = readdir(dir)) {
+    uint64_t number;
+    if (ParseSegmentName(entry->d_name, &number)) {
+      log->segments_.push_back(number);
+    }
+  }
+  closedir(dir);
+
+  std::sort(log->segments_.begin(), log->segments_.end());
+  for (auto number : log->segments_) {
+    log->bytes_ += ReplaySegment(log->SegmentPath(number), visit);
+  }
+  if (!log->segments_.empty()) {
+    log->next_segment_ = log->segments_.back() + 1;
+  }
+
+  // Never append to a replayed segment, whose end may be cut short
+  if (!log->StartSegment()) {
+    return nullptr;
+  }
+  return log;
+}
+
+TaskLog::~TaskLog() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool
+TaskLog::Append(const LogRecord& record) {
+  buffer_.clear();
+  Encode(record, &buffer_);
+  if (segment_size_ > 0 && segment_size_ + buffer_.size() > segment_bytes_ &&
+      !StartSegment()) {
+    return false;
+  }
+  if (!Write(buffer_)) {
+    return false;
+  }
+  if (sync_) {
+    fdatasync(fd_);
+  }
+  return true;
+}
+
+bool
+TaskLog::Compact(const std::vector<LogRecord>& records) {
+  auto old_segments(segments_);
+  if (!StartSegment()) {
+    return false;
+  }
+
+  auto written(true);
+  buffer_.clear();
+  for (auto& record : records) {
+    Encode(record, &buffer_);
+    if (buffer_.size() >= kCompactionChunk) {
+      written = written && Write(buffer_);
+      buffer_.clear();
+    }
+  }
+  written = written && Write(buffer_) && fsync(fd_) == 0;
+
+  if (!written) {
+    // Give up on the new segment, and append to a fresh one after the old
+    // segments instead
+    close(fd_);
+    fd_ = -1;
+    unlink(SegmentPath(segments_.back()).c_str());
+    segments_.pop_back();
+    bytes_ -= segment_size_;
+    StartSegment();
+    return false;
+  }
+
+  // The live records are safely on the disk, drop everything before them
+  for (auto number : old_segments) {
+    unlink(SegmentPath(number).c_str());
+  }
+  if (sync_) {
+    SyncDirectory(directory_);
+  }
+  segments_.assign(1, segments_.back());
+  bytes_ = segment_size_;
+  return true;
+}
+
+std::size_t
+TaskLog::RecordSize(const LogRecord& record) {
+  return kHeaderSize + (record.type == LogRecord::kInsert ?
+                        kInsertSize + record.payload_size : kRemoveSize);
+}
+
+std::string
+TaskLog::SegmentPath(uint64_t number) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%020llu.wal",
+                static_cast<unsigned long long>(number));
+  return directory_ + "/" + name;
+}
+
+bool
+TaskLog::StartSegment() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  auto number(next_segment_);
+  fd_ = open(SegmentPath(number).c_str(),
+             O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+  next_segment_++;
+  segments_.push_back(number);
+  segment_size_ = 0;
+  if (sync_) {
+    SyncDirectory(directory_);
+  }
+  return true;
+}
+
+bool
+TaskLog::Write(const std::string& data) {
+  if (fd_ < 0 && !StartSegment()) {
+    return false;
+  }
+
+  std::size_t offset(0);
+  while (offset < data.size()) {
+    auto written(write(fd_, data.data() + offset, data.size() - offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Whatever made it into the segment is cut short, and replay would
+      // stop there. Append the next records to a new segment instead
+      segment_size_ += offset;
+      bytes_ += offset;
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    offset += written;
+  }
+  segment_size_ += data.size();
+  bytes_ += data.size();
+  return true;
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef TASK_LOG_H_
+#define TASK_LOG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One entry of a TaskLog: either a task that has been scheduled, or the
+// removal of a task that has completed or has been cancelled
+struct LogRecord {
+  enum Type : uint8_t {
+    kInsert = 1,
+    kRemove = 2
+  };
+
+  Type type;
+  uint64_t task_id;
+  // The following fields are only used by kInsert records. The deadline is
+  // in nanoseconds of the system clock, which unlike TimerClock keeps its
+  // meaning across restarts of the process
+  uint32_t handler_id;
+  int64_t deadline;
+  // The payload is not owned by the record. While replaying a log, it points
+  // into the log file and is only valid during the visit of the record
+  const char* payload;
+  std::size_t payload_size;
+};
+
+// A write-ahead log of scheduled tasks, kept as a directory of numbered
+// segment files. Records are appended to the newest segment, and a new
+// segment is started once the newest one reaches the segment size.
+//
+// Each record is stored as a header of a CRC-32 checksum and a length,
+// followed by its fields in host byte order. Replay maps every segment into
+// memory and stops reading a segment at the first record that is cut short
+// or fails its checksum, which is what a crash in the middle of an append
+// leaves behind.
+//
+// Compaction writes the records that are still live into a new segment and
+// then deletes every older segment. A crash before the deletion leaves both,
+// which replays to the same state, as inserting a task twice or removing it
+// twice has no further effect.
+//
+// A task log is not thread-safe, the caller is expected to serialize the
+// access to it. Only available on POSIX systems
+class TaskLog {
+ public:
+  // Replay the log in {directory}, visiting every valid record in the order
+  // they were appended, then start a new segment to append to. The
+  // directory is created if it does not exist. Return nullptr if the
+  // directory or the new segment cannot be opened. With {sync}, every
+  // append and compaction is flushed to the disk with fsync() before it
+  // returns, otherwise only to the operating system
+  static std::unique_ptr<TaskLog> Open(
+      const std::string& directory, std::size_t segment_bytes, bool sync,
+      const std::function<void(const LogRecord&)>& visit);
+
+  ~TaskLog();
+
+  // Append a record. Return false if it could not be written
+  bool Append(const LogRecord& record);
+
+  // Replace the whole log with {records}, see the class comment. Return
+  // false if the new segment could not be written, in which case the old
+  // segments are kept
+  bool Compact(const std::vector<LogRecord>& records);
+
+  // The bytes in all segments of the log
+  std::size_t Bytes() const {
+    return bytes_;
+  }
+
+  // The bytes that a record takes in the log
+  static std::size_t RecordSize(const LogRecord& record);
+
+  TaskLog(const TaskLog&) = delete;
+  TaskLog& operator= (const TaskLog&) = delete;
+
+ private:
+  TaskLog(const std::string& directory, std::size_t segment_bytes, bool sync) :
+      directory_(directory), segment_bytes_(segment_bytes), sync_(sync),
+      fd_(-1), next_segment_(0), segment_size_(0), bytes_(0) {}
+
+  // The path of segment {number}
+  std::string SegmentPath(uint64_t number) const;
+
+  // Close the current segment, if any, and start segment next_segment_
+  bool StartSegment();
+
+  // Write out {data} to the current segment
+  bool Write(const std::string& data);
+
+  std::string directory_;
+  std::size_t segment_bytes_;
+  bool sync_;
+
+  // The segment that records are appended to
+  int fd_;
+  // The numbers of the segments that make up the log, oldest first, and the
+  // number of the next one to start
+  std::vector<uint64_t> segments_;
+  uint64_t next_segment_;
+  // The bytes in the current segment and in all segments
+  std::size_t segment_size_;
+  std::size_t bytes_;
+  // Reused to encode records
+  std::string buffer_;
+};
+
+#endif // TASK_LOG_H_
@@ -0,0 +1,286 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/task_tracer.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <set>
+#include <tuple>
+
+namespace {
+
+// Task ids of the thread with index i start at i << kTaskIdBits
+const int kTaskIdBits = 40;
+
+// Hands out TaskTracer::id_
+std::atomic<uint64_t> next_tracer_id(1);
+
+// The buffer that the current thread last recorded into, and its tracer
+struct CachedBuffer {
+  uint64_t tracer_id;
+  void* buffer;
+};
+thread_local CachedBuffer cached_buffer = {0, nullptr};
+
+int64_t ToNanoseconds(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      time.time_since_epoch()).count();
+}
+
+std::chrono::steady_clock::time_point FromNanoseconds(int64_t nanoseconds) {
+  return std::chrono::steady_clock::time_point(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::nanoseconds(nanoseconds)));
+}
+
+// Writes the events of a Chrome trace, with times in microseconds since the
+// first event
+class ChromeTraceWriter {
+ public:
+  explicit ChromeTraceWriter(std::chrono::steady_clock::time_point origin) :
+      origin_(origin) {}
+
+  // A slice of the async track of a task run
+  void WriteAsync(const char* name, char phase, uint64_t task_id,
+                  uint32_t thread,
+                  std::chrono::steady_clock::time_point time) {
+    char event[192];
+    std::snprintf(event, sizeof(event),
+                  "{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"%c\","
+                  "\"id\":\"0x%" PRIx64 "\",\"pid\":1,\"tid\":%" PRIu32
+                  ",\"ts\":%.3f}", name, phase, task_id, thread,
+                  Microseconds(time));
+    Append(event);
+  }
+
+  // A slice on the track of a thread
+  void WriteComplete(uint64_t task_id, uint32_t thread,
+                     std::chrono::steady_clock::time_point begin,
+                     std::chrono::steady_clock::time_point end) {
+    char event[192];
+    std::snprintf(event, sizeof(event),
+                  "{\"name\":\"task 0x%" PRIx64 "\",\"cat\":\"run\","
+                  "\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32 ",\"ts\":%.3f,"
+                  "\"dur\":%.3f}", task_id, thread, Microseconds(begin),
+                  Microseconds(end) - Microseconds(begin));
+    Append(event);
+  }
+
+  void WriteThreadName(uint32_t thread) {
+    char event[128];
+    std::snprintf(event, sizeof(event),
+                  "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                  "\"tid\":%" PRIu32 ",\"args\":{\"name\":\"thread %" PRIu32
+                  "\"}}", thread, thread);
+    Append(event);
+  }
+
+  std::string Finish() {
+    return "{\"traceEvents\":[" + text_ + "],\"displayTimeUnit\":\"ns\"}\n";
+  }
+
+ private:
+  double Microseconds(std::chrono::steady_clock::time_point time) const {
+    return std::chrono::duration<double, std::micro>(time - origin_).count();
+  }
+
+  void Append(const char* event) {
+    if (!text_.empty()) {
+      text_ += ",\n";
+    }
+    text_ += event;
+  }
+
+  std::chrono::steady_clock::time_point origin_;
+  std::string text_;
+};
+
+}  // namespace
+
+TaskTracer::Buffer::Buffer(std::size_t capacity, uint32_t thread) :
+    slots(new Slot[capacity]), mask(capacity - 1), head(0), thread(thread),
+    last_task_id(static_cast<uint64_t>(thread) << kTaskIdBits) {
+  for (std::size_t i = 0; i < capacity; i++) {
+    slots[i].sequence.store(0, std::memory_order_relaxed);
+  }
+}
+
+TaskTracer::TaskTracer(std::size_t events_per_thread) :
+    id_(next_tracer_id.fetch_add(1)),
+    capacity_([events_per_thread] () {
+      std::size_t capacity(1);
+      while (capacity < events_per_thread) {
+        capacity <<= 1;
+      }
+      return capacity;
+    }()) {}
+
+TaskTracer::~TaskTracer() {}
+
+uint64_t
+TaskTracer::NewTaskId() {
+  return ++ThreadBuffer()->last_task_id;
+}
+
+void
+TaskTracer::Record(uint64_t task_id, TraceEvent::Phase phase,
+                   std::chrono::steady_clock::time_point time,
+                   std::chrono::steady_clock::time_point due) {
+  auto buffer(ThreadBuffer());
+  auto position(buffer->head.load(std::memory_order_relaxed));
+  auto& slot(buffer->slots[position & buffer->mask]);
+
+  // Mark the slot as being written before overwriting its fields, so that
+  // a reader that sees any of the new fields also sees the mark
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.task_id.store(task_id, std::memory_order_relaxed);
+  slot.time.store(ToNanoseconds(time), std::memory_order_relaxed);
+  slot.due.store(ToNanoseconds(due), std::memory_order_relaxed);
+  slot.phase.store(phase, std::memory_order_relaxed);
+  slot.sequence.store(position + 1, std::memory_order_release);
+  buffer->head.store(position + 1, std::memory_order_release);
+}
+
+std::vector<TraceEvent>
+TaskTracer::Events() const {
+  std::vector<TraceEvent> events;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& buffer : buffers_) {
+    auto head(buffer->head.load(std::memory_order_acquire));
+    auto capacity(buffer->mask + 1);
+    for (auto position(head > capacity ? head - capacity : 0);
+         position < head; position++) {
+      auto& slot(buffer->slots[position & buffer->mask]);
+      if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+        continue;
+      }
+      TraceEvent event;
+      event.task_id = slot.task_id.load(std::memory_order_relaxed);
+      event.time = FromNanoseconds(slot.time.load(std::memory_order_relaxed));
+      event.due = FromNanoseconds(slot.due.load(std::memory_order_relaxed));
+      event.phase = static_cast<TraceEvent::Phase>(
+          slot.phase.load(std::memory_order_relaxed));
+      event.thread = buffer->thread;
+      // Skip the event if the thread has started to overwrite it meanwhile
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != position + 1) {
+        continue;
+      }
+      events.push_back(event);
+    }
+  }
+
+  std::sort(events.begin(), events.end(),
+            [] (const TraceEvent& a, const TraceEvent& b) {
+    return std::make_tuple(a.task_id, a.time, a.phase) <
+           std::make_tuple(b.task_id, b.time, b.phase);
+  });
+  return events;
+}
+
+std::string
+TaskTracer::ChromeTrace() const {
+  return ChromeTraceJson(Events());
+}
+
+bool
+TaskTracer::WriteChromeTrace(const std::string& path) const {
+  auto trace(ChromeTrace());
+  auto file(std::fopen(path.c_str(), "w"));
+  if (file == nullptr) {
+    return false;
+  }
+  auto written(std::fwrite(trace.data(), 1, trace.size(), file));
+  auto closed(std::fclose(file) == 0);
+  return written == trace.size() && closed;
+}
+
+TaskTracer::Buffer*
+TaskTracer::ThreadBuffer() {
+  if (cached_buffer.tracer_id == id_) {
+    return static_cast<Buffer*>(cached_buffer.buffer);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& buffer(thread_buffers_[std::this_thread::get_id()]);
+  if (buffer == nullptr) {
+    buffers_.emplace_back(new Buffer(capacity_, buffers_.size() + 1));
+    buffer = buffers_.back().get();
+  }
+  cached_buffer.tracer_id = id_;
+  cached_buffer.buffer = buffer;
+  return buffer;
+}
+
+std::string
+ChromeTraceJson(const std::vector<TraceEvent>& events) {
+  auto origin(std::chrono::steady_clock::time_point::max());
+  std::set<uint32_t> threads;
+  for (auto& event : events) {
+    origin = std::min(origin, event.time);
+    threads.insert(event.thread);
+  }
+  ChromeTraceWriter writer(origin);
+  for (auto thread : threads) {
+    writer.WriteThreadName(thread);
+  }
+
+  // Walk the events of each task, which form runs of an enqueue, a
+  // dispatch, a start and a finish. Later enqueues before the dispatch are
+  // reschedules, which do not start a new run
+  const TraceEvent* enqueued(nullptr);
+  const TraceEvent* dispatched(nullptr);
+  const TraceEvent* started(nullptr);
+  for (std::size_t i = 0; i < events.size(); i++) {
+    auto& event(events[i]);
+    if (i > 0 && event.task_id != events[i - 1].task_id) {
+      enqueued = dispatched = started = nullptr;
+    }
+    switch (event.phase) {
+      case TraceEvent::kEnqueued:
+        if (enqueued == nullptr && dispatched == nullptr) {
+          enqueued = &event;
+        }
+        break;
+      case TraceEvent::kDispatched:
+        dispatched = &event;
+        break;
+      case TraceEvent::kStarted:
+        started = &event;
+        break;
+      case TraceEvent::kFinished:
+        if (started != nullptr) {
+          writer.WriteComplete(event.task_id, event.thread, started->time,
+                               event.time);
+        }
+        if (enqueued != nullptr && dispatched != nullptr &&
+            started != nullptr) {
+          auto id(event.task_id);
+          auto due(std::max(enqueued->time, dispatched->due));
+          writer.WriteAsync("task", 'b', id, enqueued->thread,
+                            enqueued->time);
+          writer.WriteAsync("pending", 'b', id, enqueued->thread,
+                            enqueued->time);
+          writer.WriteAsync("pending", 'e', id, enqueued->thread, due);
+          writer.WriteAsync("dispatching", 'b', id, dispatched->thread, due);
+          writer.WriteAsync("dispatching", 'e', id, dispatched->thread,
+                            dispatched->time);
+          writer.WriteAsync("queued", 'b', id, dispatched->thread,
+                            dispatched->time);
+          writer.WriteAsync("queued", 'e', id, started->thread,
+                            started->time);
+          writer.WriteAsync("running", 'b', id, started->thread,
+                            started->time);
+          writer.WriteAsync("running", 'e', id, event.thread, event.time);
+          writer.WriteAsync("task", 'e', id, event.thread, event.time);
+        }
+        enqueued = dispatched = started = nullptr;
+        break;
+    }
+  }
+  return writer.Finish();
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef TASK_TRACER_H_
+#define TASK_TRACER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// One step in the life of a traced task
+struct TraceEvent {
+  enum Phase : uint8_t {
+    // Handed to the delay queue, either added or rescheduled, or armed for
+    // the next run of a periodic task
+    kEnqueued,
+    // Popped from the timer structure and handed to the thread pool. The
+    // event carries the start time that the task was due at
+    kDispatched,
+    // Picked up by a worker, right before its callable is called
+    kStarted,
+    // Its callable has returned or thrown
+    kFinished
+  };
+
+  uint64_t task_id;
+  Phase phase;
+  // The index of the thread that recorded the event, starting at 1
+  uint32_t thread;
+  // Times on the clock of the delay queue, TimerClock
+  std::chrono::steady_clock::time_point time;
+  // Only set for kDispatched
+  std::chrono::steady_clock::time_point due;
+};
+
+// Records the lifecycle of tasks, so that the time from adding a task until
+// it has run can be split into the time in the timer structure, on the
+// dispatch thread, in the queue of the thread pool and on a worker. A delay
+// queue records the events of its tasks into the tracer set by
+// DelayQueueOptions::tracer.
+//
+// Every thread writes into a ring buffer of its own, without locks and
+// without allocating, and the oldest events of a thread are overwritten
+// once its buffer is full. Each slot is guarded by a sequence number like a
+// seqlock, so that Events() can copy the buffers while they are written to
+// and skip the slots that change under it. A buffer is taken when a thread
+// records its first event and is kept, along with its events, after the
+// thread has exited; a new thread may take it over once the old thread's id
+// is reused.
+//
+// All methods are thread-safe. A thread that records into several tracers
+// in turn pays for a lookup under a lock on every switch
+class TaskTracer {
+ public:
+  // Each thread keeps its last {events_per_thread} events, rounded up to a
+  // power of two. An event takes 40 bytes
+  explicit TaskTracer(std::size_t events_per_thread = 1 << 16);
+
+  ~TaskTracer();
+
+  // A new task id, unique within this tracer. Ids are handed out from a
+  // range of the calling thread, so threads do not contend for them
+  uint64_t NewTaskId();
+
+  // Record an event of task {task_id}, taken at {time}
+  void Record(uint64_t task_id, TraceEvent::Phase phase,
+              std::chrono::steady_clock::time_point time,
+              std::chrono::steady_clock::time_point due =
+                  std::chrono::steady_clock::time_point());
+
+  // A copy of the events that are still in the buffers, ordered by task and
+  // then by time
+  std::vector<TraceEvent> Events() const;
+
+  // The events in the Chrome trace_event JSON format, which Perfetto and
+  // chrome://tracing open. See ChromeTraceJson()
+  std::string ChromeTrace() const;
+
+  // Write ChromeTrace() to the file at {path}. Return false if the file
+  // could not be written
+  bool WriteChromeTrace(const std::string& path) const;
+
+  TaskTracer(const TaskTracer&) = delete;
+  TaskTracer& operator= (const TaskTracer&) = delete;
+
+ private:
+  // A slot of a ring buffer. sequence is the position of the event in the
+  // buffer plus one, or zero while the event is being written
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> task_id;
+    std::atomic<int64_t> time;
+    std::atomic<int64_t> due;
+    std::atomic<uint32_t> phase;
+  };
+
+  // The events of one thread, only written by that thread
+  struct Buffer {
+    Buffer(std::size_t capacity, uint32_t thread);
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    // The number of events recorded so far
+    std::atomic<uint64_t> head;
+    uint32_t thread;
+    // The last task id of this thread's range
+    uint64_t last_task_id;
+  };
+
+  // The buffer of the calling thread, taken on its first call
+  Buffer* ThreadBuffer();
+
+  // Tells the thread-local cache of ThreadBuffer() apart from the tracers
+  // that may have lived at the same address before
+  const uint64_t id_;
+  const std::size_t capacity_;
+
+  // Guards the buffers below, but not the events in them
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+  std::unordered_map<std::thread::id, Buffer*> thread_buffers_;
+};
+
+// Convert {events}, ordered like TaskTracer::Events(), to the Chrome
+// trace_event JSON format. Each run of a task becomes an async track of its
+// own, with the slices "pending" from being enqueued until it was due,
+// "dispatching" until the dispatch thread handed it to the pool, "queued"
+// until a worker picked it up and "running" until it finished. The run
+// also shows up as a slice on the track of its worker thread. Runs whose
+// events have been overwritten are left out
+std::string ChromeTraceJson(const std::vector<TraceEvent>& events);
+
+#endif // TASK_TRACER_H_
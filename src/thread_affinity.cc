@@ -0,0 +1,108 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/thread_affinity.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+
+bool SetThreadAffinity(std::thread& thread, const CpuSet& cpus) {
+  if (cpus.empty()) {
+    return false;
+  }
+
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (auto cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return false;
+    }
+    CPU_SET(cpu, &cpu_set);
+  }
+  return pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set),
+                                &cpu_set) == 0;
+}
+
+CpuSet CurrentThreadCpus() {
+  CpuSet cpus;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set),
+                             &cpu_set) != 0) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cpu_set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+CpuSet NumaNodeCpus(int node) {
+  if (node < 0) {
+    return CpuSet();
+  }
+
+  std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+                     "/cpulist");
+  std::string cpu_list;
+  if (!std::getline(file, cpu_list)) {
+    return CpuSet();
+  }
+  return ParseCpuList(cpu_list);
+}
+
+#else
+
+bool SetThreadAffinity(std::thread&, const CpuSet&) {
+  return false;
+}
+
+CpuSet CurrentThreadCpus() {
+  return CpuSet();
+}
+
+CpuSet NumaNodeCpus(int) {
+  return CpuSet();
+}
+
+#endif
+
+CpuSet ParseCpuList(const std::string& cpu_list) {
+  CpuSet cpus;
+  std::istringstream stream(cpu_list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+
+    // Each entry is either a single CPU or an inclusive range of CPUs
+    char* end;
+    auto first(std::strtol(range.c_str(), &end, 10));
+    auto parsed(end != range.c_str());
+    auto last(first);
+    if (parsed && *end == '-') {
+      auto begin(end + 1);
+      last = std::strtol(begin, &end, 10);
+      parsed = end != begin;
+    }
+    if (!parsed || *end != '\0' || first < 0 || last < first) {
+      return CpuSet();
+    }
+    for (auto cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+  }
+  return cpus;
+}
@@ -0,0 +1,31 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef THREAD_AFFINITY_H_
+#define THREAD_AFFINITY_H_
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// A set of CPU numbers, as the operating system numbers them
+typedef std::vector<int> CpuSet;
+
+// Restrict {thread} to run on {cpus}. Pinning is only supported on Linux;
+// return false if it is not supported or if the operating system refuses
+// the CPU set, in which case the thread keeps its current affinity
+bool SetThreadAffinity(std::thread& thread, const CpuSet& cpus);
+
+// The CPUs that the current thread may run on, in increasing order. Return
+// an empty set if this is not supported
+CpuSet CurrentThreadCpus();
+
+// The CPUs of NUMA node {node}, read from sysfs on Linux. Return an empty set
+// if the node does not exist or if this is not supported
+CpuSet NumaNodeCpus(int node);
+
+// Parse a CPU list in the format that Linux uses in sysfs and in cpusets,
+// e.g. "0-3,8,10-11". Return an empty set if {cpu_list} is malformed
+CpuSet ParseCpuList(const std::string& cpu_list);
+
+#endif // THREAD_AFFINITY_H_
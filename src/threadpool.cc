@@ -4,17 +4,81 @@
 
 #include "src/threadpool.h"
 
+#include <algorithm>
+
+namespace {
+
+// The pool of the current thread, if the current thread is a worker thread,
+// and its worker index in work stealing mode. This is how a job submitted
+// from a worker thread finds the queue of that worker
+thread_local ThreadPool* current_pool = nullptr;
+thread_local unsigned int current_worker = 0;
+
+// How often Drain() checks whether the pool has run out of jobs
+const std::chrono::microseconds kDrainPollInterval(100);
+
+int64_t SteadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
 // Initialize the threadpool by starting a number of threads 
-ThreadPool::ThreadPool() : terminated_(false) {
-  auto thread_counts(std::max(std::thread::hardware_concurrency(), 
-                     (unsigned int)1));
+ThreadPool::ThreadPool(const ThreadPoolOptions& options) : terminated_(false),
+    starvation_limit_(options.starvation_limit),
+    capacity_(options.max_queued_jobs, 0),
+    error_handler_(options.error_handler), pending_jobs_(0), active_jobs_(0),
+    next_worker_(0) {
+  for (auto& lane_size : lane_sizes_) {
+    lane_size.store(0);
+  }
+  if (options.collect_metrics) {
+    metrics_.reset(new Metrics());
+    metrics_->created = std::chrono::steady_clock::now();
+  }
+
+  // Pin the workers to the CPUs of a NUMA node if asked to, and start one
+  // worker per CPU of that node by default
+  auto worker_cpus(options.worker_cpus);
+  auto thread_counts(options.num_threads);
+  if (worker_cpus.empty() && options.numa_node >= 0) {
+    auto node_cpus(NumaNodeCpus(options.numa_node));
+    if (!node_cpus.empty()) {
+      if (thread_counts == 0) {
+        thread_counts = node_cpus.size();
+      }
+      worker_cpus.push_back(node_cpus);
+    }
+  }
+  if (thread_counts == 0) {
+    thread_counts = std::max(std::thread::hardware_concurrency(),
+                             (unsigned int)1);
+  }
+
   try {
-    for (unsigned int i = 0; i < thread_counts; i++) {
-      threads_.push_back(std::thread(&ThreadPool::WorkerThread, this));
+    if (options.work_stealing) {
+      for (unsigned int i = 0; i < thread_counts; i++) {
+        workers_.emplace_back(new Worker());
+      }
+      for (unsigned int i = 0; i < thread_counts; i++) {
+        threads_.push_back(std::thread(&ThreadPool::WorkStealingWorkerThread,
+                                       this, i));
+      }
+    } else {
+      for (unsigned int i = 0; i < thread_counts; i++) {
+        threads_.push_back(std::thread(&ThreadPool::WorkerThread, this));
+      }
     }
   } catch (...) {
     terminated_.store(true);
   }
+
+  if (!worker_cpus.empty()) {
+    for (unsigned int i = 0; i < threads_.size(); i++) {
+      SetThreadAffinity(threads_[i], worker_cpus[i % worker_cpus.size()]);
+    }
+  }
 }
 
 ThreadPool::~ThreadPool() {
@@ -24,24 +88,311 @@ ThreadPool::~ThreadPool() {
   for(unsigned int i = 0; i < threads_.size(); i++) {
     semaphore_.Notify();
   }
+  for (auto& worker : workers_) {
+    worker->sleeping_.store(false);
+    worker->semaphore_.Notify();
+  }
   // Join all worker threads
   for(unsigned int i = 0; i < threads_.size(); i++) {
     threads_[i].join();
   }
 }
 
+void
+ThreadPool::Enqueue(FunctionWrapper&& function_wrapper,
+                    TaskPriority priority) {
+  // A worker waiting for room in its own pool could end up waiting for
+  // itself, so jobs from the workers go over the limit instead
+  if (current_pool == this) {
+    capacity_.ForceAcquire(1, 0);
+  } else {
+    capacity_.Acquire(1, 0);
+  }
+  Push(std::move(function_wrapper), priority);
+}
+
+bool
+ThreadPool::InWorkerThread() const {
+  return current_pool == this;
+}
+
+bool
+ThreadPool::SubmitUntil(FunctionWrapper&& function_wrapper,
+                        TaskPriority priority,
+                        std::chrono::steady_clock::time_point deadline) {
+  if (current_pool == this) {
+    capacity_.ForceAcquire(1, 0);
+  } else if (!capacity_.AcquireUntil(1, 0, deadline)) {
+    return false;
+  }
+  Push(std::move(function_wrapper), priority);
+  return true;
+}
+
+void
+ThreadPool::Push(FunctionWrapper&& function_wrapper, TaskPriority priority) {
+  active_jobs_.fetch_add(1);
+  Job job(std::move(function_wrapper), 0);
+  if (metrics_) {
+    job.queued_at = SteadyNanoseconds();
+    metrics_->submitted.Add(1);
+  }
+
+  auto lane(static_cast<int>(priority));
+  if (workers_.empty()) {
+    if (priority != TaskPriority::kNormal) {
+      lane_sizes_[lane].fetch_add(1);
+    }
+    lanes_[lane].Push(std::move(job));
+    semaphore_.Notify();
+    return;
+  }
+
+  // Keep a job submitted by a worker on that worker, otherwise spread the
+  // jobs over the workers. Jobs of the other priorities go to the shared
+  // lanes, where every worker looks for them first or last
+  unsigned int target;
+  if (current_pool == this) {
+    target = current_worker;
+  } else {
+    target = next_worker_.fetch_add(1, std::memory_order_relaxed) %
+             workers_.size();
+  }
+  if (priority == TaskPriority::kNormal) {
+    workers_[target]->queue_.Push(std::move(job));
+  } else {
+    lane_sizes_[lane].fetch_add(1);
+    lanes_[lane].Push(std::move(job));
+  }
+  pending_jobs_.fetch_add(1);
+
+  // The target worker may be busy, in which case any sleeping worker can
+  // steal the job
+  WakeWorker(target);
+}
+
+void
+ThreadPool::Run(Job& job) {
+  int64_t started_at(0);
+  if (metrics_) {
+    started_at = SteadyNanoseconds();
+    metrics_->queue_wait.Observe(
+        std::chrono::nanoseconds(started_at - job.queued_at));
+  }
+
+  // A packaged_task stores its exception in the future, so only posted jobs
+  // can throw here
+  try {
+    job.function();
+  } catch (...) {
+    if (error_handler_) {
+      error_handler_(std::current_exception());
+    }
+  }
+
+  if (metrics_) {
+    metrics_->execution.Observe(
+        std::chrono::nanoseconds(SteadyNanoseconds() - started_at));
+    metrics_->completed.Add(1);
+  }
+
+  // Free what the job captured before it stops counting, so that a pool
+  // that Drain() sees idle holds no state of its jobs anymore
+  job.function = FunctionWrapper();
+  active_jobs_.fetch_sub(1);
+}
+
+std::size_t
+ThreadPool::Drain(std::chrono::steady_clock::time_point deadline) {
+  while (active_jobs_.load() > 0) {
+    auto current_time(std::chrono::steady_clock::now());
+    if (current_time >= deadline) {
+      break;
+    }
+    std::this_thread::sleep_for(
+        std::min<std::chrono::steady_clock::duration>(kDrainPollInterval,
+                                                      deadline - current_time));
+  }
+
+  // Take the jobs that are left like a worker would, and drop them. In the
+  // normal lane of work stealing mode, this steals from every worker queue
+  std::size_t dropped(0);
+  Job job;
+  for (int lane = 0; lane < kNumPriorities; lane++) {
+    while (TryPopLane(lane, 0, job)) {
+      capacity_.Release(1, 0);
+      if (!workers_.empty()) {
+        pending_jobs_.fetch_sub(1);
+      }
+      job.function = FunctionWrapper();
+      active_jobs_.fetch_sub(1);
+      dropped++;
+    }
+  }
+  return dropped;
+}
+
+std::string
+ThreadPool::MetricsText() const {
+  PrometheusWriter writer;
+  WriteMetrics(&writer);
+  return writer.Text();
+}
+
+void
+ThreadPool::WriteMetrics(PrometheusWriter* writer) const {
+  if (!metrics_) {
+    return;
+  }
+
+  auto submitted(metrics_->submitted.Value());
+  auto completed(metrics_->completed.Value());
+  writer->WriteCounter("threadpool_jobs_submitted_total",
+                       "Jobs submitted to the thread pool", submitted);
+  writer->WriteCounter("threadpool_jobs_completed_total",
+                       "Jobs that have finished running", completed);
+  writer->WriteGauge("threadpool_workers", "Worker threads", NumThreads());
+  // Read after the counters, so that it does not include the jobs counted
+  // as submitted since
+  auto queue_wait(metrics_->queue_wait.Read());
+  writer->WriteGauge("threadpool_queued_jobs",
+                     "Jobs waiting for a worker",
+                     static_cast<double>(submitted) - queue_wait.count);
+  writer->WriteHistogram("threadpool_queue_wait_seconds",
+                         "Time from the submission of a job to its start",
+                         metrics_->queue_wait);
+  writer->WriteHistogram("threadpool_execution_seconds",
+                         "Time that a job runs", metrics_->execution);
+
+  // The share of the time since the pool was created that the workers have
+  // spent running jobs
+  auto execution(metrics_->execution.Read());
+  std::chrono::duration<double> uptime(std::chrono::steady_clock::now() -
+                                       metrics_->created);
+  auto worker_seconds(uptime.count() * std::max<std::size_t>(NumThreads(), 1));
+  writer->WriteGauge("threadpool_busy_fraction",
+                     "Share of the worker time spent running jobs",
+                     worker_seconds > 0 ? execution.sum * 1e-9 / worker_seconds
+                                        : 0);
+
+  uint64_t contentions(0);
+  for (auto& lane : lanes_) {
+    contentions += lane.Contentions();
+  }
+  for (auto& worker : workers_) {
+    contentions += worker->queue_.Contentions();
+  }
+  writer->WriteCounter("threadpool_lock_contentions_total",
+                       "Times a thread waited for the lock of a job queue",
+                       contentions);
+}
+
+bool
+ThreadPool::WakeWorker(unsigned int preferred) {
+  auto num_workers(workers_.size());
+  for (unsigned int i = 0; i < num_workers; i++) {
+    auto& worker(workers_[(preferred + i) % num_workers]);
+    if (worker->sleeping_.load() && worker->sleeping_.exchange(false)) {
+      worker->semaphore_.Notify();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+ThreadPool::FindJob(unsigned int index, unsigned int& jobs_taken, Job& job) {
+  // Start at the high lane, except on every starvation_limit_-th turn,
+  // which starts at one of the lower lanes, taking turns among them
+  auto turn(jobs_taken + 1);
+  int first(0);
+  if (starvation_limit_ > 0 && turn % starvation_limit_ == 0) {
+    first = 1 + turn / starvation_limit_ % (kNumPriorities - 1);
+  }
+
+  for (int i = 0; i < kNumPriorities; i++) {
+    if (TryPopLane((first + i) % kNumPriorities, index, job)) {
+      jobs_taken = turn;
+      capacity_.Release(1, 0);
+      if (!workers_.empty()) {
+        pending_jobs_.fetch_sub(1);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+ThreadPool::TryPopLane(int lane, unsigned int index, Job& job) {
+  if (lane != static_cast<int>(TaskPriority::kNormal)) {
+    if (lane_sizes_[lane].load() <= 0 || !lanes_[lane].TryPop(job)) {
+      return false;
+    }
+    lane_sizes_[lane].fetch_sub(1);
+    return true;
+  }
+  if (workers_.empty()) {
+    return lanes_[lane].TryPop(job);
+  }
+
+  auto num_workers(workers_.size());
+  if (workers_[index]->queue_.TryPop(job)) {
+    return true;
+  }
+  for (unsigned int i = 1; i < num_workers; i++) {
+    if (workers_[(index + i) % num_workers]->queue_.TrySteal(job)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 void
 ThreadPool::WorkerThread() {
+  current_pool = this;
+
   // Keep trying pop the task and execute
+  unsigned int jobs_taken(0);
   while (!terminated_.load()) {
     // Wait for a submission to wake up and process a task
     semaphore_.Wait();
 
-    FunctionWrapper task;
-    if (work_queue_.TryPop(task)) {
-      task();
+    Job task;
+    if (FindJob(0, jobs_taken, task)) {
+      Run(task);
     } else {
       std::this_thread::yield();
     }
   }
 }
+
+void
+ThreadPool::WorkStealingWorkerThread(unsigned int index) {
+  current_pool = this;
+  current_worker = index;
+  auto& self(*workers_[index]);
+
+  unsigned int jobs_taken(0);
+  while (!terminated_.load()) {
+    Job job;
+    if (FindJob(index, jobs_taken, job)) {
+      Run(job);
+      continue;
+    }
+
+    // Announce that this worker is going to sleep before checking for jobs
+    // one last time. A submitter bumps pending_jobs_ before it looks for a
+    // sleeping worker, so either this check sees the new job or the
+    // submitter sees this worker sleeping and notifies it
+    self.sleeping_.store(true);
+    if (pending_jobs_.load() > 0 || terminated_.load()) {
+      if (self.sleeping_.exchange(false)) {
+        continue;
+      }
+      // Somebody else has already flipped the flag and is notifying this
+      // worker, so consume that notification below
+    }
+    self.semaphore_.Wait();
+  }
+}
@@ -5,61 +5,243 @@
 #define THREADPOOL_H_
 
 #include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <future>
+#include <memory>
+#include <new>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "src/awaitable.h"
+#include "src/capacity_limit.h"
+#include "src/metrics.h"
 #include "src/semaphore.h"
+#include "src/thread_affinity.h"
 #include "src/threadsafe_queue.h"
+#include "src/work_stealing_queue.h"
 
 // Definition of a function wrapper that stores the reference to a function.
-// This is necessary as a task queue expects a copyable object 
+// This is necessary as a task queue expects a copyable object.
+//
+// A callable that fits in kInlineSize bytes and can be moved without
+// throwing is stored inline, so wrapping it does not allocate. Only larger
+// callables are moved to the heap. Instead of a virtual base class, each
+// stored type gets a static table of plain function pointers, which is the
+// only thing the wrapper needs to call, move and destroy the callable
 class FunctionWrapper {
  public:
-  template <typename Function>
-  FunctionWrapper(Function&& function) : 
-      impl_(new ImplType<Function>(std::move(function))) {}
+  // Size of the inline buffer. This fits a std::packaged_task, a
+  // std::function, or a lambda with a handful of captures
+  static constexpr std::size_t kInlineSize = 48;
+
+  template <typename Function, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<Function>::type,
+                    FunctionWrapper>::value>::type>
+  FunctionWrapper(Function&& function) : ops_(nullptr) {
+    typedef typename std::decay<Function>::type StoredType;
+    Store<StoredType>(std::forward<Function>(function),
+        std::integral_constant<bool, StoredInline<StoredType>()>());
+  }
 
   // Basically a functor pattern, use () operator to invoke the call
   void operator() () {
-    impl_->Call();
+    ops_->call(&storage_);
   }
 
-  FunctionWrapper() = default;
+  FunctionWrapper() : ops_(nullptr) {}
 
   // Move constructor
-  FunctionWrapper(FunctionWrapper&& other) : impl_(std::move(other.impl_)) {}
+  FunctionWrapper(FunctionWrapper&& other) : ops_(nullptr) {
+    MoveFrom(other);
+  }
 
   // Move assignment operator 
   FunctionWrapper& operator= (FunctionWrapper&& other) {
-    impl_ = std::move(other.impl_);
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
     return *this;
   }
 
+  ~FunctionWrapper() {
+    Reset();
+  }
+
+  // Whether the wrapper holds a callable
+  explicit operator bool() const {
+    return ops_ != nullptr;
+  }
+
+  // Whether a callable of type Function would be stored without allocating
+  template <typename Function>
+  static constexpr bool StoredInline() {
+    return sizeof(Function) <= kInlineSize &&
+           alignof(Function) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<Function>::value;
+  }
+
   // Remove other copy constructors
   FunctionWrapper(const FunctionWrapper&) = delete;
   FunctionWrapper(FunctionWrapper&) = delete;
   FunctionWrapper& operator= (const FunctionWrapper&) = delete;
 
  private:
-  // A base type for implementation
-  struct ImplBase {
-    virtual void Call() = 0;
-    virtual ~ImplBase() {}
+  // The hand-written virtual table of a stored callable. Every function
+  // takes the address of the storage of a wrapper
+  struct Ops {
+    // Invoke the callable
+    void (*call)(void* storage);
+    // Move the callable from one storage into another, and destroy what is
+    // left in the source storage
+    void (*move)(void* from, void* to);
+    // Destroy the callable
+    void (*destroy)(void* storage);
   };
-  std::unique_ptr<ImplBase> impl_;
 
+  // The table of a callable that lives inside the storage
   template <typename Function>
-  // Actual impl type, which stores a function reference and provides a 
-  // unified interface to invoke this function
-  struct ImplType : ImplBase {
-    Function func;
-    ImplType(Function&& _func) : func(std::move(_func)) {}
-    void Call() {
-      func();
+  struct InlineOps {
+    static void Call(void* storage) {
+      (*static_cast<Function*>(storage))();
+    }
+    static void Move(void* from, void* to) {
+      new (to) Function(std::move(*static_cast<Function*>(from)));
+      static_cast<Function*>(from)->~Function();
+    }
+    static void Destroy(void* storage) {
+      static_cast<Function*>(storage)->~Function();
     }
+    static const Ops kOps;
   };
+
+  // The table of a callable on the heap, whose pointer lives inside the
+  // storage. Moving it only moves the pointer
+  template <typename Function>
+  struct HeapOps {
+    static void Call(void* storage) {
+      (**static_cast<Function**>(storage))();
+    }
+    static void Move(void* from, void* to) {
+      *static_cast<Function**>(to) = *static_cast<Function**>(from);
+    }
+    static void Destroy(void* storage) {
+      delete *static_cast<Function**>(storage);
+    }
+    static const Ops kOps;
+  };
+
+  // Construct the callable inside the storage, or on the heap
+  template <typename StoredType, typename Function>
+  void Store(Function&& function, std::true_type /* inline */) {
+    new (&storage_) StoredType(std::forward<Function>(function));
+    ops_ = &InlineOps<StoredType>::kOps;
+  }
+  template <typename StoredType, typename Function>
+  void Store(Function&& function, std::false_type /* inline */) {
+    *reinterpret_cast<StoredType**>(&storage_) =
+        new StoredType(std::forward<Function>(function));
+    ops_ = &HeapOps<StoredType>::kOps;
+  }
+
+  // Destroy the stored callable, if any
+  void Reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  // Take over the callable of another wrapper, leaving it empty
+  void MoveFrom(FunctionWrapper& other) {
+    if (other.ops_ != nullptr) {
+      other.ops_->move(&other.storage_, &storage_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  // The table of the stored callable, nullptr for an empty wrapper
+  const Ops* ops_;
+  // Holds either the callable itself or a pointer to it
+  typename std::aligned_storage<kInlineSize,
+                                alignof(std::max_align_t)>::type storage_;
+};
+
+template <typename Function>
+const FunctionWrapper::Ops FunctionWrapper::InlineOps<Function>::kOps = {
+    &InlineOps<Function>::Call, &InlineOps<Function>::Move,
+    &InlineOps<Function>::Destroy};
+
+template <typename Function>
+const FunctionWrapper::Ops FunctionWrapper::HeapOps<Function>::kOps = {
+    &HeapOps<Function>::Call, &HeapOps<Function>::Move,
+    &HeapOps<Function>::Destroy};
+
+// The lane that a job waits in until a worker takes it. Workers serve the
+// higher lanes first, e.g. so that timeouts do not queue behind bulk jobs
+enum class TaskPriority {
+  kHigh,
+  kNormal,
+  kLow
+};
+
+// Number of TaskPriority values, which are used as indices of the lanes
+const int kNumPriorities = 3;
+
+// Options that configure a thread pool at construction
+struct ThreadPoolOptions {
+  // Number of worker threads. With 0, the pool starts one thread per CPU of
+  // numa_node if it is set, and one thread per hardware thread otherwise
+  unsigned int num_threads = 0;
+
+  // Pin worker i to the CPUs in worker_cpus[i % worker_cpus.size()], e.g.
+  // one CPU per worker, or one CPU set for all of them. Pinning is best
+  // effort and only supported on Linux
+  std::vector<CpuSet> worker_cpus;
+
+  // Pin every worker to the CPUs of this NUMA node on Linux, unless
+  // worker_cpus is set. Memory that the workers allocate then stays local
+  // to the node. A negative value leaves the workers unpinned
+  int numa_node = -1;
+
+  // Give each worker thread its own queue instead of sharing one queue among
+  // all of them. A job submitted from a worker thread goes to the queue of
+  // that worker, other jobs are spread round-robin, and a worker that runs
+  // out of jobs steals from the other queues. This avoids having every
+  // submission and every worker contend on the same lock
+  bool work_stealing = false;
+
+  // Every starvation_limit-th job that a worker takes, it looks at the lower
+  // priority lanes first, taking turns among them. This keeps a steady
+  // stream of high priority jobs from starving the other lanes: each lane
+  // gets at least about 1 / (starvation_limit * (kNumPriorities - 1)) of the
+  // workers' turns while it has jobs. With 0, the priorities are strict
+  unsigned int starvation_limit = 8;
+
+  // The most jobs that may wait in the pool for a worker. Once that many are
+  // queued, Submit() and Post() wait for a worker to take one, and TryPost()
+  // fails. Jobs submitted from the pool's own workers are always queued, as
+  // they would otherwise wait for themselves, and so are the jobs of
+  // ForceSubmit(), e.g. the tasks that a delay queue dispatches. 0 means no
+  // limit
+  std::size_t max_queued_jobs = 0;
+
+  // Collect metrics of the jobs: how many are submitted and completed, how
+  // long they wait in the queue and how long they run. This reads the clock
+  // three times per job. See ThreadPool::MetricsText()
+  bool collect_metrics = false;
+
+  // Called on the worker thread with the exception of a job that throws,
+  // which can only be a job added with Post(). Without a handler, such
+  // exceptions are dropped. The handler itself must not throw
+  std::function<void(std::exception_ptr)> error_handler;
 };
 
 // Definition of a simple thread pool class. This implementation is base on 
@@ -69,41 +251,233 @@ class FunctionWrapper {
 // task. This avoids busy waiting problem which burns CPU cycles.  
 class ThreadPool {
  public:
-  ThreadPool();
+  explicit ThreadPool(const ThreadPoolOptions& options = ThreadPoolOptions());
+
+  // Stop the workers once they have finished their current jobs. Jobs that
+  // are still queued are dropped, see Drain() to run them first
   ~ThreadPool();
 
-  // Submit a function to the workpool
+  // The number of worker threads
+  std::size_t NumThreads() const {
+    return threads_.size();
+  }
+
+  // Submit a function to the workpool, into the lane of {priority}
   template<typename FunctionType>
   std::future<typename std::result_of<FunctionType()>::type> 
-      Submit(FunctionType function) {
+      Submit(FunctionType function,
+             TaskPriority priority = TaskPriority::kNormal) {
     typedef typename std::result_of<FunctionType()>::type result_type;
     std::packaged_task<result_type()> task(std::move(function));
     std::future<result_type> res(task.get_future());
-    work_queue_.Push(std::move(task));
-    semaphore_.Notify();
+    Enqueue(std::move(task), priority);
     return res;
   }
 
-  // Provide an interface for one to simply submit a FunctionWrapper. This gets
-  // used by the delay queue
-  void Submit(FunctionWrapper&& function_wrapper) {
-    work_queue_.Push(std::move(function_wrapper));
-    semaphore_.Notify();
+  // Provide an interface for one to simply submit a FunctionWrapper
+  void Submit(FunctionWrapper&& function_wrapper,
+              TaskPriority priority = TaskPriority::kNormal) {
+    Enqueue(std::move(function_wrapper), priority);
+  }
+
+  // Same as above, but queue the job right away even if the pool already
+  // holds ThreadPoolOptions::max_queued_jobs jobs. This is for threads that
+  // must not wait for the workers, like the dispatch thread of a delay
+  // queue. Its jobs count against the limits of the delay queue instead,
+  // until they start, see DelayQueueOptions::max_pending_tasks
+  void ForceSubmit(FunctionWrapper&& function_wrapper,
+                   TaskPriority priority = TaskPriority::kNormal) {
+    capacity_.ForceAcquire(1, 0);
+    Push(std::move(function_wrapper), priority);
+  }
+
+  // Same as Submit(), but give up at {deadline} if the pool is still full
+  // by then. Return false in that case, leaving {function_wrapper} as it is
+  bool SubmitUntil(FunctionWrapper&& function_wrapper, TaskPriority priority,
+                   std::chrono::steady_clock::time_point deadline);
+
+  // Submit a function whose result nobody waits for. Unlike Submit(), this
+  // does not create a packaged_task and a future, so a small callable is
+  // queued without any allocation. An exception thrown by the function goes
+  // to the error handler of the pool
+  template<typename FunctionType>
+  void Post(FunctionType function,
+            TaskPriority priority = TaskPriority::kNormal) {
+    Enqueue(FunctionWrapper(std::move(function)), priority);
+  }
+
+  // Same as above, but return false instead of waiting if the pool already
+  // holds ThreadPoolOptions::max_queued_jobs jobs. The function is dropped
+  // then
+  template<typename FunctionType>
+  bool TryPost(FunctionType function,
+               TaskPriority priority = TaskPriority::kNormal) {
+    if (!capacity_.TryAcquire(1, 0)) {
+      return false;
+    }
+    Push(FunctionWrapper(std::move(function)), priority);
+    return true;
+  }
+
+  // The number of jobs waiting for a worker. Only counted with
+  // max_queued_jobs set, zero otherwise
+  std::size_t QueuedJobs() const {
+    return capacity_.Items();
   }
 
+  // Whether the calling thread is one of the workers of this pool
+  bool InWorkerThread() const;
+
+  // The number of jobs that have been queued and have not finished running
+  // yet, or been dropped by Drain()
+  std::size_t ActiveJobs() const {
+    return active_jobs_.load();
+  }
+
+  // Wait until every job has run, or until {deadline}, whichever comes
+  // first, and then drop the jobs that no worker has started, which breaks
+  // the promises of their futures. Jobs that are running at the deadline
+  // keep running. Return the number of dropped jobs. The pool keeps taking
+  // jobs meanwhile and afterwards, and jobs submitted by running jobs are
+  // waited for too. Must not be called from a worker of the pool
+  std::size_t Drain(std::chrono::steady_clock::time_point deadline);
+
+  // The metrics of the pool in the Prometheus text format, or an empty
+  // string unless ThreadPoolOptions::collect_metrics is set. The counters of
+  // the worker threads are summed up on every call
+  std::string MetricsText() const;
+
+  // Same as above, but add the metrics to {writer}, e.g. together with the
+  // metrics of a delay queue
+  void WriteMetrics(PrometheusWriter* writer) const;
+
  private:
+  // A job waiting for a worker, with the time it was queued at when metrics
+  // are collected
+  struct Job {
+    Job() : queued_at(0) {}
+    Job(FunctionWrapper&& function, int64_t queued_at) :
+        function(std::move(function)), queued_at(queued_at) {}
+
+    FunctionWrapper function;
+    // Nanoseconds of the steady clock
+    int64_t queued_at;
+  };
+
+  // See ThreadPoolOptions::collect_metrics
+  struct Metrics {
+    Counter submitted;
+    Counter completed;
+    Histogram queue_wait;
+    Histogram execution;
+    std::chrono::steady_clock::time_point created;
+  };
+
+  // The per-thread state of a worker in work stealing mode
+  struct Worker {
+    Worker() : sleeping_(false) {}
+
+    // The jobs submitted to this worker
+    WorkStealingQueue<Job> queue_;
+    // The worker sleeps on its own semaphore when no job is left anywhere
+    Semaphore semaphore_;
+    // Whether the worker is about to sleep or is sleeping on its semaphore.
+    // Whoever flips it back to false owes the worker a Notify()
+    std::atomic<bool> sleeping_;
+  };
+
   // An atomic bool to indicate if the thread pool is still operating
   std::atomic<bool> terminated_;
-  // A threadsafe queue to store the functions to be called
-  ThreadsafeQueue<FunctionWrapper> work_queue_;
+  // Threadsafe queues to store the functions to be called, one lane per
+  // TaskPriority. In work stealing mode, normal priority jobs go to the
+  // worker queues instead, and only the other lanes are used
+  ThreadsafeQueue<Job> lanes_[kNumPriorities];
+  // Upper bounds of the sizes of the high and the low lane, which are bumped
+  // before a push and dropped after a pop. Workers skip an empty lane
+  // without taking its lock, so that the normal lane pays nothing for them
+  std::atomic<int64_t> lane_sizes_[kNumPriorities];
+  // See ThreadPoolOptions
+  unsigned int starvation_limit_;
+  // The budget of max_queued_jobs, taken by every queued job and given back
+  // when a worker takes the job
+  CapacityLimit capacity_;
   // All threads
   std::vector<std::thread> threads_;
   // Use semaphore to synchronize between the commanding thread (main thread 
   // for ThreadPool) and the worker threads
   Semaphore semaphore_;
 
-  // Function that runs a worker thread
+  // Receives the exceptions of the jobs, see ThreadPoolOptions
+  std::function<void(std::exception_ptr)> error_handler_;
+  // nullptr unless ThreadPoolOptions::collect_metrics is set
+  std::unique_ptr<Metrics> metrics_;
+
+  // The workers in work stealing mode, empty otherwise
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // Number of jobs that sit in the worker queues and the lanes
+  std::atomic<int64_t> pending_jobs_;
+  // Number of jobs that are queued or running, see ActiveJobs()
+  std::atomic<int64_t> active_jobs_;
+  // The worker queue that the next job from outside the pool goes to
+  std::atomic<unsigned int> next_worker_;
+
+  // Hand a job over to the worker threads, after waiting for room in the
+  // pool if it is full
+  void Enqueue(FunctionWrapper&& function_wrapper, TaskPriority priority);
+
+  // Queue a job that already has its room in the pool
+  void Push(FunctionWrapper&& function_wrapper, TaskPriority priority);
+
+  // Run a job on the current worker thread, and hand an exception thrown by
+  // the job to the error handler
+  void Run(Job& job);
+
+  // Wake up one sleeping worker, trying {preferred} first. Return false if
+  // no worker is sleeping
+  bool WakeWorker(unsigned int preferred);
+
+  // Try to take a job for a worker that has taken {jobs_taken} jobs so far,
+  // from the highest lane that has one, or from the lower lanes first on a
+  // turn that protects them from starvation. {index} is the worker index in
+  // work stealing mode
+  bool FindJob(unsigned int index, unsigned int& jobs_taken, Job& job);
+
+  // Try to take a job from the lane of priority {lane}. In work stealing
+  // mode, the normal lane of worker {index} is its own queue, and then the
+  // queues of the other workers
+  bool TryPopLane(int lane, unsigned int index, Job& job);
+
+  // Functions that run a worker thread, with a shared queue or with a
+  // work stealing queue
   void WorkerThread();
+  void WorkStealingWorkerThread(unsigned int index);
+};
+
+#ifdef DELAY_QUEUE_COROUTINES
+// Awaited by a coroutine to move onto a worker of a pool, see ScheduleOn()
+struct ScheduleAwaiter {
+  bool await_ready() const noexcept {
+    return false;
+  }
+  void await_suspend(std::coroutine_handle<> coroutine) {
+    pool->Post(ResumeCoroutine{coroutine}, priority);
+  }
+  void await_resume() const noexcept {}
+
+  ThreadPool* pool;
+  TaskPriority priority;
 };
 
+// co_await ScheduleOn(pool) suspends the calling coroutine and queues its
+// resumption into the lane of {priority} of {pool}, like ThreadPool::Post(),
+// so that the coroutine continues on a worker thread. A coroutine that
+// already runs on a worker goes to the back of the queue. Waits for room in
+// a full pool like Post() does. Only available with C++20 coroutines, see
+// awaitable.h
+inline ScheduleAwaiter ScheduleOn(
+    ThreadPool& pool, TaskPriority priority = TaskPriority::kNormal) {
+  return ScheduleAwaiter{&pool, priority};
+}
+#endif
+
 #endif // THREADPOOL_H_
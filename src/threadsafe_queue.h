@@ -5,7 +5,9 @@
 #ifndef THREADSAFE_QUEUE_H_
 #define THREADSAFE_QUEUE_H_
 
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <queue>
 
@@ -15,9 +17,11 @@
 template <typename T>
 class ThreadsafeQueue {
  public:
+  ThreadsafeQueue() : contentions_(0) {}
+
   // Push a new value into the queue
   void Push(T new_value) {
-    std::unique_lock<std::mutex> lock(mutex_);
+    auto lock(Lock());
     queue_.push(std::move(new_value));
     condition_variable_.notify_one();
   }
@@ -25,14 +29,14 @@ class ThreadsafeQueue {
   // Wait until there is an item in the queue and pop it from the queue, the 
   // popped item is moved to the value variable
   void WaitAndPop(T& value) {
-    std::unique_lock<std::mutex> lock(mutex_);
+    auto lock(Lock());
     condition_variable_.wait(lock, [this] { return !queue_.empty(); });
     value = std::move(queue_.front());
     queue_.pop();
   }
 
   bool TryPop(T& value) {
-    std::unique_lock<std::mutex> lock(mutex_);
+    auto lock(Lock());
     // Empty queue, nothing to pop
     if (queue_.empty()) {
       return false;
@@ -45,11 +49,27 @@ class ThreadsafeQueue {
   }
 
   bool Empty() const {
-    std::unique_lock<std::mutex> lock(mutex_);
+    auto lock(Lock());
     return queue_.empty();
   }
 
+  // How many times a thread found the lock of the queue taken and had to
+  // wait for it
+  uint64_t Contentions() const {
+    return contentions_.load(std::memory_order_relaxed);
+  }
+
  private:
+  // Take the lock of the queue, counting the contention if it is taken
+  std::unique_lock<std::mutex> Lock() const {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      contentions_.fetch_add(1, std::memory_order_relaxed);
+      lock.lock();
+    }
+    return lock;
+  }
+
   // THe thread-safe queue is managed by a normal queue which is protected by
   // a mutex and condition variable
   // The reason that we make mutex mutable is because Empty() method is a const
@@ -58,6 +78,7 @@ class ThreadsafeQueue {
   mutable std::mutex mutex_;
   std::queue<T> queue_;
   std::condition_variable condition_variable_;
+  mutable std::atomic<uint64_t> contentions_;
 };
 
 #endif // THREADSAFE_QUEUE_H_
@@ -0,0 +1,133 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/timer_queue.h"
+
+#include <algorithm>
+
+TimerClock::time_point
+CoalesceStartTime(TimerClock::time_point earliest,
+                  TimerClock::duration slack) {
+  auto first(earliest.time_since_epoch().count());
+  auto last(first + slack.count());
+  if (slack.count() <= 0 || first < 0) {
+    return earliest;
+  }
+
+  // Double the alignment as long as the window still holds a multiple of it
+  TimerClock::rep alignment(1);
+  auto start(first);
+  while (alignment <= slack.count()) {
+    auto doubled(alignment * 2);
+    auto aligned((first + doubled - 1) / doubled * doubled);
+    if (aligned > last) {
+      break;
+    }
+    alignment = doubled;
+    start = aligned;
+  }
+  return TimerClock::time_point(TimerClock::duration(start));
+}
+
+TimerHeap::~TimerHeap() {
+  for (auto node : heap_) {
+    node->Release();
+  }
+}
+
+void
+TimerHeap::Push(TimerNode* node) {
+  heap_.push_back(node);
+  node->position_ = heap_.size() - 1;
+  SiftUp(heap_.size() - 1);
+}
+
+TimerNode*
+TimerHeap::PopExpired(TimerClock::time_point now) {
+  if (heap_.empty() || heap_.front()->start_time_ > now) {
+    return nullptr;
+  }
+
+  auto node(heap_.front());
+  Place(0, heap_.back());
+  heap_.pop_back();
+  if (!heap_.empty()) {
+    SiftDown(0);
+  }
+  return node;
+}
+
+void
+TimerHeap::Reschedule(TimerNode* node, TimerClock::time_point start_time) {
+  auto earlier(start_time < node->start_time_);
+  node->start_time_ = start_time;
+  if (earlier) {
+    SiftUp(node->position_);
+  } else {
+    SiftDown(node->position_);
+  }
+}
+
+TimerClock::time_point
+TimerHeap::NextWakeupTime() const {
+  return heap_.front()->start_time_;
+}
+
+std::size_t
+TimerHeap::Compact() {
+  auto live_end(std::partition(heap_.begin(), heap_.end(),
+                               [] (const TimerNode* node) {
+                                 return !node->Cancelled();
+                               }));
+  auto removed(heap_.end() - live_end);
+  for (auto it = live_end; it != heap_.end(); it++) {
+    (*it)->Release();
+  }
+  heap_.erase(live_end, heap_.end());
+
+  // Rebuild the heap bottom-up, which also refreshes every position
+  for (std::size_t i = 0; i < heap_.size(); i++) {
+    heap_[i]->position_ = i;
+  }
+  for (auto i = heap_.size() / 2; i-- > 0; ) {
+    SiftDown(i);
+  }
+  return removed;
+}
+
+void
+TimerHeap::SiftUp(std::size_t index) {
+  auto node(heap_[index]);
+  while (index > 0) {
+    auto parent((index - 1) / 2);
+    if (heap_[parent]->start_time_ <= node->start_time_) {
+      break;
+    }
+    Place(index, heap_[parent]);
+    index = parent;
+  }
+  Place(index, node);
+}
+
+void
+TimerHeap::SiftDown(std::size_t index) {
+  auto node(heap_[index]);
+  auto size(heap_.size());
+  while (true) {
+    auto child(2 * index + 1);
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size &&
+        heap_[child + 1]->start_time_ < heap_[child]->start_time_) {
+      child++;
+    }
+    if (node->start_time_ <= heap_[child]->start_time_) {
+      break;
+    }
+    Place(index, heap_[child]);
+    index = child;
+  }
+  Place(index, node);
+}
@@ -0,0 +1,278 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef TIMER_QUEUE_H_
+#define TIMER_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "src/threadpool.h"
+
+// The clock that the delay queue uses to timestamp its tasks. It has to be
+// monotonic, as a clock that jumps would make tasks start early or late;
+// high_resolution_clock is not guaranteed to be, and is the system clock in
+// some standard libraries
+typedef std::chrono::steady_clock TimerClock;
+
+// Pick the start time of a task that may start anywhere between {earliest}
+// and {earliest} + {slack}. The result is the time in that window that is a
+// multiple of the largest possible power of two clock ticks. Tasks whose
+// windows overlap therefore tend to land on the same start time, so that
+// the dispatch thread can run all of them with a single wakeup, like timer
+// slack in the kernel. A zero slack returns {earliest}
+TimerClock::time_point CoalesceStartTime(TimerClock::time_point earliest,
+                                         TimerClock::duration slack);
+
+// A pending delayed task. A node is allocated once when a task is added and
+// is then linked into one of the timer structures below until it expires.
+// Timer structures only store pointers to nodes, so moving a node between
+// positions never touches its function wrapper.
+//
+// A node is reference counted: the timer structure holding it owns one
+// reference and every TaskHandle to it owns another one. A new node starts
+// with the single reference of the timer structure it is about to enter
+struct TimerNode {
+  // The lifecycle of a node. A pending node turns into either a cancelled or
+  // a dispatched node exactly once, whichever transition happens first. A
+  // periodic node goes from pending to running for every run instead, and
+  // back to pending when its next run is armed; it can be cancelled in both
+  // states and is never dispatched
+  enum State {
+    kPending,
+    kCancelled,
+    kDispatched,
+    kRunning
+  };
+
+  // Where the node is, as seen by the thread that owns the timer structure:
+  // not inserted yet, held by the timer structure, popped from it for good,
+  // or popped from it for a periodic run that re-arms the node afterwards
+  enum Location {
+    kUnscheduled,
+    kScheduled,
+    kRetired,
+    kInFlight
+  };
+
+  TimerNode(TimerClock::time_point start_time,
+            FunctionWrapper&& function_wrapper) :
+      start_time_(start_time),
+      function_wrapper_(std::move(function_wrapper)),
+      state_(kPending), ref_count_(1),
+      requested_start_(start_time.time_since_epoch().count()),
+      in_intake_(false), location_(kUnscheduled) {}
+
+  void Acquire() {
+    ref_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Drop one reference and delete the node once the last one is gone
+  void Release() {
+    if (ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  // Move a pending node into the cancelled or the dispatched state. Return
+  // false if the node has already left the pending state
+  bool TryCancel() {
+    return Transition(kPending, kCancelled);
+  }
+  bool TryDispatch() {
+    return Transition(kPending, kDispatched);
+  }
+
+  // The transitions of a periodic node: start a run, arm the next run after
+  // a run, and cancel the series while a run is in flight. Return false if
+  // the node is not in the state that the transition starts from
+  bool TryRun() {
+    return Transition(kPending, kRunning);
+  }
+  bool TryRearm() {
+    return Transition(kRunning, kPending);
+  }
+  bool TryCancelRunning() {
+    return Transition(kRunning, kCancelled);
+  }
+
+  bool Periodic() const {
+    return period_ != TimerClock::duration::zero();
+  }
+
+  bool Cancelled() const {
+    return state_.load(std::memory_order_acquire) == kCancelled;
+  }
+
+  // Indicate the timepoint for this task to start
+  TimerClock::time_point start_time_;
+  // How much later than requested the task may start, see
+  // CoalesceStartTime(). Set before the node is shared, and never changed
+  TimerClock::duration slack_ = TimerClock::duration::zero();
+  // The interval between the runs of a periodic task, zero for a task that
+  // runs once, and whether the interval is counted from the end of a run
+  // instead of from its start time. Set before the node is shared
+  TimerClock::duration period_ = TimerClock::duration::zero();
+  bool fixed_delay_ = false;
+  // The lane of the thread pool that the task runs from. Set before the
+  // node is shared
+  TaskPriority priority_ = TaskPriority::kNormal;
+  // The bytes that the task has taken from the capacity of its delay queue.
+  // Set before the node is shared
+  std::size_t footprint_ = 0;
+  // The id of the task in DelayQueueOptions::tracer, or 0 when it is not
+  // traced. Set before the node is shared
+  uint64_t trace_id_ = 0;
+  // Function wrapper for the task's function. Only the thread that moves the
+  // node out of kPending may touch it afterwards. A periodic node calls it
+  // once per run, from the thread that moved the node into kRunning
+  FunctionWrapper function_wrapper_;
+  // One of the State values
+  std::atomic<int> state_;
+  // Number of owners of this node
+  std::atomic<int> ref_count_;
+
+  // Intrusive links, used by the timing wheel to chain the nodes that share
+  // the same slot
+  TimerNode* prev_ = nullptr;
+  TimerNode* next_ = nullptr;
+  // Where the node currently sits in its timer structure: the index in the
+  // heap array for TimerHeap, or the slot for TimingWheel
+  std::size_t position_ = 0;
+
+  // Fields used by the delay queue to hand nodes from producer threads over
+  // to the dispatch thread. A node waits in the intake queue either to be
+  // inserted, or to be moved to the start time that a producer requested
+  TimerNode* intake_next_ = nullptr;
+  // The latest start time requested by a producer, as a count of
+  // TimerClock ticks since the epoch
+  std::atomic<TimerClock::rep> requested_start_;
+  // Whether the node is waiting in the intake queue, which keeps a node
+  // from being queued twice
+  std::atomic<bool> in_intake_;
+  // Only read and written by the dispatch thread
+  Location location_;
+
+ private:
+  bool Transition(State from, State to) {
+    int expected(from);
+    return state_.compare_exchange_strong(expected, to,
+                                          std::memory_order_acq_rel);
+  }
+};
+
+// A reference to a task that has been added to a delay queue, which can be
+// used to cancel the task through DelayQueue::Cancel(). A handle keeps the
+// node of its task alive, so it stays valid after the task has run
+class TaskHandle {
+ public:
+  TaskHandle() : node_(nullptr) {}
+
+  explicit TaskHandle(TimerNode* node) : node_(node) {
+    if (node_ != nullptr) {
+      node_->Acquire();
+    }
+  }
+
+  TaskHandle(const TaskHandle& other) : TaskHandle(other.node_) {}
+
+  TaskHandle(TaskHandle&& other) : node_(other.node_) {
+    other.node_ = nullptr;
+  }
+
+  TaskHandle& operator= (TaskHandle other) {
+    std::swap(node_, other.node_);
+    return *this;
+  }
+
+  ~TaskHandle() {
+    if (node_ != nullptr) {
+      node_->Release();
+    }
+  }
+
+  // Whether this handle refers to a task
+  bool Valid() const {
+    return node_ != nullptr;
+  }
+
+ private:
+  friend class DelayQueue;
+  TimerNode* node_;
+};
+
+// The interface of a structure that keeps pending nodes ordered by their
+// start time. A timer queue is not thread-safe, the delay queue is expected
+// to serialize the access to it. The queue owns a reference to every node
+// pushed into it, and hands that reference over to the caller of
+// PopExpired()
+class TimerQueue {
+ public:
+  virtual ~TimerQueue() {}
+
+  // Insert a node into the queue
+  virtual void Push(TimerNode* node) = 0;
+
+  // Remove and return one node whose start time is at or before now. Return
+  // nullptr if no node is due yet. The caller takes over the reference that
+  // the queue held on the returned node
+  virtual TimerNode* PopExpired(TimerClock::time_point now) = 0;
+
+  // Move a node that is held by the queue to a new start time, keeping the
+  // queue ordered. The node's function wrapper is left untouched
+  virtual void Reschedule(TimerNode* node,
+                          TimerClock::time_point start_time) = 0;
+
+  // Return the earliest timepoint at which PopExpired() may return a node.
+  // The caller should only call this function on a non-empty queue. The
+  // returned timepoint is never later than the start time of any node
+  virtual TimerClock::time_point NextWakeupTime() const = 0;
+
+  // Remove every cancelled node from the queue and release it. Return the
+  // number of removed nodes. This costs O(n)
+  virtual std::size_t Compact() = 0;
+
+  // Number of nodes held by the queue
+  virtual std::size_t Size() const = 0;
+
+  bool Empty() const {
+    return Size() == 0;
+  }
+};
+
+// A timer queue backed by a binary min-heap on start time. Every node knows
+// its index in the heap array, so a node can be rescheduled in place.
+// Insertion, removal and rescheduling cost O(log n)
+class TimerHeap : public TimerQueue {
+ public:
+  ~TimerHeap();
+
+  void Push(TimerNode* node) override;
+  TimerNode* PopExpired(TimerClock::time_point now) override;
+  void Reschedule(TimerNode* node, TimerClock::time_point start_time) override;
+  TimerClock::time_point NextWakeupTime() const override;
+  std::size_t Compact() override;
+  std::size_t Size() const override {
+    return heap_.size();
+  }
+
+ private:
+  // Restore the heap order by moving the node at {index} towards the top or
+  // towards the bottom, updating the positions of the nodes it passes
+  void SiftUp(std::size_t index);
+  void SiftDown(std::size_t index);
+
+  // Put a node at {index} and record the index in the node
+  void Place(std::size_t index, TimerNode* node) {
+    heap_[index] = node;
+    node->position_ = index;
+  }
+
+  // The top node of the heap is the one with the minimal start_time
+  std::vector<TimerNode*> heap_;
+};
+
+#endif // TIMER_QUEUE_H_
@@ -0,0 +1,304 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include "src/timing_wheel.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+// Rotate the bits of x right by r, with 0 <= r < 64
+uint64_t RotateRight(uint64_t x, unsigned int r) {
+  return r == 0 ? x : (x >> r) | (x << (64 - r));
+}
+
+// Index of the least significant set bit, x must not be zero
+unsigned int LowestBit(uint64_t x) {
+  return __builtin_ctzll(x);
+}
+
+}  // namespace
+
+TimingWheel::TimingWheel(TimerClock::duration tick,
+                         TimerClock::time_point start) :
+    tick_(std::max(tick, TimerClock::duration(1))), start_(start),
+    current_tick_(0), occupied_(), slotted_(0), expired_head_(nullptr),
+    expired_tail_(nullptr), size_(0) {
+  for (auto& level : slots_) {
+    std::fill(std::begin(level), std::end(level), nullptr);
+  }
+}
+
+TimingWheel::~TimingWheel() {
+  for (auto& level : slots_) {
+    for (auto node : level) {
+      while (node != nullptr) {
+        auto next(node->next_);
+        node->Release();
+        node = next;
+      }
+    }
+  }
+
+  while (expired_head_ != nullptr) {
+    auto next(expired_head_->next_);
+    expired_head_->Release();
+    expired_head_ = next;
+  }
+}
+
+void
+TimingWheel::Push(TimerNode* node) {
+  size_++;
+  Link(node);
+}
+
+TimerNode*
+TimingWheel::PopExpired(TimerClock::time_point now) {
+  Advance(CurrentTick(now));
+  if (expired_head_ == nullptr) {
+    return nullptr;
+  }
+
+  auto node(expired_head_);
+  Unlink(node);
+  size_--;
+  return node;
+}
+
+void
+TimingWheel::Reschedule(TimerNode* node, TimerClock::time_point start_time) {
+  Unlink(node);
+  node->start_time_ = start_time;
+  Link(node);
+}
+
+TimerClock::time_point
+TimingWheel::NextWakeupTime() const {
+  if (expired_head_ != nullptr) {
+    return TickTime(current_tick_);
+  }
+
+  return TickTime(NextEventTick());
+}
+
+std::size_t
+TimingWheel::Compact() {
+  std::size_t removed(0);
+  for (int level = 0; level < kLevels; level++) {
+    for (int slot = 0; slot < kSlotsPerLevel; slot++) {
+      auto node(slots_[level][slot]);
+      while (node != nullptr) {
+        auto next(node->next_);
+        if (node->Cancelled()) {
+          Unlink(node);
+          node->Release();
+          removed++;
+        }
+        node = next;
+      }
+    }
+  }
+
+  auto node(expired_head_);
+  while (node != nullptr) {
+    auto next(node->next_);
+    if (node->Cancelled()) {
+      Unlink(node);
+      node->Release();
+      removed++;
+    }
+    node = next;
+  }
+
+  size_ -= removed;
+  return removed;
+}
+
+uint64_t
+TimingWheel::NextEventTick() const {
+  // The lowest level gives the exact tick of its next slot, while an upper
+  // level gives the tick at which its next occupied slot cascades. Nodes can
+  // only be in the future of these ticks, so the minimum is a safe wakeup
+  auto next_tick(std::numeric_limits<uint64_t>::max());
+  for (int level = 0; level < kLevels; level++) {
+    if (occupied_[level] == 0) {
+      continue;
+    }
+
+    unsigned int shift(level * kSlotBits);
+    uint64_t position((current_tick_ >> shift) & kSlotMask);
+    // Find the closest occupied slot after the current position, counting
+    // the current slot itself as a full revolution away
+    auto rotated(RotateRight(occupied_[level], (position + 1) & kSlotMask));
+    uint64_t distance(LowestBit(rotated) + 1);
+    next_tick = std::min(next_tick,
+                         ((current_tick_ >> shift) + distance) << shift);
+  }
+
+  return next_tick;
+}
+
+uint64_t
+TimingWheel::ExpiryTick(TimerClock::time_point start_time) const {
+  if (start_time <= start_) {
+    return 0;
+  }
+
+  auto elapsed((start_time - start_).count());
+  return (elapsed + tick_.count() - 1) / tick_.count();
+}
+
+uint64_t
+TimingWheel::CurrentTick(TimerClock::time_point now) const {
+  if (now <= start_) {
+    return 0;
+  }
+
+  return (now - start_).count() / tick_.count();
+}
+
+TimerClock::time_point
+TimingWheel::TickTime(uint64_t tick) const {
+  return start_ + tick * tick_;
+}
+
+void
+TimingWheel::Link(TimerNode* node) {
+  auto expiry(ExpiryTick(node->start_time_));
+  if (expiry <= current_tick_) {
+    AppendExpired(node);
+    return;
+  }
+
+  // Pick the lowest level whose span covers the distance to the expiry. A
+  // node beyond the span of the top level is clamped onto the top level
+  auto delta(expiry - current_tick_);
+  int level(0);
+  while (level < kLevels - 1 && (delta >> ((level + 1) * kSlotBits)) != 0) {
+    level++;
+  }
+  uint64_t max_delta((uint64_t(1) << (kLevels * kSlotBits)) - 1);
+  if (delta > max_delta) {
+    expiry = current_tick_ + max_delta;
+  }
+
+  auto slot((expiry >> (level * kSlotBits)) & kSlotMask);
+  auto& head(slots_[level][slot]);
+  node->prev_ = nullptr;
+  node->next_ = head;
+  node->position_ = level * kSlotsPerLevel + slot;
+  if (head != nullptr) {
+    head->prev_ = node;
+  }
+  head = node;
+  occupied_[level] |= uint64_t(1) << slot;
+  slotted_++;
+}
+
+void
+TimingWheel::Advance(uint64_t target_tick) {
+  while (current_tick_ < target_tick) {
+    // Nothing is left in the slots, so there is nothing to cascade or to
+    // collect on the way
+    if (slotted_ == 0) {
+      current_tick_ = target_tick;
+      return;
+    }
+
+    // Jump straight to the next tick at which a level-0 slot is due or an
+    // occupied upper slot cascades. Ticks in between have nothing to do
+    auto next_tick(NextEventTick());
+    if (next_tick > target_tick) {
+      current_tick_ = target_tick;
+      return;
+    }
+    current_tick_ = next_tick;
+
+    // Cascade from level 1 upwards for as long as the level wrapped around
+    if ((current_tick_ & kSlotMask) == 0) {
+      for (int level = 1; level < kLevels; level++) {
+        auto slot((current_tick_ >> (level * kSlotBits)) & kSlotMask);
+        Cascade(level, slot);
+        if (slot != 0) {
+          break;
+        }
+      }
+    }
+
+    // Every node in the current level-0 slot is due now
+    auto slot(current_tick_ & kSlotMask);
+    auto node(slots_[0][slot]);
+    slots_[0][slot] = nullptr;
+    occupied_[0] &= ~(uint64_t(1) << slot);
+    while (node != nullptr) {
+      auto next(node->next_);
+      slotted_--;
+      AppendExpired(node);
+      node = next;
+    }
+  }
+}
+
+void
+TimingWheel::Cascade(int level, uint64_t slot) {
+  auto node(slots_[level][slot]);
+  slots_[level][slot] = nullptr;
+  occupied_[level] &= ~(uint64_t(1) << slot);
+  while (node != nullptr) {
+    auto next(node->next_);
+    slotted_--;
+    Link(node);
+    node = next;
+  }
+}
+
+void
+TimingWheel::Unlink(TimerNode* node) {
+  if (node->position_ == kExpiredPosition) {
+    if (node->prev_ != nullptr) {
+      node->prev_->next_ = node->next_;
+    } else {
+      expired_head_ = node->next_;
+    }
+    if (node->next_ != nullptr) {
+      node->next_->prev_ = node->prev_;
+    } else {
+      expired_tail_ = node->prev_;
+    }
+  } else {
+    auto level(node->position_ / kSlotsPerLevel);
+    auto slot(node->position_ % kSlotsPerLevel);
+    if (node->prev_ != nullptr) {
+      node->prev_->next_ = node->next_;
+    } else {
+      slots_[level][slot] = node->next_;
+    }
+    if (node->next_ != nullptr) {
+      node->next_->prev_ = node->prev_;
+    }
+
+    if (slots_[level][slot] == nullptr) {
+      occupied_[level] &= ~(uint64_t(1) << slot);
+    }
+    slotted_--;
+  }
+
+  node->prev_ = nullptr;
+  node->next_ = nullptr;
+}
+
+void
+TimingWheel::AppendExpired(TimerNode* node) {
+  node->prev_ = expired_tail_;
+  node->next_ = nullptr;
+  node->position_ = kExpiredPosition;
+  if (expired_tail_ == nullptr) {
+    expired_head_ = node;
+  } else {
+    expired_tail_->next_ = node;
+  }
+  expired_tail_ = node;
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#ifndef TIMING_WHEEL_H_
+#define TIMING_WHEEL_H_
+
+#include <cstdint>
+
+#include "src/timer_queue.h"
+
+// A hierarchical timing wheel, which is a timer queue that inserts a node in
+// O(1) and expires nodes in amortized O(1). Time is divided into ticks of a
+// fixed duration. The wheel has kLevels levels of kSlotsPerLevel slots each,
+// and a slot on level L covers pow(kSlotsPerLevel, L) ticks. A node is
+// placed on the lowest level that can hold its expiry tick, and nodes on an
+// upper level get redistributed (cascaded) to the lower levels as time
+// advances. The design follows the classic Linux kernel timer wheel, see
+// Varghese and Lauck, "Hashed and Hierarchical Timing Wheels", SOSP 1987.
+//
+// The wheel never expires a node early: a node's start time is rounded up to
+// the next tick boundary, so a node can be up to one tick late.
+class TimingWheel : public TimerQueue {
+ public:
+  // Create a timing wheel whose tick zero is at {start} and whose resolution
+  // is {tick}
+  TimingWheel(TimerClock::duration tick,
+              TimerClock::time_point start = TimerClock::now());
+  ~TimingWheel();
+
+  void Push(TimerNode* node) override;
+  TimerNode* PopExpired(TimerClock::time_point now) override;
+  void Reschedule(TimerNode* node, TimerClock::time_point start_time) override;
+  TimerClock::time_point NextWakeupTime() const override;
+  std::size_t Compact() override;
+  std::size_t Size() const override {
+    return size_;
+  }
+
+ private:
+  static constexpr int kSlotBits = 6;
+  static constexpr int kSlotsPerLevel = 1 << kSlotBits;
+  static constexpr uint64_t kSlotMask = kSlotsPerLevel - 1;
+  // Six levels of 64 slots cover 2^36 ticks, i.e. about 2 years with a
+  // 1ms tick. A node further in the future is parked on the top level and
+  // re-placed each time its slot cascades
+  static constexpr int kLevels = 6;
+  // The position of a node on the expired list. A slotted node has the
+  // position level * kSlotsPerLevel + slot
+  static constexpr std::size_t kExpiredPosition = kLevels * kSlotsPerLevel;
+
+  // Convert between timepoints and ticks. A start time is rounded up so that
+  // a node never expires early, while the current time is rounded down
+  uint64_t ExpiryTick(TimerClock::time_point start_time) const;
+  uint64_t CurrentTick(TimerClock::time_point now) const;
+  TimerClock::time_point TickTime(uint64_t tick) const;
+
+  // The next tick at which a level-0 slot becomes due or an occupied slot
+  // on an upper level cascades. Only valid if some slot is occupied
+  uint64_t NextEventTick() const;
+
+  // Place a node into the slot that matches its expiry tick, or into the
+  // expired list if it is already due
+  void Link(TimerNode* node);
+
+  // Move the clock of the wheel forward to {target_tick}, cascading the
+  // upper levels and collecting the due level-0 slots on the way
+  void Advance(uint64_t target_tick);
+
+  // Detach all nodes of a slot and place each of them again
+  void Cascade(int level, uint64_t slot);
+
+  // Remove a node from its slot or from the expired list
+  void Unlink(TimerNode* node);
+
+  // Append a node to the expired list
+  void AppendExpired(TimerNode* node);
+
+  // The resolution and the origin of the wheel
+  const TimerClock::duration tick_;
+  const TimerClock::time_point start_;
+  // The tick that the wheel has advanced to
+  uint64_t current_tick_;
+
+  // Slots are doubly-linked lists through TimerNode::prev_/next_, and
+  // occupied_ keeps one bit per non-empty slot on each level so that empty
+  // slots can be skipped
+  TimerNode* slots_[kLevels][kSlotsPerLevel];
+  uint64_t occupied_[kLevels];
+  // Number of nodes linked into slots, excluding the expired list
+  std::size_t slotted_;
+
+  // Due nodes that are waiting to be popped, in expiry order. This list is
+  // doubly linked as well
+  TimerNode* expired_head_;
+  TimerNode* expired_tail_;
+
+  // Number of nodes held by the wheel
+  std::size_t size_;
+};
+
+#endif // TIMING_WHEEL_H_
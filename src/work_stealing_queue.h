@@ -0,0 +1,80 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#ifndef WORK_STEALING_QUEUE_H_
+#define WORK_STEALING_QUEUE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// A double-ended queue that a worker thread owns, and that other worker
+// threads may steal from. The owner pushes and pops at the front, so it works
+// on its most recent and cache-hot items first, while thieves take the
+// oldest items from the back. This implementation is essentially taken from
+// Anthony D. Williams, "C++ Concurrency in Action", Chapter 9, section 9.1.5
+template <typename T>
+class WorkStealingQueue {
+ public:
+  WorkStealingQueue() : contentions_(0) {}
+
+  // Push a new value at the front of the queue
+  void Push(T new_value) {
+    auto lock(Lock());
+    queue_.push_front(std::move(new_value));
+  }
+
+  // Pop the most recently pushed item, used by the owner of the queue
+  bool TryPop(T& value) {
+    auto lock(Lock());
+    if (queue_.empty()) {
+      return false;
+    }
+
+    value = std::move(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  // Pop the least recently pushed item, used by the other worker threads
+  bool TrySteal(T& value) {
+    auto lock(Lock());
+    if (queue_.empty()) {
+      return false;
+    }
+
+    value = std::move(queue_.back());
+    queue_.pop_back();
+    return true;
+  }
+
+  bool Empty() const {
+    auto lock(Lock());
+    return queue_.empty();
+  }
+
+  // See ThreadsafeQueue::Contentions()
+  uint64_t Contentions() const {
+    return contentions_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::unique_lock<std::mutex> Lock() const {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      contentions_.fetch_add(1, std::memory_order_relaxed);
+      lock.lock();
+    }
+    return lock;
+  }
+
+  // Same as ThreadsafeQueue, the mutex is mutable so that Empty() can be a
+  // const method
+  mutable std::mutex mutex_;
+  std::deque<T> queue_;
+  mutable std::atomic<uint64_t> contentions_;
+};
+
+#endif // WORK_STEALING_QUEUE_H_
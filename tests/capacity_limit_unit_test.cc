@@ -0,0 +1,108 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/capacity_limit.h"
+
+// Without limits, every request fits and nothing is counted
+TEST(CapacityLimitUnitTest, Unlimited) {
+  CapacityLimit capacity(0, 0);
+  EXPECT_FALSE(capacity.Limited());
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_TRUE(capacity.TryAcquire(1, 1000));
+  }
+  EXPECT_EQ(capacity.Items(), 0u);
+  EXPECT_EQ(capacity.Bytes(), 0u);
+}
+
+// Requests fail once the item limit is reached, and fit again after a
+// release
+TEST(CapacityLimitUnitTest, ItemLimit) {
+  CapacityLimit capacity(3, 0);
+  EXPECT_TRUE(capacity.TryAcquire(2, 0));
+  EXPECT_TRUE(capacity.TryAcquire(1, 0));
+  EXPECT_FALSE(capacity.TryAcquire(1, 0));
+  EXPECT_EQ(capacity.Items(), 3u);
+
+  capacity.Release(1, 0);
+  EXPECT_TRUE(capacity.TryAcquire(1, 0));
+  EXPECT_FALSE(capacity.TryAcquire(1, 0));
+}
+
+// The byte limit works the same way, and a request larger than the whole
+// budget is only let in while nothing else is held
+TEST(CapacityLimitUnitTest, ByteLimit) {
+  CapacityLimit capacity(0, 100);
+  EXPECT_TRUE(capacity.TryAcquire(1, 60));
+  EXPECT_FALSE(capacity.TryAcquire(1, 60));
+  EXPECT_TRUE(capacity.TryAcquire(1, 40));
+  capacity.Release(2, 100);
+
+  EXPECT_TRUE(capacity.TryAcquire(1, 500));
+  EXPECT_FALSE(capacity.TryAcquire(1, 1));
+  capacity.Release(1, 500);
+  EXPECT_EQ(capacity.Bytes(), 0u);
+}
+
+// A forced acquisition goes over the limit
+TEST(CapacityLimitUnitTest, ForceAcquire) {
+  CapacityLimit capacity(1, 0);
+  capacity.ForceAcquire(1, 0);
+  capacity.ForceAcquire(1, 0);
+  EXPECT_EQ(capacity.Items(), 2u);
+  EXPECT_FALSE(capacity.TryAcquire(1, 0));
+}
+
+// A timed acquisition gives up at its deadline, and succeeds when room is
+// made before it
+TEST(CapacityLimitUnitTest, AcquireUntil) {
+  CapacityLimit capacity(1, 0);
+  capacity.Acquire(1, 0);
+
+  auto start(std::chrono::steady_clock::now());
+  EXPECT_FALSE(capacity.AcquireUntil(1, 0,
+      start + std::chrono::milliseconds(20)));
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(20));
+
+  std::thread releaser([&capacity] () {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    capacity.Release(1, 0);
+  });
+  EXPECT_TRUE(capacity.AcquireUntil(1, 0,
+      std::chrono::steady_clock::now() + std::chrono::seconds(10)));
+  releaser.join();
+}
+
+// Many producers and consumers never hold more than the limit at a time
+TEST(CapacityLimitUnitTest, ProducersAndConsumers) {
+  const std::size_t limit(4);
+  CapacityLimit capacity(limit, 0);
+  std::atomic<std::size_t> held(0);
+  std::atomic<std::size_t> max_held(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&] () {
+      for (int j = 0; j < 2000; j++) {
+        capacity.Acquire(1, 0);
+        auto now_held(++held);
+        auto seen(max_held.load());
+        while (now_held > seen &&
+               !max_held.compare_exchange_weak(seen, now_held)) {
+        }
+        held--;
+        capacity.Release(1, 0);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_LE(max_held.load(), limit);
+  EXPECT_EQ(capacity.Items(), 0u);
+}
@@ -0,0 +1,132 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+//
+// Only runs when built with C++20 coroutines, which the Bazel target asks
+// for with -std=c++20
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/threadpool.h"
+
+#ifdef DELAY_QUEUE_COROUTINES
+
+namespace {
+
+// A coroutine that starts right away and frees itself when it returns
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() {
+      return Detached();
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+// Sleep for {delay}, then report the thread it was resumed on
+Detached SleepAndReport(DelayQueue* delay_queue,
+                        TimerClock::duration delay,
+                        std::promise<std::thread::id>* resumed_on) {
+  co_await SleepFor(*delay_queue, delay);
+  resumed_on->set_value(std::this_thread::get_id());
+}
+
+// Move onto a worker of {threadpool}, then report the thread
+Detached ScheduleAndReport(ThreadPool* threadpool,
+                           std::promise<std::thread::id>* resumed_on) {
+  co_await ScheduleOn(*threadpool);
+  resumed_on->set_value(std::this_thread::get_id());
+}
+
+// Sleep {num_sleeps} times for a millisecond, then count down {pending}
+Detached SleepRepeatedly(DelayQueue* delay_queue, int num_sleeps,
+                         std::atomic<int>* pending,
+                         std::promise<void>* all_done) {
+  for (int i = 0; i < num_sleeps; i++) {
+    co_await SleepFor(*delay_queue, std::chrono::milliseconds(1));
+  }
+  if (--*pending == 0) {
+    all_done->set_value();
+  }
+}
+
+}  // namespace
+
+// A sleeping coroutine resumes on a worker once its delay has passed
+TEST(CoroutineUnitTest, Sleep) {
+  DelayQueue delay_queue;
+  std::promise<std::thread::id> resumed_on;
+  auto future(resumed_on.get_future());
+  auto start(TimerClock::now());
+  SleepAndReport(&delay_queue, std::chrono::milliseconds(20), &resumed_on);
+  auto thread(future.get());
+  EXPECT_GE(TimerClock::now() - start, std::chrono::milliseconds(20));
+  EXPECT_NE(thread, std::this_thread::get_id());
+}
+
+// A delay that has already passed does not suspend the coroutine
+TEST(CoroutineUnitTest, SleepWithoutDelay) {
+  DelayQueue delay_queue;
+  std::promise<std::thread::id> resumed_on;
+  auto future(resumed_on.get_future());
+  SleepAndReport(&delay_queue, TimerClock::duration::zero(), &resumed_on);
+  ASSERT_EQ(future.wait_for(std::chrono::seconds(0)),
+            std::future_status::ready);
+  EXPECT_EQ(future.get(), std::this_thread::get_id());
+}
+
+// ScheduleOn() moves a coroutine onto a worker of the pool
+TEST(CoroutineUnitTest, ScheduleOn) {
+  ThreadPoolOptions options;
+  options.num_threads = 1;
+  ThreadPool threadpool(options);
+  auto worker(threadpool.Submit([] () {
+    return std::this_thread::get_id();
+  }).get());
+
+  std::promise<std::thread::id> resumed_on;
+  auto future(resumed_on.get_future());
+  ScheduleAndReport(&threadpool, &resumed_on);
+  EXPECT_EQ(future.get(), worker);
+}
+
+// Many coroutines sleep at the same time without holding a thread each
+TEST(CoroutineUnitTest, ManySleepers) {
+  const int num_coroutines(10000);
+  ThreadPoolOptions options;
+  options.num_threads = 2;
+  DelayQueueOptions delay_queue_options;
+  delay_queue_options.thread_pool_options = options;
+  DelayQueue delay_queue(delay_queue_options);
+
+  std::atomic<int> pending{num_coroutines};
+  std::promise<void> all_done;
+  auto future(all_done.get_future());
+  for (int i = 0; i < num_coroutines; i++) {
+    SleepRepeatedly(&delay_queue, 3, &pending, &all_done);
+  }
+  EXPECT_EQ(future.wait_for(std::chrono::seconds(30)),
+            std::future_status::ready);
+}
+
+#else
+
+TEST(CoroutineUnitTest, Unsupported) {
+  GTEST_SKIP() << "Built without C++20 coroutines";
+}
+
+#endif
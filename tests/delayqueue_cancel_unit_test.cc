@@ -0,0 +1,132 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/timing_wheel.h"
+
+// Run every test against both timer backends
+class DelayQueueCancelUnitTest
+    : public ::testing::TestWithParam<TimerBackend> {
+ protected:
+  DelayQueueCancelUnitTest() : delay_queue_(MakeOptions(GetParam())) {}
+
+  static DelayQueueOptions MakeOptions(TimerBackend backend) {
+    DelayQueueOptions options;
+    options.timer_backend = backend;
+    return options;
+  }
+
+  DelayQueue delay_queue_;
+};
+
+// A cancelled task never runs, and its future reports a broken promise
+// right away instead of at the task's start time
+TEST_P(DelayQueueCancelUnitTest, CancelPendingTask) {
+  std::atomic<bool> ran{false};
+  auto task_future(delay_queue_.AddTask(60000, [&ran] () { ran = true; }));
+  EXPECT_TRUE(delay_queue_.Cancel(task_future.handle()));
+
+  try {
+    task_future.get();
+    FAIL() << "a cancelled task must not deliver a result";
+  } catch (const std::future_error& error) {
+    EXPECT_EQ(error.code(), std::future_errc::broken_promise);
+  }
+  EXPECT_FALSE(ran.load());
+}
+
+// A task can only be cancelled once, and not after it has been dispatched
+TEST_P(DelayQueueCancelUnitTest, CancelTwiceAndCancelAfterRun) {
+  auto pending(delay_queue_.AddTask(60000, [] () { return 1; }));
+  EXPECT_TRUE(delay_queue_.Cancel(pending.handle()));
+  EXPECT_FALSE(delay_queue_.Cancel(pending.handle()));
+
+  auto done(delay_queue_.AddTask(0, [] () { return 2; }));
+  EXPECT_EQ(done.get(), 2);
+  EXPECT_FALSE(delay_queue_.Cancel(done.handle()));
+
+  EXPECT_FALSE(delay_queue_.Cancel(TaskHandle()));
+}
+
+// Cancelling a task whose future has been dropped releases its captured
+// state immediately
+TEST_P(DelayQueueCancelUnitTest, CancelReleasesCapture) {
+  auto capture(std::make_shared<int>(42));
+  std::weak_ptr<int> weak_capture(capture);
+  TaskHandle handle;
+  {
+    auto task_future(delay_queue_.AddTask(60000,
+                                          [capture] () { return *capture; }));
+    handle = task_future.handle();
+  }
+  capture.reset();
+  EXPECT_FALSE(weak_capture.expired());
+
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+  EXPECT_TRUE(weak_capture.expired());
+}
+
+// Cancel most of a large batch of timeouts. The remaining tasks still run,
+// and none of the cancelled ones does
+TEST_P(DelayQueueCancelUnitTest, CancelMostOfManyTasks) {
+  int num_tasks(20000);
+  std::atomic<int> num_runs{0};
+  std::vector<TaskFuture<int>> task_futures;
+  for (int i = 0; i < num_tasks; i++) {
+    task_futures.push_back(delay_queue_.AddTask(1000 + i % 100,
+        [i, &num_runs] () { num_runs++; return i; }));
+  }
+
+  for (int i = 0; i < num_tasks; i++) {
+    if (i % 10 != 0) {
+      EXPECT_TRUE(delay_queue_.Cancel(task_futures[i].handle()));
+    }
+  }
+
+  for (int i = 0; i < num_tasks; i += 10) {
+    EXPECT_EQ(task_futures[i].get(), i);
+  }
+  EXPECT_EQ(num_runs.load(), num_tasks / 10);
+}
+
+INSTANTIATE_TEST_SUITE_P(TimerBackends, DelayQueueCancelUnitTest,
+                         ::testing::Values(TimerBackend::kBinaryHeap,
+                                           TimerBackend::kTimingWheel));
+
+// Compact() removes exactly the cancelled nodes from either timer structure
+TEST(TimerQueueCompactUnitTest, CompactRemovesCancelledNodes) {
+  auto start(TimerClock::now());
+  std::unique_ptr<TimerQueue> queues[] = {
+      std::unique_ptr<TimerQueue>(new TimerHeap()),
+      std::unique_ptr<TimerQueue>(
+          new TimingWheel(std::chrono::milliseconds(1), start))};
+
+  for (auto& queue : queues) {
+    std::vector<TaskHandle> handles;
+    for (int i = 0; i < 1000; i++) {
+      auto node(new TimerNode(start + std::chrono::milliseconds(i * 37),
+                              FunctionWrapper([] () {})));
+      handles.emplace_back(node);
+      queue->Push(node);
+      if (i % 3 != 0) {
+        node->TryCancel();
+      }
+    }
+
+    EXPECT_EQ(queue->Compact(), 666u);
+    EXPECT_EQ(queue->Size(), 334u);
+    int popped(0);
+    while (auto node = queue->PopExpired(start + std::chrono::hours(1))) {
+      EXPECT_FALSE(node->Cancelled());
+      node->Release();
+      popped++;
+    }
+    EXPECT_EQ(popped, 334);
+  }
+}
@@ -0,0 +1,191 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+
+namespace {
+
+DelayQueueOptions MakeOptions(std::size_t max_pending_tasks,
+                              std::size_t max_pending_bytes) {
+  DelayQueueOptions options;
+  options.max_pending_tasks = max_pending_tasks;
+  options.max_pending_bytes = max_pending_bytes;
+  return options;
+}
+
+}  // namespace
+
+// Insertions fail once the limit of pending tasks is reached
+TEST(DelayQueueCapacityUnitTest, TryPostFailsWhenFull) {
+  DelayQueue delay_queue(MakeOptions(10, 0));
+  std::vector<TaskHandle> handles;
+  for (int i = 0; i < 10; i++) {
+    handles.push_back(delay_queue.TryPost(60000, [] () {}));
+    EXPECT_TRUE(handles.back().Valid());
+  }
+  EXPECT_FALSE(delay_queue.TryPost(60000, [] () {}).Valid());
+  EXPECT_FALSE(delay_queue.TryAddTask(60000, [] () {}).valid());
+
+  // A cancelled task gives its room back right away
+  EXPECT_TRUE(delay_queue.Cancel(handles[0]));
+  EXPECT_TRUE(delay_queue.TryPost(60000, [] () {}).Valid());
+  EXPECT_FALSE(delay_queue.TryPost(60000, [] () {}).Valid());
+}
+
+// A dispatched task gives its room back
+TEST(DelayQueueCapacityUnitTest, DispatchMakesRoom) {
+  DelayQueue delay_queue(MakeOptions(1, 0));
+  auto future(delay_queue.TryAddTask(10, [] () { return 1; }));
+  ASSERT_TRUE(future.valid());
+  EXPECT_EQ(future.get(), 1);
+
+  // The room comes back as a worker starts the task
+  auto retry_until(TimerClock::now() + std::chrono::seconds(10));
+  TaskFuture<int> next;
+  while (!next.valid() && TimerClock::now() < retry_until) {
+    next = delay_queue.TryAddTask(0, [] () { return 2; });
+  }
+  ASSERT_TRUE(next.valid());
+  EXPECT_EQ(next.get(), 2);
+}
+
+// A timed insertion gives up when no room comes up in time, and succeeds
+// when a task is dispatched in the meantime
+TEST(DelayQueueCapacityUnitTest, TryAddTaskFor) {
+  DelayQueue delay_queue(MakeOptions(1, 0));
+  auto handle(delay_queue.Post(60000, [] () {}));
+
+  auto start(TimerClock::now());
+  EXPECT_FALSE(delay_queue.TryAddTaskFor(std::chrono::milliseconds(20),
+      std::chrono::milliseconds(0), [] () {}).valid());
+  EXPECT_GE(TimerClock::now() - start, std::chrono::milliseconds(20));
+
+  EXPECT_TRUE(delay_queue.Reschedule(handle, 10));
+  auto future(delay_queue.TryAddTaskFor(std::chrono::seconds(10),
+      std::chrono::milliseconds(0), [] () { return 3; }));
+  ASSERT_TRUE(future.valid());
+  EXPECT_EQ(future.get(), 3);
+  EXPECT_TRUE(delay_queue.TryPostFor(std::chrono::seconds(10),
+      std::chrono::milliseconds(0), [] () {}).Valid());
+}
+
+// A blocking insertion waits until a pending task leaves the queue
+TEST(DelayQueueCapacityUnitTest, PostBlocksUntilRoom) {
+  DelayQueue delay_queue(MakeOptions(2, 0));
+  delay_queue.Post(30, [] () {});
+  delay_queue.Post(30, [] () {});
+
+  auto start(TimerClock::now());
+  std::promise<void> done;
+  delay_queue.Post(0, [&done] () { done.set_value(); });
+  EXPECT_GE(TimerClock::now() - start, std::chrono::milliseconds(25));
+  EXPECT_EQ(done.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+}
+
+// The byte limit counts the callables that do not fit into the node
+TEST(DelayQueueCapacityUnitTest, ByteLimit) {
+  DelayQueue delay_queue(MakeOptions(0, 4 * sizeof(TimerNode)));
+  std::array<char, 1024> payload{};
+
+  // Small callables only cost their node
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(delay_queue.TryPost(60000, [] () {}).Valid());
+  }
+  EXPECT_FALSE(delay_queue.TryPost(60000, [] () {}).Valid());
+
+  DelayQueue large_queue(MakeOptions(0, 4 * (sizeof(TimerNode) + 1024)));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(large_queue.TryPost(60000, [payload] () {}).Valid());
+  }
+  EXPECT_FALSE(large_queue.TryPost(60000, [payload] () {}).Valid());
+}
+
+// A periodic task holds its room until the series is cancelled
+TEST(DelayQueueCapacityUnitTest, PeriodicTaskHoldsRoom) {
+  // Declared before the delay queue, as a run may still be in flight when
+  // the test ends
+  std::atomic<int> runs(0);
+  DelayQueue delay_queue(MakeOptions(1, 0));
+  auto handle(delay_queue.PostPeriodic(std::chrono::milliseconds(0),
+      std::chrono::milliseconds(1), [&runs] () { runs++; }));
+  while (runs.load() < 3) {
+    std::this_thread::yield();
+  }
+  EXPECT_FALSE(delay_queue.TryPost(60000, [] () {}).Valid());
+
+  EXPECT_TRUE(delay_queue.Cancel(handle));
+  EXPECT_TRUE(delay_queue.TryPost(60000, [] () {}).Valid());
+}
+
+// With limits on both the delay queue and its thread pool, the dispatch
+// thread does not wait for room in the pool: the workers block in Post()
+// until the dispatch thread makes room, so waiting for the workers would
+// stop every timer for good
+TEST(DelayQueueCapacityUnitTest, BoundedThreadPool) {
+  auto options(MakeOptions(2, 0));
+  options.thread_pool_options.num_threads = 1;
+  options.thread_pool_options.max_queued_jobs = 1;
+  std::atomic<int> num_done{0};
+  std::promise<void> all_done;
+  int num_tasks(20);
+  DelayQueue delay_queue(options);
+
+  for (int i = 0; i < num_tasks; i++) {
+    delay_queue.Post(std::chrono::milliseconds(1), [&] () {
+      // Each task adds a follow-up task from the worker
+      delay_queue.Post(std::chrono::milliseconds(1), [&] () {
+        if (++num_done == num_tasks) {
+          all_done.set_value();
+        }
+      });
+    });
+  }
+  EXPECT_EQ(all_done.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+}
+
+// Short-delay tasks that come in faster than a single worker runs them keep
+// their room until they start, so the pool queue stays within the limits of
+// the delay queue although the dispatch thread never waits for the pool
+TEST(DelayQueueCapacityUnitTest, FloodStaysWithinLimits) {
+  ThreadPoolOptions pool_options;
+  pool_options.num_threads = 1;
+  pool_options.max_queued_jobs = 4;
+  ThreadPool pool(pool_options);
+  auto options(MakeOptions(4, 0));
+  options.thread_pool = &pool;
+  std::atomic<std::size_t> max_queued{0};
+  std::atomic<int> num_done{0};
+  int num_tasks(200);
+  DelayQueue delay_queue(options);
+
+  auto record_queued([&] () {
+    auto queued(pool.QueuedJobs());
+    auto seen(max_queued.load());
+    while (queued > seen && !max_queued.compare_exchange_weak(seen, queued)) {
+    }
+  });
+  for (int i = 0; i < num_tasks; i++) {
+    delay_queue.Post(std::chrono::microseconds(i % 2 * 100), [&] () {
+      record_queued();
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      num_done++;
+    });
+    record_queued();
+  }
+  auto wait_until(TimerClock::now() + std::chrono::seconds(10));
+  while (num_done.load() < num_tasks && TimerClock::now() < wait_until) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(num_done.load(), num_tasks);
+  EXPECT_LE(max_queued.load(), 4u);
+}
@@ -0,0 +1,195 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+
+class DelayQueuePeriodicUnitTest
+    : public ::testing::TestWithParam<TimerBackend> {
+ protected:
+  DelayQueuePeriodicUnitTest() : errors_(0),
+      delay_queue_(MakeOptions(GetParam(), &errors_)) {}
+
+  static DelayQueueOptions MakeOptions(TimerBackend backend,
+                                       std::atomic<int>* errors) {
+    DelayQueueOptions options;
+    options.timer_backend = backend;
+    options.thread_pool_options.error_handler =
+        [errors] (std::exception_ptr) { (*errors)++; };
+    return options;
+  }
+
+  // Record the start time of every run, and signal {done} on the
+  // {num_runs}-th one. The tasks share it, as a run that is in flight when
+  // a test cancels its series may still use it after the test
+  struct Recorder {
+    explicit Recorder(int num_runs) : num_runs(num_runs) {}
+
+    void Run() {
+      std::lock_guard<std::mutex> lock(mutex);
+      starts.push_back(TimerClock::now());
+      if (static_cast<int>(starts.size()) == num_runs) {
+        done.set_value();
+      }
+    }
+
+    bool Wait() {
+      return done.get_future().wait_for(std::chrono::seconds(30)) ==
+             std::future_status::ready;
+    }
+
+    int num_runs;
+    std::mutex mutex;
+    std::vector<TimerClock::time_point> starts;
+    std::promise<void> done;
+  };
+
+  std::atomic<int> errors_;
+  DelayQueue delay_queue_;
+};
+
+// A fixed-rate task runs on the grid of its first start time, never early
+TEST_P(DelayQueuePeriodicUnitTest, FixedRate) {
+  auto period(std::chrono::milliseconds(5));
+  auto recorder(std::make_shared<Recorder>(10));
+  auto start(TimerClock::now());
+  auto handle(delay_queue_.PostPeriodic(period, period,
+                                        [recorder] () { recorder->Run(); }));
+  ASSERT_TRUE(recorder->Wait());
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  for (std::size_t i = 0; i < 10; i++) {
+    EXPECT_GE(recorder->starts[i] - start, period * (i + 1));
+  }
+}
+
+// A fixed-delay task waits a full period after the end of every run
+TEST_P(DelayQueuePeriodicUnitTest, FixedDelay) {
+  auto period(std::chrono::milliseconds(5));
+  auto run_time(std::chrono::milliseconds(3));
+  auto recorder(std::make_shared<Recorder>(5));
+  auto handle(delay_queue_.PostPeriodic(TimerClock::duration::zero(), period,
+      [recorder, run_time] () {
+        recorder->Run();
+        std::this_thread::sleep_for(run_time);
+      }, PeriodicMode::kFixedDelay));
+  ASSERT_TRUE(recorder->Wait());
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  for (std::size_t i = 1; i < 5; i++) {
+    EXPECT_GE(recorder->starts[i] - recorder->starts[i - 1],
+              period + run_time);
+  }
+}
+
+// A fixed-rate run that overruns its period skips the start times that have
+// passed, instead of running late right after
+TEST_P(DelayQueuePeriodicUnitTest, SkipsMissedRuns) {
+  auto period(std::chrono::milliseconds(10));
+  auto recorder(std::make_shared<Recorder>(2));
+  auto start(TimerClock::now());
+  auto handle(delay_queue_.PostPeriodic(TimerClock::duration::zero(), period,
+      [recorder] () {
+        recorder->Run();
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        if (recorder->starts.size() == 1) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(35));
+        }
+      }));
+  ASSERT_TRUE(recorder->Wait());
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+
+  // The first run ends after 35ms, past the start times at 10, 20 and 30ms
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  EXPECT_GE(recorder->starts[1] - start, std::chrono::milliseconds(40));
+}
+
+// A task can cancel its own series from within a run
+TEST_P(DelayQueuePeriodicUnitTest, CancelDuringRun) {
+  std::promise<TaskHandle> handle_promise;
+  std::shared_future<TaskHandle> handle(handle_promise.get_future());
+  std::atomic<int> runs(0);
+  std::atomic<bool> cancelled(false);
+  handle_promise.set_value(delay_queue_.PostPeriodic(
+      TimerClock::duration::zero(), std::chrono::milliseconds(1),
+      [this, &runs, &cancelled, handle] () {
+        if (++runs == 3) {
+          cancelled = delay_queue_.Cancel(handle.get());
+        }
+      }));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(cancelled.load());
+  EXPECT_EQ(runs.load(), 3);
+  EXPECT_FALSE(delay_queue_.Cancel(handle.get()));
+}
+
+// A series cancelled before its first run never runs
+TEST_P(DelayQueuePeriodicUnitTest, CancelBeforeFirstRun) {
+  std::atomic<int> runs(0);
+  auto handle(delay_queue_.PostPeriodic(std::chrono::milliseconds(20),
+                                        std::chrono::milliseconds(1),
+                                        [&runs] () { runs++; }));
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(runs.load(), 0);
+}
+
+// Moving the next run of a waiting task
+TEST_P(DelayQueuePeriodicUnitTest, Reschedule) {
+  auto recorder(std::make_shared<Recorder>(2));
+  auto handle(delay_queue_.PostPeriodic(std::chrono::hours(1),
+                                        std::chrono::milliseconds(5),
+                                        [recorder] () { recorder->Run(); }));
+  EXPECT_TRUE(delay_queue_.Reschedule(handle, 0));
+  ASSERT_TRUE(recorder->Wait());
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+}
+
+// An exception goes to the error handler and the series goes on
+TEST_P(DelayQueuePeriodicUnitTest, ExceptionsKeepTheSeries) {
+  auto recorder(std::make_shared<Recorder>(5));
+  auto handle(delay_queue_.PostPeriodic(TimerClock::duration::zero(),
+      std::chrono::milliseconds(1), [recorder] () {
+        recorder->Run();
+        throw std::runtime_error("periodic failure");
+      }));
+  ASSERT_TRUE(recorder->Wait());
+  EXPECT_TRUE(delay_queue_.Cancel(handle));
+
+  // A run arms the next one before its exception reaches the handler
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_GE(errors_.load(), 5);
+}
+
+// Destroying a delay queue with many series in flight neither hangs nor
+// leaks the nodes
+TEST_P(DelayQueuePeriodicUnitTest, DestroyWithRunningSeries) {
+  auto counter(std::make_shared<std::atomic<int>>(0));
+  {
+    DelayQueue delay_queue(MakeOptions(GetParam(), &errors_));
+    for (int i = 0; i < 100; i++) {
+      delay_queue.PostPeriodic(TimerClock::duration::zero(),
+                               std::chrono::microseconds(100 + i),
+                               [counter] () { (*counter)++; });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  EXPECT_GT(counter->load(), 0);
+  EXPECT_EQ(counter.use_count(), 1);
+}
+
+INSTANTIATE_TEST_SUITE_P(TimerBackends, DelayQueuePeriodicUnitTest,
+                         ::testing::Values(TimerBackend::kBinaryHeap,
+                                           TimerBackend::kTimingWheel));
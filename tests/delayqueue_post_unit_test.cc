@@ -0,0 +1,166 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/threadpool.h"
+
+// Posted jobs run on the pool without a future
+TEST(ThreadPoolPostUnitTest, PostedJobsRun) {
+  ThreadPool threadpool;
+  int num_jobs(10000);
+  std::atomic<int> num_done{0};
+  std::promise<void> all_done;
+  for (int i = 0; i < num_jobs; i++) {
+    threadpool.Post([&] () {
+      if (++num_done == num_jobs) {
+        all_done.set_value();
+      }
+    });
+  }
+  all_done.get_future().wait();
+  EXPECT_EQ(num_done.load(), num_jobs);
+}
+
+// The exception of a posted job reaches the error handler, and the worker
+// thread keeps running jobs afterwards
+TEST(ThreadPoolPostUnitTest, ExceptionGoesToErrorHandler) {
+  std::promise<std::string> error;
+  ThreadPoolOptions options;
+  options.error_handler = [&error] (std::exception_ptr exception) {
+    try {
+      std::rethrow_exception(exception);
+    } catch (const std::runtime_error& runtime_error) {
+      error.set_value(runtime_error.what());
+    }
+  };
+  ThreadPool threadpool(options);
+
+  threadpool.Post([] () { throw std::runtime_error("posted"); });
+  EXPECT_EQ(error.get_future().get(), "posted");
+  EXPECT_EQ(threadpool.Submit([] () { return 1; }).get(), 1);
+}
+
+// Without an error handler, the exception of a posted job is dropped
+TEST(ThreadPoolPostUnitTest, ExceptionWithoutErrorHandler) {
+  ThreadPool threadpool;
+  threadpool.Post([] () { throw std::runtime_error("dropped"); });
+  EXPECT_EQ(threadpool.Submit([] () { return 2; }).get(), 2);
+}
+
+// A posted task runs after its delay
+TEST(DelayQueuePostUnitTest, PostedTaskRunsAfterDelay) {
+  DelayQueue delay_queue;
+  std::promise<TimerClock::time_point> ran_at;
+  auto start(TimerClock::now());
+  delay_queue.Post(100, [&ran_at] () { ran_at.set_value(TimerClock::now()); });
+  EXPECT_GE(ran_at.get_future().get() - start, std::chrono::milliseconds(100));
+}
+
+// A posted task can be cancelled and rescheduled through its handle
+TEST(DelayQueuePostUnitTest, CancelAndReschedulePostedTask) {
+  DelayQueue delay_queue;
+  std::atomic<bool> cancelled_ran{false};
+  auto cancelled(delay_queue.Post(60000, [&] () { cancelled_ran = true; }));
+  EXPECT_TRUE(delay_queue.Cancel(cancelled));
+
+  std::promise<void> done;
+  auto rescheduled(delay_queue.Post(60000, [&done] () { done.set_value(); }));
+  EXPECT_TRUE(delay_queue.Reschedule(rescheduled, 10));
+  done.get_future().wait();
+  EXPECT_FALSE(delay_queue.Cancel(rescheduled));
+  EXPECT_FALSE(cancelled_ran.load());
+}
+
+// The exception of a posted task goes to the error handler of the delay
+// queue's thread pool
+TEST(DelayQueuePostUnitTest, ExceptionGoesToErrorHandler) {
+  std::promise<void> error;
+  DelayQueueOptions options;
+  options.thread_pool_options.error_handler =
+      [&error] (std::exception_ptr) { error.set_value(); };
+  DelayQueue delay_queue(options);
+
+  delay_queue.Post(10, [] () { throw std::runtime_error("posted"); });
+  EXPECT_EQ(error.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+}
+
+// Among tasks that are due together, a high priority task runs first even
+// when it was added last
+TEST(DelayQueuePostUnitTest, HighPriorityRunsFirst) {
+  DelayQueueOptions options;
+  options.thread_pool_options.num_threads = 1;
+  options.thread_pool_options.starvation_limit = 0;
+  DelayQueue delay_queue(options);
+
+  // Keep the only worker busy until every task has been dispatched
+  auto start_time(TimerClock::now() + std::chrono::milliseconds(20));
+  delay_queue.Post(0, [start_time] () {
+    std::this_thread::sleep_until(start_time + std::chrono::milliseconds(50));
+  });
+
+  std::mutex mutex;
+  std::vector<TaskPriority> order;
+  std::promise<void> all_done;
+  const std::size_t num_tasks(21);
+  for (std::size_t i = 0; i < num_tasks; i++) {
+    auto priority(i + 1 < num_tasks ? TaskPriority::kNormal
+                                    : TaskPriority::kHigh);
+    delay_queue.PostAt(start_time, [&, priority] () {
+      // Signal after unlocking, as the mutex is gone once the test wakes
+      std::unique_lock<std::mutex> lock(mutex);
+      order.push_back(priority);
+      if (order.size() == num_tasks) {
+        lock.unlock();
+        all_done.set_value();
+      }
+    }, TimerClock::duration::zero(), priority);
+  }
+
+  all_done.get_future().wait();
+  EXPECT_EQ(order.front(), TaskPriority::kHigh);
+}
+
+// A batch of posted tasks runs in the order of the start times, and its
+// handles can cancel single tasks
+TEST(DelayQueuePostUnitTest, PostTasksAt) {
+  DelayQueueOptions options;
+  options.thread_pool_options.num_threads = 1;
+  DelayQueue delay_queue(options);
+
+  std::mutex mutex;
+  std::vector<int> order;
+  std::promise<void> all_done;
+  std::vector<std::pair<TimerClock::time_point, std::function<void()>>> tasks;
+  auto start_time(TimerClock::now() + std::chrono::milliseconds(10));
+  for (int i = 0; i < 10; i++) {
+    tasks.emplace_back(start_time + std::chrono::milliseconds(10 - i),
+                       [&, i] () {
+      std::unique_lock<std::mutex> lock(mutex);
+      order.push_back(i);
+      if (order.size() == 9) {
+        lock.unlock();
+        all_done.set_value();
+      }
+    });
+  }
+  auto handles(delay_queue.PostTasksAt(std::move(tasks)));
+  ASSERT_EQ(handles.size(), 10u);
+  EXPECT_TRUE(delay_queue.Cancel(handles[4]));
+
+  all_done.get_future().wait();
+  EXPECT_EQ(order, (std::vector<int>{9, 8, 7, 6, 5, 3, 2, 1, 0}));
+}
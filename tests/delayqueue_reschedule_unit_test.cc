@@ -0,0 +1,132 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/timing_wheel.h"
+
+// Run every test against both timer backends
+class DelayQueueRescheduleUnitTest
+    : public ::testing::TestWithParam<TimerBackend> {
+ protected:
+  DelayQueueRescheduleUnitTest() : delay_queue_(MakeOptions(GetParam())) {}
+
+  static DelayQueueOptions MakeOptions(TimerBackend backend) {
+    DelayQueueOptions options;
+    options.timer_backend = backend;
+    return options;
+  }
+
+  // Milliseconds elapsed since {start}
+  static int64_t ElapsedSince(TimerClock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        TimerClock::now() - start).count();
+  }
+
+  DelayQueue delay_queue_;
+};
+
+// Pushing a task back delays its execution to the new start time
+TEST_P(DelayQueueRescheduleUnitTest, Postpone) {
+  auto start(TimerClock::now());
+  auto task_future(delay_queue_.AddTask(100, [] () { return 1; }));
+  EXPECT_TRUE(delay_queue_.Reschedule(task_future.handle(), 400));
+  EXPECT_EQ(task_future.get(), 1);
+  EXPECT_GE(ElapsedSince(start), 400);
+}
+
+// Pulling a task in runs it at the earlier start time
+TEST_P(DelayQueueRescheduleUnitTest, Advance) {
+  auto start(TimerClock::now());
+  auto task_future(delay_queue_.AddTask(60000, [] () { return 2; }));
+  EXPECT_TRUE(delay_queue_.Reschedule(task_future.handle(), 50));
+  EXPECT_EQ(task_future.get(), 2);
+  EXPECT_LT(ElapsedSince(start), 10000);
+}
+
+// Move a task to an absolute start time
+TEST_P(DelayQueueRescheduleUnitTest, RescheduleAt) {
+  auto start(TimerClock::now());
+  auto task_future(delay_queue_.AddTask(60000, [] () { return 6; }));
+  EXPECT_TRUE(delay_queue_.RescheduleAt(task_future.handle(),
+                                        start + std::chrono::milliseconds(50)));
+  EXPECT_EQ(task_future.get(), 6);
+  EXPECT_GE(ElapsedSince(start), 50);
+  EXPECT_LT(ElapsedSince(start), 10000);
+}
+
+// Reset an idle timer many times before it finally expires
+TEST_P(DelayQueueRescheduleUnitTest, RepeatedReset) {
+  auto task_future(delay_queue_.AddTask(100, [] () { return 3; }));
+  for (int i = 0; i < 10000; i++) {
+    EXPECT_TRUE(delay_queue_.Reschedule(task_future.handle(), 100));
+  }
+  EXPECT_EQ(task_future.get(), 3);
+}
+
+// A task cannot be rescheduled once it has run or has been cancelled
+TEST_P(DelayQueueRescheduleUnitTest, RescheduleFinishedOrCancelledTask) {
+  auto done(delay_queue_.AddTask(0, [] () { return 4; }));
+  EXPECT_EQ(done.get(), 4);
+  EXPECT_FALSE(delay_queue_.Reschedule(done.handle(), 100));
+
+  auto cancelled(delay_queue_.AddTask(60000, [] () { return 5; }));
+  EXPECT_TRUE(delay_queue_.Cancel(cancelled.handle()));
+  EXPECT_FALSE(delay_queue_.Reschedule(cancelled.handle(), 0));
+
+  EXPECT_FALSE(delay_queue_.Reschedule(TaskHandle(), 0));
+}
+
+INSTANTIATE_TEST_SUITE_P(TimerBackends, DelayQueueRescheduleUnitTest,
+                         ::testing::Values(TimerBackend::kBinaryHeap,
+                                           TimerBackend::kTimingWheel));
+
+// Randomly moved nodes still come out of either timer structure in the
+// order of their new start times, and never early
+TEST(TimerQueueRescheduleUnitTest, RandomReschedule) {
+  auto start(TimerClock::now());
+  std::unique_ptr<TimerQueue> queues[] = {
+      std::unique_ptr<TimerQueue>(new TimerHeap()),
+      std::unique_ptr<TimerQueue>(
+          new TimingWheel(std::chrono::milliseconds(1), start))};
+
+  std::srand(42);
+  for (auto& queue : queues) {
+    int num_nodes(5000);
+    std::vector<TimerNode*> nodes;
+    for (int i = 0; i < num_nodes; i++) {
+      nodes.push_back(new TimerNode(
+          start + std::chrono::milliseconds(std::rand() % 100000),
+          FunctionWrapper([] () {})));
+      queue->Push(nodes.back());
+    }
+
+    for (int i = 0; i < 20000; i++) {
+      auto node(nodes[std::rand() % num_nodes]);
+      queue->Reschedule(node,
+          start + std::chrono::milliseconds(std::rand() % 100000));
+    }
+
+    int popped(0);
+    auto now(start);
+    auto last_start_time(start);
+    while (!queue->Empty()) {
+      now += std::chrono::milliseconds(1);
+      while (auto node = queue->PopExpired(now)) {
+        EXPECT_LE(node->start_time_, now);
+        EXPECT_GE(node->start_time_ + std::chrono::milliseconds(1),
+                  last_start_time);
+        last_start_time = node->start_time_;
+        node->Release();
+        popped++;
+      }
+    }
+    EXPECT_EQ(popped, num_nodes);
+  }
+}
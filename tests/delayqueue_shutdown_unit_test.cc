@@ -0,0 +1,176 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/threadpool.h"
+
+// A drain runs the tasks that are due before the deadline, and returns as
+// soon as only later tasks are left, which it drops
+TEST(DelayQueueShutdownUnitTest, DrainRunsDueTasks) {
+  DelayQueue delay_queue;
+  std::atomic<int> num_done{0};
+  for (int i = 0; i < 20; i++) {
+    delay_queue.Post(std::chrono::milliseconds(10 + i),
+                     [&num_done] () { num_done++; });
+  }
+  auto late(delay_queue.AddTask(std::chrono::hours(1), [] () {}));
+
+  auto start_time(TimerClock::now());
+  auto report(delay_queue.Shutdown(ShutdownMode::kDrain,
+                                   start_time + std::chrono::seconds(10)));
+  EXPECT_LT(TimerClock::now() - start_time, std::chrono::seconds(5));
+  EXPECT_EQ(num_done.load(), 20);
+  EXPECT_EQ(report.dispatched, 20u);
+  EXPECT_EQ(report.dropped, 1u);
+  EXPECT_FALSE(report.timed_out);
+  EXPECT_THROW(late.get(), std::future_error);
+}
+
+// Tasks that the running tasks add are drained too
+TEST(DelayQueueShutdownUnitTest, DrainFollowsNewTasks) {
+  DelayQueue delay_queue;
+  std::atomic<int> num_done{0};
+  delay_queue.Post(std::chrono::milliseconds(5), [&] () {
+    delay_queue.Post(std::chrono::milliseconds(5), [&] () {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      delay_queue.Post(std::chrono::milliseconds(5), [&] () { num_done++; });
+      num_done++;
+    });
+    num_done++;
+  });
+
+  auto report(delay_queue.Shutdown(
+      ShutdownMode::kDrain, TimerClock::now() + std::chrono::seconds(10)));
+  EXPECT_EQ(num_done.load(), 3);
+  EXPECT_EQ(report.dispatched, 3u);
+  EXPECT_EQ(report.dropped, 0u);
+}
+
+// All pending tasks run right away, spread over the workers
+TEST(DelayQueueShutdownUnitTest, RunPendingRunsEverythingNow) {
+  DelayQueue delay_queue;
+  std::vector<std::future<int>> futures;
+  for (int i = 0; i < 100; i++) {
+    futures.push_back(delay_queue.AddTask(std::chrono::hours(1 + i),
+                                          [i] () { return i; }));
+  }
+  delay_queue.Post(std::chrono::minutes(1), [] () {});
+
+  auto start_time(TimerClock::now());
+  auto report(delay_queue.Shutdown(ShutdownMode::kRunPending,
+                                   start_time + std::chrono::seconds(10)));
+  EXPECT_LT(TimerClock::now() - start_time, std::chrono::seconds(5));
+  EXPECT_EQ(report.dispatched, 101u);
+  EXPECT_EQ(report.dropped, 0u);
+  EXPECT_EQ(report.running, 0u);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(futures[i].get(), i);
+  }
+}
+
+// Discarding drops every pending task and counts it, while cancelled tasks
+// do not count
+TEST(DelayQueueShutdownUnitTest, DiscardReportsDroppedTasks) {
+  DelayQueueOptions options;
+  options.timer_backend = TimerBackend::kTimingWheel;
+  DelayQueue delay_queue(options);
+  std::atomic<int> num_done{0};
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < 50; i++) {
+    futures.push_back(delay_queue.AddTask(std::chrono::seconds(10 + i),
+                                          [&num_done] () { num_done++; }));
+  }
+  EXPECT_TRUE(delay_queue.Cancel(
+      delay_queue.Post(std::chrono::seconds(1), [] () {})));
+
+  auto report(delay_queue.Shutdown(
+      ShutdownMode::kDiscard, TimerClock::now() + std::chrono::seconds(10)));
+  EXPECT_EQ(report.dispatched, 0u);
+  EXPECT_EQ(report.dropped, 50u);
+  EXPECT_FALSE(report.timed_out);
+  for (auto& future : futures) {
+    EXPECT_THROW(future.get(), std::future_error);
+  }
+  EXPECT_EQ(num_done.load(), 0);
+}
+
+// The deadline bounds the shutdown: the jobs that no worker has started by
+// then are dropped, and the running ones are reported
+TEST(DelayQueueShutdownUnitTest, DeadlineBoundsShutdown) {
+  DelayQueueOptions options;
+  options.thread_pool_options.num_threads = 1;
+  DelayQueue delay_queue(options);
+  std::atomic<int> num_done{0};
+  for (int i = 0; i < 20; i++) {
+    delay_queue.Post(std::chrono::hours(1), [&num_done] () {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      num_done++;
+    });
+  }
+
+  auto deadline(TimerClock::now() + std::chrono::milliseconds(120));
+  auto report(delay_queue.Shutdown(ShutdownMode::kRunPending, deadline));
+  EXPECT_LT(TimerClock::now(), deadline + std::chrono::milliseconds(40));
+  EXPECT_TRUE(report.timed_out);
+  EXPECT_EQ(report.dispatched, 20u);
+  EXPECT_LE(report.running, 1u);
+  EXPECT_GT(report.dropped, 0u);
+  // Let the running job finish
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(num_done.load() + report.dropped, 20u);
+}
+
+// With a bounded thread pool, the dispatch thread keeps to its limit until
+// the deadline, and drops and counts the tasks that do not fit by then
+TEST(DelayQueueShutdownUnitTest, BoundedThreadPool) {
+  ThreadPoolOptions pool_options;
+  pool_options.num_threads = 1;
+  pool_options.max_queued_jobs = 1;
+  ThreadPool thread_pool(pool_options);
+  std::atomic<int> num_done{0};
+  DelayQueueOptions options;
+  options.thread_pool = &thread_pool;
+  DelayQueue delay_queue(options);
+  for (int i = 0; i < 20; i++) {
+    delay_queue.Post(std::chrono::hours(1), [&num_done] () {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      num_done++;
+    });
+  }
+
+  auto deadline(TimerClock::now() + std::chrono::milliseconds(100));
+  auto report(delay_queue.Shutdown(ShutdownMode::kRunPending, deadline));
+  EXPECT_LT(TimerClock::now(), deadline + std::chrono::milliseconds(40));
+  EXPECT_TRUE(report.timed_out);
+  EXPECT_EQ(report.dispatched + report.dropped, 20u);
+  EXPECT_GT(report.dropped, 0u);
+  // The jobs that were queued in time still run on the shared pool
+  thread_pool.Drain(TimerClock::time_point::max());
+  EXPECT_EQ(static_cast<std::size_t>(num_done.load()), report.dispatched);
+}
+
+// Periodic tasks stop after their pending run
+TEST(DelayQueueShutdownUnitTest, PeriodicTasksStop) {
+  DelayQueue delay_queue;
+  std::atomic<int> num_runs{0};
+  auto handle(delay_queue.PostPeriodic(std::chrono::milliseconds(1),
+                                       std::chrono::milliseconds(1),
+                                       [&num_runs] () { num_runs++; }));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  auto start_time(TimerClock::now());
+  delay_queue.Shutdown(ShutdownMode::kDrain,
+                       start_time + std::chrono::seconds(10));
+  EXPECT_LT(TimerClock::now() - start_time, std::chrono::seconds(5));
+  auto num_runs_at_shutdown(num_runs.load());
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(num_runs.load(), num_runs_at_shutdown);
+  EXPECT_FALSE(delay_queue.Cancel(handle));
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <chrono>
+#include <future>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/timer_queue.h"
+
+// The coalesced start time always lies within the slack window
+TEST(CoalesceStartTimeUnitTest, StaysWithinWindow) {
+  std::mt19937_64 generator(42);
+  std::uniform_int_distribution<TimerClock::rep> offsets(0, 1000000000);
+  std::uniform_int_distribution<TimerClock::rep> slacks(0, 10000000);
+  auto base(TimerClock::now());
+  for (int i = 0; i < 100000; i++) {
+    auto earliest(base + TimerClock::duration(offsets(generator)));
+    TimerClock::duration slack(slacks(generator));
+    auto start(CoalesceStartTime(earliest, slack));
+    EXPECT_GE(start, earliest);
+    EXPECT_LE(start, earliest + slack);
+  }
+
+  EXPECT_EQ(CoalesceStartTime(base, TimerClock::duration::zero()), base);
+}
+
+// Start times a few microseconds apart collapse onto a handful of distinct
+// times once they are given a millisecond of slack
+TEST(CoalesceStartTimeUnitTest, MergesNearbyStartTimes) {
+  auto base(TimerClock::now());
+  std::set<TimerClock::time_point> exact;
+  std::set<TimerClock::time_point> coalesced;
+  for (int i = 0; i < 1000; i++) {
+    auto earliest(base + std::chrono::microseconds(i * 7));
+    exact.insert(CoalesceStartTime(earliest, TimerClock::duration::zero()));
+    coalesced.insert(CoalesceStartTime(earliest,
+                                       std::chrono::milliseconds(1)));
+  }
+  EXPECT_EQ(exact.size(), 1000u);
+  EXPECT_LE(coalesced.size(), 20u);
+}
+
+class DelayQueueSlackUnitTest
+    : public ::testing::TestWithParam<TimerBackend> {
+ protected:
+  DelayQueueSlackUnitTest() : delay_queue_(MakeOptions(GetParam())) {}
+
+  static DelayQueueOptions MakeOptions(TimerBackend backend) {
+    DelayQueueOptions options;
+    options.timer_backend = backend;
+    return options;
+  }
+
+  DelayQueue delay_queue_;
+};
+
+// A task with slack never starts before its delay has elapsed
+TEST_P(DelayQueueSlackUnitTest, NeverStartsEarly) {
+  int num_tasks(100);
+  auto start(TimerClock::now());
+  std::vector<TaskFuture<TimerClock::time_point>> task_futures;
+  for (int i = 0; i < num_tasks; i++) {
+    task_futures.push_back(delay_queue_.AddTask(i,
+        [] () { return TimerClock::now(); }, std::chrono::milliseconds(20)));
+  }
+
+  for (int i = 0; i < num_tasks; i++) {
+    EXPECT_GE(task_futures[i].get() - start, std::chrono::milliseconds(i));
+  }
+}
+
+// A rescheduled task keeps its slack and still runs
+TEST_P(DelayQueueSlackUnitTest, Reschedule) {
+  std::promise<void> done;
+  auto handle(delay_queue_.Post(60000, [&done] () { done.set_value(); },
+                                std::chrono::milliseconds(5)));
+  EXPECT_TRUE(delay_queue_.Reschedule(handle, 10));
+  EXPECT_EQ(done.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+}
+
+INSTANTIATE_TEST_SUITE_P(TimerBackends, DelayQueueSlackUnitTest,
+                         ::testing::Values(TimerBackend::kBinaryHeap,
+                                           TimerBackend::kTimingWheel));
@@ -1,9 +1,12 @@
 // Copyright (c) 2020 Xi Cheng. All rights reserved.
 // Use of this source code is governed by a Apache License 2.0 that can be
 // found in the LICENSE file.
+#include <chrono>
+#include <functional>
 #include <future>
 #include <iostream>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -145,3 +148,59 @@ TEST_F(DelayQueueSmallUnitTest, AddTaskInReverseSequenceMultiThread) {
   }
   EXPECT_TRUE(int_res_queue_.Empty());
 }
+
+// Add a whole batch of tasks in one call, with delays in reverse order of
+// insertion, and check that they run in the order of their delays
+TEST_F(DelayQueueSmallUnitTest, AddTasksInBatch) {
+  int num_tasks(100);
+  std::vector<std::pair<uint64_t, std::function<int()>>> tasks;
+  for (int i = 0; i < num_tasks; i++) {
+    tasks.emplace_back((num_tasks - i) * 20,
+        std::bind(&DelayQueueSmallUnitTest::add, this, i, i + 1));
+  }
+
+  auto task_future(delay_queue_.AddTasks(std::move(tasks)));
+  ASSERT_EQ(task_future.size(), static_cast<std::size_t>(num_tasks));
+  for (int i = 0; i < num_tasks; i++) {
+    EXPECT_EQ(task_future[i].get(), 2 * i + 1);
+  }
+
+  // Check that the results are showing up in reverse sequence in the
+  // int_res_queue_
+  for (int i = num_tasks - 1; i >= 0; i--) {
+    int val;
+    EXPECT_TRUE(int_res_queue_.TryPop(val));
+    EXPECT_EQ(val, 2 * i + 1);
+  }
+  EXPECT_TRUE(int_res_queue_.Empty());
+}
+
+// Tasks added with absolute start times run in the order of those times,
+// and a start time in the past runs the task right away
+TEST_F(DelayQueueSmallUnitTest, AddTaskAt) {
+  int num_tasks(10);
+  auto start(TimerClock::now());
+  std::vector<std::future<int>> task_future;
+  for (int i = 0; i < num_tasks; i++) {
+    task_future.push_back(delay_queue_.AddTaskAt(
+        start + std::chrono::milliseconds((num_tasks - i) * 20),
+        std::bind(&DelayQueueSmallUnitTest::add, this, i, i + 1)));
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    EXPECT_EQ(task_future[i].get(), 2 * i + 1);
+  }
+  EXPECT_GE(TimerClock::now() - start,
+            std::chrono::milliseconds(num_tasks * 20));
+
+  for (int i = num_tasks - 1; i >= 0; i--) {
+    int val;
+    EXPECT_TRUE(int_res_queue_.TryPop(val));
+    EXPECT_EQ(val, 2 * i + 1);
+  }
+
+  auto past(delay_queue_.AddTaskAt(start - std::chrono::hours(1),
+                                   [] () { return 42; }));
+  EXPECT_EQ(past.wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  EXPECT_EQ(past.get(), 42);
+}
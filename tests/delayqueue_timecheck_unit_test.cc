@@ -1,8 +1,12 @@
 // Copyright (c) 2020 Xi Cheng. All rights reserved.
 // Use of this source code is governed by a Apache License 2.0 that can be
 // found in the LICENSE file.
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <ctime>
+#include <future>
+#include <random>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -133,3 +137,77 @@ TEST_F(DelayQueueTimeCheckUnitTest, MultipleTaskReverse) {
 TEST_F(DelayQueueTimeCheckUnitTest, MultipleTaskRandom) {
   MultipleTaskTestSingleThread(10, 1000, TaskInsertSequence::random_);
 }
+
+// Measure how late tasks with sub-millisecond delays start, with the default
+// semaphore waiter (false) and with the timerfd waiter (true)
+class DelayQueueLatenessUnitTest : public ::testing::TestWithParam<bool> {
+ protected:
+  DelayQueueLatenessUnitTest() : delay_queue_(MakeOptions(GetParam())) {}
+
+  static DelayQueueOptions MakeOptions(bool use_timerfd) {
+    DelayQueueOptions options;
+    options.use_timerfd = use_timerfd;
+    return options;
+  }
+
+  // The lateness at the given percentile of sorted {lateness}
+  static std::chrono::microseconds Percentile(
+      const std::vector<std::chrono::microseconds>& lateness,
+      double percentile) {
+    auto index(static_cast<std::size_t>(percentile / 100 *
+                                        (lateness.size() - 1)));
+    return lateness[index];
+  }
+
+  DelayQueue delay_queue_;
+};
+
+// A delay below a millisecond is honoured, and does not get rounded up to a
+// whole millisecond
+TEST_P(DelayQueueLatenessUnitTest, MicrosecondDelay) {
+  auto start(TimerClock::now());
+  auto task_future(delay_queue_.AddTask(std::chrono::microseconds(300),
+      [] () { return TimerClock::now(); }));
+  auto elapsed(task_future.get() - start);
+  EXPECT_GE(elapsed, std::chrono::microseconds(300));
+  EXPECT_LT(elapsed, std::chrono::milliseconds(100));
+}
+
+// Spread tasks over the next 200ms at microsecond granularity, and bound
+// the percentiles of how late they start. No task may start early
+TEST_P(DelayQueueLatenessUnitTest, LatenessPercentiles) {
+  int num_tasks(2000);
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> delays(0, 200000);
+  std::vector<std::chrono::microseconds> lateness(num_tasks);
+  std::atomic<int> num_done{0};
+  std::promise<void> all_done;
+
+  for (int i = 0; i < num_tasks; i++) {
+    std::chrono::microseconds delay(delays(generator));
+    auto start_time(TimerClock::now() + delay);
+    delay_queue_.Post(delay, [&, i, start_time] () {
+      lateness[i] = std::chrono::duration_cast<std::chrono::microseconds>(
+          TimerClock::now() - start_time);
+      if (++num_done == num_tasks) {
+        all_done.set_value();
+      }
+    });
+  }
+  all_done.get_future().wait();
+
+  std::sort(lateness.begin(), lateness.end());
+  // Kept in the XML report of the test, e.g. with --gtest_output=xml
+  RecordProperty("lateness_p50_us", Percentile(lateness, 50).count());
+  RecordProperty("lateness_p90_us", Percentile(lateness, 90).count());
+  RecordProperty("lateness_p99_us", Percentile(lateness, 99).count());
+  RecordProperty("lateness_max_us", lateness.back().count());
+  EXPECT_GE(lateness.front().count(), 0);
+  // Loose bounds, so that the test stays stable on a loaded machine. The
+  // tight numbers come from the lateness benchmark in //bench
+  EXPECT_LT(Percentile(lateness, 50), std::chrono::milliseconds(20));
+  EXPECT_LT(Percentile(lateness, 99), std::chrono::milliseconds(100));
+}
+
+INSTANTIATE_TEST_SUITE_P(Waiters, DelayQueueLatenessUnitTest,
+                         ::testing::Values(false, true));
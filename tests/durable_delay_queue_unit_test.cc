@@ -0,0 +1,183 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+#include "src/durable_delay_queue.h"
+
+class DurableDelayQueueUnitTest : public ::testing::Test {
+ protected:
+  DurableDelayQueueUnitTest() {
+    char path[] = "/tmp/durable_delay_queue_unit_test_XXXXXX";
+    options_.directory = mkdtemp(path);
+  }
+
+  ~DurableDelayQueueUnitTest() {
+    auto dir(opendir(options_.directory.c_str()));
+    while (auto entry = readdir(dir)) {
+      unlink((options_.directory + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+    rmdir(options_.directory.c_str());
+  }
+
+  // Open the queue with handler 1, which records its payloads
+  std::unique_ptr<DurableDelayQueue> Open() {
+    std::unordered_map<uint32_t, DurableDelayQueue::Handler> handlers;
+    handlers[1] = [this] (const std::string& payload) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      payloads_.push_back(payload);
+      ran_.notify_all();
+    };
+    return DurableDelayQueue::Open(options_, std::move(handlers));
+  }
+
+  // Wait until {count} payloads have been recorded, and return them sorted
+  std::vector<std::string> WaitForPayloads(std::size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ran_.wait_for(lock, std::chrono::seconds(10),
+                  [&] () { return payloads_.size() >= count; });
+    auto payloads(payloads_);
+    std::sort(payloads.begin(), payloads.end());
+    return payloads;
+  }
+
+  DurableDelayQueueOptions options_;
+  std::mutex mutex_;
+  std::condition_variable ran_;
+  std::vector<std::string> payloads_;
+};
+
+// Scheduled tasks run their handler with their payload, and are gone from
+// the queue afterwards
+TEST_F(DurableDelayQueueUnitTest, RunsTasks) {
+  auto queue(Open());
+  ASSERT_NE(queue, nullptr);
+  EXPECT_NE(queue->Schedule(1, std::chrono::milliseconds(10), "a"), 0u);
+  EXPECT_NE(queue->ScheduleAt(1, std::chrono::system_clock::now(), "b"), 0u);
+  EXPECT_EQ(queue->Schedule(2, std::chrono::milliseconds(0), "c"), 0u);
+
+  EXPECT_EQ(WaitForPayloads(2), (std::vector<std::string>{"a", "b"}));
+  auto retry_until(std::chrono::steady_clock::now() +
+                   std::chrono::seconds(10));
+  while (queue->PendingTasks() > 0 &&
+         std::chrono::steady_clock::now() < retry_until) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(queue->PendingTasks(), 0u);
+}
+
+// Pending tasks survive the queue, except for the cancelled ones, and run
+// at their deadline after the queue is opened again
+TEST_F(DurableDelayQueueUnitTest, RecoversPendingTasks) {
+  uint64_t last_id;
+  {
+    auto queue(Open());
+    queue->Schedule(1, std::chrono::milliseconds(200), "kept");
+    auto cancelled(queue->Schedule(1, std::chrono::milliseconds(200),
+                                   "cancelled"));
+    last_id = queue->Schedule(1, std::chrono::milliseconds(50), "overdue");
+    EXPECT_TRUE(queue->Cancel(cancelled));
+    EXPECT_FALSE(queue->Cancel(cancelled));
+    EXPECT_EQ(queue->PendingTasks(), 2u);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(WaitForPayloads(0).empty());
+
+  auto queue(Open());
+  ASSERT_NE(queue, nullptr);
+  // Ids are not reused
+  EXPECT_GT(queue->Schedule(1, std::chrono::seconds(60), "new"), last_id);
+
+  // The overdue task runs right away, the other one at its deadline
+  EXPECT_EQ(WaitForPayloads(1), (std::vector<std::string>{"overdue"}));
+  EXPECT_EQ(WaitForPayloads(2),
+            (std::vector<std::string>{"kept", "overdue"}));
+}
+
+// A task of a handler that is not registered waits in the log for it
+TEST_F(DurableDelayQueueUnitTest, UnknownHandler) {
+  {
+    auto queue(Open());
+    queue->Schedule(1, std::chrono::milliseconds(100), "later");
+    queue->Schedule(1, std::chrono::seconds(60), "cancelled");
+  }
+  auto queue(DurableDelayQueue::Open(options_, {}));
+  ASSERT_NE(queue, nullptr);
+  EXPECT_EQ(queue->PendingTasks(), 2u);
+  EXPECT_TRUE(queue->Cancel(2));
+  queue.reset();
+
+  queue = Open();
+  EXPECT_EQ(WaitForPayloads(1), (std::vector<std::string>{"later"}));
+}
+
+// The capacity limits of the delay queue options do not apply, as neither
+// Schedule() nor the replay in Open() may wait for tasks that are not due
+// for a minute
+TEST_F(DurableDelayQueueUnitTest, IgnoresCapacityLimits) {
+  options_.delay_queue_options.max_pending_tasks = 2;
+  options_.delay_queue_options.max_pending_bytes = 1;
+  {
+    auto queue(Open());
+    for (int i = 0; i < 10; i++) {
+      EXPECT_NE(queue->Schedule(1, std::chrono::seconds(60), "later"), 0u);
+    }
+    EXPECT_EQ(queue->PendingTasks(), 10u);
+  }
+
+  auto queue(Open());
+  ASSERT_NE(queue, nullptr);
+  EXPECT_EQ(queue->PendingTasks(), 10u);
+  queue->Schedule(1, std::chrono::milliseconds(0), "now");
+  EXPECT_EQ(WaitForPayloads(1), (std::vector<std::string>{"now"}));
+}
+
+// Compaction shrinks the log down to the pending tasks
+TEST_F(DurableDelayQueueUnitTest, Compact) {
+  options_.segment_bytes = 4096;
+  auto queue(Open());
+  for (int i = 0; i < 1000; i++) {
+    auto task_id(queue->Schedule(1, std::chrono::seconds(60),
+                                 std::to_string(i)));
+    if (i % 100 != 0) {
+      EXPECT_TRUE(queue->Cancel(task_id));
+    }
+  }
+  auto log_bytes(queue->LogBytes());
+  EXPECT_TRUE(queue->Compact());
+  EXPECT_LT(queue->LogBytes() * 50, log_bytes);
+  queue.reset();
+
+  queue = Open();
+  EXPECT_EQ(queue->PendingTasks(), 10u);
+}
+
+// The log is compacted in the background once it grows past the ratio
+TEST_F(DurableDelayQueueUnitTest, BackgroundCompaction) {
+  options_.segment_bytes = 4096;
+  options_.compaction_interval = std::chrono::milliseconds(5);
+  auto queue(Open());
+  for (int i = 0; i < 1000; i++) {
+    queue->Cancel(queue->Schedule(1, std::chrono::seconds(60), "payload"));
+  }
+  auto retry_until(std::chrono::steady_clock::now() +
+                   std::chrono::seconds(10));
+  while (queue->LogBytes() > options_.segment_bytes &&
+         std::chrono::steady_clock::now() < retry_until) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_LE(queue->LogBytes(), options_.segment_bytes);
+}
@@ -0,0 +1,176 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/threadpool.h"
+
+// Count the heap allocations made by the current thread, so that the
+// allocations of the dispatch thread and of the worker threads do not
+// interfere with the measurements below
+thread_local int allocation_count = 0;
+
+void* operator new(std::size_t size) {
+  allocation_count++;
+  if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+// GCC inlines these into the callers of operator new, and then takes free()
+// for a mismatch with the replaced operator new, which calls malloc()
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+#pragma GCC diagnostic pop
+
+class FunctionWrapperUnitTest : public ::testing::Test {
+ protected:
+  // Number of allocations made by the current thread while running {body}
+  template <typename Body>
+  static int CountAllocations(Body body) {
+    auto before(allocation_count);
+    body();
+    return allocation_count - before;
+  }
+};
+
+// A small lambda is stored inline, both when wrapped and when moved around
+TEST_F(FunctionWrapperUnitTest, SmallCallableDoesNotAllocate) {
+  int calls(0);
+  int* counter(&calls);
+  auto allocations(CountAllocations([counter] () {
+    FunctionWrapper wrapper([counter] () { (*counter)++; });
+    FunctionWrapper moved(std::move(wrapper));
+    FunctionWrapper assigned;
+    assigned = std::move(moved);
+    assigned();
+    EXPECT_FALSE(static_cast<bool>(wrapper));
+    EXPECT_TRUE(static_cast<bool>(assigned));
+  }));
+  EXPECT_EQ(allocations, 0);
+  EXPECT_EQ(calls, 1);
+}
+
+// A packaged_task only allocates its own shared state, the wrapper around it
+// does not allocate
+TEST_F(FunctionWrapperUnitTest, PackagedTaskIsStoredInline) {
+  EXPECT_TRUE(FunctionWrapper::StoredInline<std::packaged_task<int()>>());
+  std::packaged_task<int()> task([] () { return 7; });
+  auto result(task.get_future());
+  auto allocations(CountAllocations([&task] () {
+    FunctionWrapper wrapper(std::move(task));
+    FunctionWrapper moved(std::move(wrapper));
+    moved();
+  }));
+  EXPECT_EQ(allocations, 0);
+  EXPECT_EQ(result.get(), 7);
+}
+
+// A callable larger than the inline buffer goes to the heap once, and moving
+// the wrapper afterwards does not allocate again
+TEST_F(FunctionWrapperUnitTest, LargeCallableAllocatesOnce) {
+  std::array<int, 64> payload;
+  payload.fill(1);
+  int sum(0);
+  int* result(&sum);
+  auto large([payload, result] () {
+    for (auto value : payload) {
+      *result += value;
+    }
+  });
+  EXPECT_FALSE(FunctionWrapper::StoredInline<decltype(large)>());
+
+  auto allocations(CountAllocations([&large] () {
+    FunctionWrapper wrapper(std::move(large));
+    FunctionWrapper moved(std::move(wrapper));
+    moved();
+  }));
+  EXPECT_EQ(allocations, 1);
+  EXPECT_EQ(sum, 64);
+}
+
+// The wrapper destroys what it holds, whether inline or on the heap
+TEST_F(FunctionWrapperUnitTest, DestroysCallable) {
+  auto capture(std::make_shared<int>(1));
+  std::weak_ptr<int> weak_capture(capture);
+  std::array<char, 128> padding{};
+  {
+    FunctionWrapper small([capture] () {});
+    FunctionWrapper large([capture, padding] () {});
+    capture.reset();
+    EXPECT_FALSE(weak_capture.expired());
+  }
+  EXPECT_TRUE(weak_capture.expired());
+}
+
+// Adding a delayed task with a small callable only allocates the timer node
+// on top of what the packaged_task allocates for its shared state
+TEST_F(FunctionWrapperUnitTest, AllocationsPerDelayedTask) {
+  auto packaged_task_allocations(CountAllocations([] () {
+    std::packaged_task<int()> task([] () { return 0; });
+    auto result(task.get_future());
+  }));
+
+  DelayQueue delay_queue;
+  int num_tasks(1000);
+  std::vector<TaskFuture<int>> task_futures;
+  task_futures.reserve(num_tasks);
+
+  auto allocations(CountAllocations([&] () {
+    for (int i = 0; i < num_tasks; i++) {
+      task_futures.push_back(delay_queue.AddTask(10, [i] () { return i; }));
+    }
+  }));
+  EXPECT_EQ(allocations, (1 + packaged_task_allocations) * num_tasks);
+
+  for (int i = 0; i < num_tasks; i++) {
+    EXPECT_EQ(task_futures[i].get(), i);
+  }
+}
+
+// Posting a delayed task with a small callable only allocates the timer node,
+// and a large one allocates the callable on top of it
+TEST_F(FunctionWrapperUnitTest, AllocationsPerPostedTask) {
+  DelayQueue delay_queue;
+  int num_tasks(1000);
+  std::atomic<int> num_done{0};
+  std::promise<void> all_done;
+  auto task([&num_done, &all_done, num_tasks] () {
+    if (++num_done == 2 * num_tasks) {
+      all_done.set_value();
+    }
+  });
+  std::array<char, 128> padding{};
+  auto large_task([task, padding] () mutable { task(); });
+
+  auto allocations(CountAllocations([&] () {
+    for (int i = 0; i < num_tasks; i++) {
+      delay_queue.Post(10, task);
+    }
+  }));
+  EXPECT_EQ(allocations, num_tasks);
+  allocations = CountAllocations([&] () {
+    for (int i = 0; i < num_tasks; i++) {
+      delay_queue.Post(10, large_task);
+    }
+  });
+  EXPECT_EQ(allocations, 2 * num_tasks);
+  all_done.get_future().wait();
+}
@@ -0,0 +1,242 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/future.h"
+#include "src/threadpool.h"
+
+TEST(FutureTest, SetThenGet) {
+  Promise<std::string> promise;
+  auto future(promise.GetFuture());
+  EXPECT_TRUE(future.Valid());
+  EXPECT_FALSE(future.Ready());
+
+  std::thread setter([&promise] () {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    promise.SetValue("done");
+  });
+  EXPECT_EQ(future.Get(), "done");
+  EXPECT_FALSE(future.Valid());
+  setter.join();
+}
+
+TEST(FutureTest, ThenRunsInline) {
+  // A continuation added before the value runs on the thread that sets it
+  Promise<int> promise;
+  std::thread::id ran_on;
+  auto doubled(promise.GetFuture().Then([&ran_on] (int value) {
+    ran_on = std::this_thread::get_id();
+    return value * 2;
+  }));
+  std::thread setter([&promise] () {
+    promise.SetValue(21);
+  });
+  auto setter_id(setter.get_id());
+  setter.join();
+  EXPECT_TRUE(doubled.Ready());
+  EXPECT_EQ(ran_on, setter_id);
+  EXPECT_EQ(doubled.Get(), 42);
+
+  // One added after the value runs right away on the calling thread
+  auto ready(MakeReadyFuture(1));
+  auto chained(ready.Then([&ran_on] (int value) {
+    ran_on = std::this_thread::get_id();
+    return std::to_string(value + 1);
+  }).Then([] (std::string text) {
+    return text + "!";
+  }));
+  EXPECT_FALSE(ready.Valid());
+  EXPECT_EQ(ran_on, std::this_thread::get_id());
+  EXPECT_EQ(chained.Get(), "2!");
+}
+
+TEST(FutureTest, ExceptionSkipsContinuations) {
+  Promise<int> promise;
+  bool called(false);
+  auto future(promise.GetFuture().Then([&called] (int value) {
+    called = true;
+    return value;
+  }).Then([&called] (int) {
+    called = true;
+  }));
+  promise.SetException(std::make_exception_ptr(std::runtime_error("boom")));
+  EXPECT_THROW(future.Get(), std::runtime_error);
+  EXPECT_FALSE(called);
+
+  // An exception thrown by a continuation goes on to its future
+  auto thrown(MakeReadyFuture(1).Then([] (int) -> int {
+    throw std::logic_error("bad");
+  }));
+  EXPECT_THROW(thrown.Get(), std::logic_error);
+}
+
+TEST(FutureTest, BrokenPromise) {
+  Future<void> future;
+  {
+    Promise<void> promise;
+    future = promise.GetFuture();
+  }
+  try {
+    future.Get();
+    FAIL() << "expected a broken promise";
+  } catch (const std::future_error& error) {
+    EXPECT_EQ(error.code(), std::future_errc::broken_promise);
+  }
+}
+
+TEST(FutureTest, MoveOnlyValues) {
+  Promise<std::unique_ptr<int>> promise;
+  auto future(promise.GetFuture().Then([] (std::unique_ptr<int> value) {
+    return *value + 1;
+  }));
+  promise.SetValue(std::unique_ptr<int>(new int(1)));
+  EXPECT_EQ(future.Get(), 2);
+}
+
+TEST(FutureTest, ThenOnThreadPool) {
+  ThreadPool threadpool;
+  Promise<void> promise;
+  std::promise<std::thread::id> ran_on;
+  auto future(promise.GetFuture().Then(threadpool, [&ran_on] () {
+    ran_on.set_value(std::this_thread::get_id());
+    return 7;
+  }));
+  promise.SetValue();
+  EXPECT_EQ(future.Get(), 7);
+  EXPECT_NE(ran_on.get_future().get(), std::this_thread::get_id());
+}
+
+TEST(FutureTest, ThenAfterWaitsForTheDelay) {
+  DelayQueue delay_queue;
+  Promise<TimerClock::time_point> promise;
+  auto future(promise.GetFuture().ThenAfter(
+      delay_queue, std::chrono::milliseconds(50),
+      [] (TimerClock::time_point set_time) {
+    return TimerClock::now() - set_time;
+  }));
+  promise.SetValue(TimerClock::now());
+  EXPECT_GE(future.Get(), std::chrono::milliseconds(50));
+
+  // An exception does not wait for the delay
+  Promise<int> failing;
+  auto failed(failing.GetFuture().ThenAfter(
+      delay_queue, std::chrono::hours(1), [] (int value) {
+    return value;
+  }));
+  failing.SetException(std::make_exception_ptr(std::runtime_error("boom")));
+  EXPECT_TRUE(failed.Ready());
+  EXPECT_THROW(failed.Get(), std::runtime_error);
+}
+
+// Setting the value does not wait for room in a full delay queue
+TEST(FutureTest, ThenAfterIgnoresCapacityLimits) {
+  DelayQueueOptions options;
+  options.max_pending_tasks = 1;
+  DelayQueue delay_queue(options);
+  auto pending(delay_queue.Post(std::chrono::hours(1), [] () {}));
+  Promise<int> promise;
+  auto future(promise.GetFuture().ThenAfter(
+      delay_queue, std::chrono::milliseconds(1), [] (int value) {
+    return value + 1;
+  }));
+
+  std::promise<void> set;
+  std::thread setter([&promise, &set] () {
+    promise.SetValue(1);
+    set.set_value();
+  });
+  EXPECT_EQ(set.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  // Makes room for a setter that is stuck, so that the test can end
+  EXPECT_TRUE(delay_queue.Cancel(pending));
+  setter.join();
+  EXPECT_EQ(future.Get(), 2);
+}
+
+TEST(FutureTest, DeferAndCancel) {
+  DelayQueue delay_queue;
+  auto start_time(TimerClock::now());
+  auto deferred(delay_queue.Defer(std::chrono::milliseconds(20), [] () {
+    return 5;
+  }));
+  auto chained(deferred.Then([start_time] (int value) {
+    EXPECT_GE(TimerClock::now() - start_time, std::chrono::milliseconds(20));
+    return value + 1;
+  }));
+  EXPECT_EQ(chained.Get(), 6);
+
+  auto cancelled(delay_queue.Defer(std::chrono::hours(1), [] () {}));
+  EXPECT_TRUE(delay_queue.Cancel(cancelled.handle()));
+  try {
+    cancelled.Get();
+    FAIL() << "expected a broken promise";
+  } catch (const std::future_error& error) {
+    EXPECT_EQ(error.code(), std::future_errc::broken_promise);
+  }
+}
+
+TEST(FutureTest, OneCallbackAtATime) {
+  // A second consumer of a pending future fails loudly instead of replacing
+  // the callback, and leaves the future as it was
+  Promise<int> promise;
+  auto future(promise.GetFuture());
+  int calls(0);
+  future.OnReady([&calls] () { calls++; });
+  EXPECT_THROW(future.OnReady([] () {}), std::logic_error);
+  EXPECT_THROW(future.Get(), std::logic_error);
+  EXPECT_THROW(future.Then([] (int value) { return value; }),
+               std::logic_error);
+  EXPECT_TRUE(future.Valid());
+
+  promise.SetValue(3);
+  EXPECT_EQ(calls, 1);
+  // Once ready, the future can be read, and further callbacks run at once
+  future.OnReady([&calls] () { calls++; });
+  EXPECT_EQ(calls, 2);
+  EXPECT_EQ(future.Get(), 3);
+}
+
+TEST(FutureTest, WhenAll) {
+  DelayQueue delay_queue;
+  std::vector<Future<int>> futures;
+  for (int i = 0; i < 10; i++) {
+    futures.push_back(delay_queue.Defer(std::chrono::milliseconds(10 - i),
+                                        [i] () { return i; }));
+  }
+  auto all(WhenAll(std::move(futures)).Then(
+      [] (std::vector<Future<int>> ready) {
+    int sum(0);
+    for (auto& future : ready) {
+      EXPECT_TRUE(future.Ready());
+      sum += future.Get();
+    }
+    return sum;
+  }));
+  EXPECT_EQ(all.Get(), 45);
+
+  // Nothing to wait for
+  EXPECT_TRUE(WhenAll(std::vector<Future<int>>()).Ready());
+}
+
+TEST(FutureTest, WhenAny) {
+  DelayQueue delay_queue;
+  std::vector<Future<std::string>> futures;
+  futures.push_back(delay_queue.Defer(std::chrono::hours(1), [] () {
+    return std::string("late");
+  }));
+  futures.push_back(delay_queue.Defer(std::chrono::milliseconds(10), [] () {
+    return std::string("early");
+  }));
+  auto first(WhenAny(std::move(futures)).Get());
+  EXPECT_EQ(first.index, 1u);
+  EXPECT_EQ(first.future.Get(), "early");
+}
@@ -0,0 +1,273 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/keyed_delay_queue.h"
+
+namespace {
+
+// Records the calls of the handler
+class Recorder {
+ public:
+  void Record(const std::string& key, int payload) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    calls_.emplace_back(key, payload);
+    cv_.notify_all();
+  }
+
+  std::vector<std::pair<std::string, int>> Calls() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return calls_;
+  }
+
+  // Wait up to 10 seconds for {num_calls} calls
+  std::vector<std::pair<std::string, int>> WaitForCalls(
+      std::size_t num_calls) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, std::chrono::seconds(10),
+                 [&] () { return calls_.size() >= num_calls; });
+    return calls_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::pair<std::string, int>> calls_;
+};
+
+// The tasks that {delay_queue} has taken so far, from its metrics
+double TasksAdded(DelayQueue& delay_queue) {
+  const std::string name("\ndelay_queue_tasks_added_total ");
+  auto text(delay_queue.MetricsText());
+  auto pos(text.find(name));
+  return pos == std::string::npos ? -1 : std::stod(text.substr(pos +
+                                                               name.size()));
+}
+
+}  // namespace
+
+// A burst of calls runs the handler once per key, with the latest payload
+TEST(KeyedDelayQueueUnitTest, DebounceKeepsLatest) {
+  Recorder recorder;
+  DelayQueueOptions options;
+  options.collect_metrics = true;
+  KeyedDelayQueue<std::string, int> queue(
+      [&recorder] (const std::string& key, int payload) {
+        recorder.Record(key, payload);
+      }, nullptr, options);
+  for (int i = 0; i < 100; i++) {
+    queue.Debounce("a", std::chrono::milliseconds(100), i);
+    queue.Debounce("b", std::chrono::milliseconds(100), -i);
+  }
+  EXPECT_EQ(queue.PendingKeys(), 2u);
+
+  auto calls(recorder.WaitForCalls(2));
+  // Rescheduled in place instead of adding a task per call
+  EXPECT_EQ(TasksAdded(queue.delay_queue()), 2);
+  ASSERT_EQ(calls.size(), 2u);
+  std::sort(calls.begin(), calls.end());
+  EXPECT_EQ(calls[0], std::make_pair(std::string("a"), 99));
+  EXPECT_EQ(calls[1], std::make_pair(std::string("b"), -99));
+  EXPECT_EQ(queue.PendingKeys(), 0u);
+}
+
+// Each call pushes the run back
+TEST(KeyedDelayQueueUnitTest, DebouncePushesBack) {
+  Recorder recorder;
+  KeyedDelayQueue<std::string, int> queue(
+      [&recorder] (const std::string& key, int payload) {
+        recorder.Record(key, payload);
+      });
+  auto start_time(TimerClock::now());
+  for (int i = 0; i < 5; i++) {
+    queue.Debounce("a", std::chrono::milliseconds(30), i);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_TRUE(recorder.Calls().empty());
+
+  auto calls(recorder.WaitForCalls(1));
+  EXPECT_GE(TimerClock::now() - start_time, std::chrono::milliseconds(70));
+  ASSERT_EQ(calls.size(), 1u);
+  EXPECT_EQ(calls[0].second, 4);
+}
+
+// A run never starts sooner than {delay} after the call whose payload it
+// gets, even when a call moves the run just as it is dispatched
+TEST(KeyedDelayQueueUnitTest, DebounceRacesDispatch) {
+  const auto delay(std::chrono::microseconds(500));
+  int num_calls(2000);
+  std::vector<TimerClock::time_point> call_times(num_calls);
+  std::mutex mutex;
+  std::vector<std::pair<int, TimerClock::time_point>> runs;
+  KeyedDelayQueue<int, int> queue(
+      [&] (const int&, int payload) {
+        auto run_time(TimerClock::now());
+        std::lock_guard<std::mutex> lock(mutex);
+        runs.emplace_back(payload, run_time);
+      });
+  for (int i = 0; i < num_calls; i++) {
+    call_times[i] = TimerClock::now();
+    queue.Debounce(1, delay, i);
+    // Around the delay, so that some calls land just as the run is due
+    auto pause(TimerClock::now() + delay * (i % 3) / 2);
+    while (TimerClock::now() < pause) {}
+  }
+  while (queue.PendingKeys() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  EXPECT_GT(runs.size(), 0u);
+  for (auto& run : runs) {
+    EXPECT_GE(run.second, call_times[run.first] + delay);
+  }
+  EXPECT_EQ(runs.back().first, num_calls - 1);
+}
+
+// The first call runs right away, the calls within a window run once at its
+// end, with the latest payload
+TEST(KeyedDelayQueueUnitTest, ThrottleBoundsRuns) {
+  Recorder recorder;
+  KeyedDelayQueue<std::string, int> queue(
+      [&recorder] (const std::string& key, int payload) {
+        recorder.Record(key, payload);
+      });
+  queue.Throttle("a", std::chrono::milliseconds(50), 0);
+  ASSERT_EQ(recorder.WaitForCalls(1).size(), 1u);
+  for (int i = 1; i <= 10; i++) {
+    queue.Throttle("a", std::chrono::milliseconds(50), i);
+  }
+  EXPECT_EQ(recorder.Calls().size(), 1u);
+
+  // The run at the end of the first window opens a second one, which
+  // passes without calls and closes the key
+  while (queue.PendingKeys() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto calls(recorder.Calls());
+  ASSERT_EQ(calls.size(), 2u);
+  EXPECT_EQ(calls[0].second, 0);
+  EXPECT_EQ(calls[1].second, 10);
+}
+
+// Calls for a busy key run the handler at most once per window
+TEST(KeyedDelayQueueUnitTest, ThrottleRateUnderLoad) {
+  Recorder recorder;
+  KeyedDelayQueue<std::string, int> queue(
+      [&recorder] (const std::string& key, int payload) {
+        recorder.Record(key, payload);
+      });
+  auto start_time(TimerClock::now());
+  int num_calls(0);
+  while (TimerClock::now() - start_time < std::chrono::milliseconds(100)) {
+    queue.Throttle("a", std::chrono::milliseconds(20), num_calls++);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  while (queue.PendingKeys() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto calls(recorder.Calls());
+  EXPECT_GE(calls.size(), 2u);
+  EXPECT_LE(calls.size(), 7u);
+  EXPECT_EQ(calls.back().second, num_calls - 1);
+}
+
+// The payloads of the calls before the run are merged in order
+TEST(KeyedDelayQueueUnitTest, CoalesceMergesPayloads) {
+  std::mutex mutex;
+  std::vector<std::vector<int>> runs;
+  DelayQueueOptions options;
+  options.collect_metrics = true;
+  KeyedDelayQueue<int, std::vector<int>> queue(
+      [&] (const int&, std::vector<int> payload) {
+        std::lock_guard<std::mutex> lock(mutex);
+        runs.push_back(std::move(payload));
+      },
+      [] (std::vector<int>& pending, std::vector<int> payload) {
+        pending.insert(pending.end(), payload.begin(), payload.end());
+      }, options);
+  for (int i = 0; i < 10; i++) {
+    queue.Coalesce(1, std::chrono::milliseconds(20), {i});
+  }
+  EXPECT_EQ(queue.PendingKeys(), 1u);
+
+  auto wait_for_runs([&] (std::size_t num_runs) {
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (runs.size() >= num_runs) {
+          return;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  wait_for_runs(1);
+  EXPECT_EQ(TasksAdded(queue.delay_queue()), 1);
+  queue.Coalesce(1, std::chrono::milliseconds(1), {10});
+  wait_for_runs(2);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(runs.size(), 2u);
+  EXPECT_EQ(runs[0], std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+  EXPECT_EQ(runs[1], std::vector<int>({10}));
+}
+
+// A cancelled key does not run, and starts over on the next call
+TEST(KeyedDelayQueueUnitTest, Cancel) {
+  Recorder recorder;
+  KeyedDelayQueue<std::string, int> queue(
+      [&recorder] (const std::string& key, int payload) {
+        recorder.Record(key, payload);
+      });
+  queue.Debounce("a", std::chrono::milliseconds(20), 1);
+  EXPECT_TRUE(queue.Cancel("a"));
+  EXPECT_FALSE(queue.Cancel("a"));
+  EXPECT_EQ(queue.PendingKeys(), 0u);
+
+  queue.Debounce("a", std::chrono::milliseconds(20), 2);
+  auto calls(recorder.WaitForCalls(1));
+  ASSERT_EQ(calls.size(), 1u);
+  EXPECT_EQ(calls[0].second, 2);
+}
+
+// The runs do not go to a shared thread pool, where they could still be
+// queued when the KeyedDelayQueue is gone
+TEST(KeyedDelayQueueUnitTest, IgnoresSharedThreadPool) {
+  Recorder recorder;
+  ThreadPoolOptions pool_options;
+  pool_options.num_threads = 1;
+  ThreadPool pool(pool_options);
+  std::promise<void> unblock;
+  auto blocked(unblock.get_future().share());
+  pool.Post([blocked] () { blocked.wait(); });
+
+  {
+    DelayQueueOptions options;
+    options.thread_pool = &pool;
+    KeyedDelayQueue<std::string, int> queue(
+        [&recorder] (const std::string& key, int payload) {
+          recorder.Record(key, payload);
+        }, nullptr, options);
+    // Runs although the only worker of the shared pool is busy
+    queue.Debounce("a", std::chrono::milliseconds(0), 1);
+    EXPECT_EQ(recorder.WaitForCalls(1).size(), 1u);
+    for (int i = 0; i < 10; i++) {
+      queue.Debounce(std::to_string(i), std::chrono::milliseconds(0), i);
+    }
+  }
+  unblock.set_value();
+  pool.Drain(TimerClock::now() + std::chrono::seconds(10));
+  EXPECT_GE(recorder.Calls().size(), 1u);
+}
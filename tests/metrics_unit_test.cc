@@ -0,0 +1,183 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/metrics.h"
+#include "src/threadpool.h"
+
+namespace {
+
+// The value of the sample {name} in a Prometheus text, or -1 if it is
+// missing
+double SampleValue(const std::string& text, const std::string& name) {
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.compare(0, name.size() + 1, name + " ") == 0) {
+      return std::strtod(line.c_str() + name.size() + 1, nullptr);
+    }
+  }
+  return -1;
+}
+
+// Wait until the sample {name} of {metrics_text()} reaches {value}, as the
+// counters of a job are updated after its future is ready
+template <typename MetricsText>
+double WaitForSample(MetricsText metrics_text, const std::string& name,
+                     double value) {
+  auto retry_until(std::chrono::steady_clock::now() +
+                   std::chrono::seconds(10));
+  auto sample(SampleValue(metrics_text(), name));
+  while (sample < value && std::chrono::steady_clock::now() < retry_until) {
+    std::this_thread::yield();
+    sample = SampleValue(metrics_text(), name);
+  }
+  return sample;
+}
+
+}  // namespace
+
+// The shards of a counter add up to every update of every thread
+TEST(MetricsUnitTest, Counter) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&counter] () {
+      for (int j = 0; j < 10000; j++) {
+        counter.Add(1);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(counter.Value(), 80000);
+  counter.Add(-80001);
+  EXPECT_EQ(counter.Value(), -1);
+}
+
+// Durations land in the bucket of the next power of two microseconds
+TEST(MetricsUnitTest, Histogram) {
+  Histogram histogram;
+  histogram.Observe(std::chrono::nanoseconds(-5));
+  histogram.Observe(std::chrono::nanoseconds(500));
+  histogram.Observe(std::chrono::microseconds(1));
+  histogram.Observe(std::chrono::milliseconds(3));
+  histogram.Observe(std::chrono::seconds(100));
+
+  auto snapshot(histogram.Read());
+  EXPECT_EQ(snapshot.count, 5u);
+  EXPECT_EQ(snapshot.buckets[0], 2u);
+  EXPECT_EQ(snapshot.buckets[1], 1u);
+  EXPECT_EQ(snapshot.buckets[12], 1u);
+  EXPECT_EQ(snapshot.buckets[Histogram::kNumBuckets - 1], 1u);
+  EXPECT_EQ(snapshot.sum, 100003001500);
+  EXPECT_DOUBLE_EQ(Histogram::UpperBound(0), 1e-6);
+  EXPECT_DOUBLE_EQ(Histogram::UpperBound(12), 4096e-6);
+}
+
+// The writer produces the Prometheus text format
+TEST(MetricsUnitTest, PrometheusWriter) {
+  Histogram histogram;
+  histogram.Observe(std::chrono::nanoseconds(100));
+  histogram.Observe(std::chrono::microseconds(3));
+
+  PrometheusWriter writer;
+  writer.WriteCounter("events_total", "Events", 42);
+  writer.WriteGauge("ratio", "A ratio", 0.25);
+  writer.WriteHistogram("wait_seconds", "Waits", histogram);
+  auto& text(writer.Text());
+
+  EXPECT_NE(text.find("# HELP events_total Events\n"
+                      "# TYPE events_total counter\n"
+                      "events_total 42\n"), std::string::npos);
+  EXPECT_NE(text.find("# TYPE ratio gauge\nratio 0.25\n"), std::string::npos);
+  EXPECT_NE(text.find("# TYPE wait_seconds histogram\n"), std::string::npos);
+  EXPECT_EQ(SampleValue(text, "wait_seconds_bucket{le=\"1e-06\"}"), 1);
+  EXPECT_EQ(SampleValue(text, "wait_seconds_bucket{le=\"2e-06\"}"), 1);
+  EXPECT_EQ(SampleValue(text, "wait_seconds_bucket{le=\"4e-06\"}"), 2);
+  EXPECT_EQ(SampleValue(text, "wait_seconds_bucket{le=\"+Inf\"}"), 2);
+  EXPECT_DOUBLE_EQ(SampleValue(text, "wait_seconds_sum"), 3.1e-6);
+  EXPECT_EQ(SampleValue(text, "wait_seconds_count"), 2);
+}
+
+// Without metrics, nothing is written
+TEST(MetricsUnitTest, Disabled) {
+  ThreadPool threadpool;
+  EXPECT_EQ(threadpool.MetricsText(), "");
+  DelayQueue delay_queue;
+  EXPECT_EQ(delay_queue.MetricsText(), "");
+}
+
+// A thread pool counts its jobs and their times
+TEST(MetricsUnitTest, ThreadPool) {
+  ThreadPoolOptions options;
+  options.num_threads = 2;
+  options.collect_metrics = true;
+  ThreadPool threadpool(options);
+
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < 100; i++) {
+    futures.push_back(threadpool.Submit([] () {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }));
+  }
+  for (auto& future : futures) {
+    future.wait();
+  }
+
+  auto metrics_text([&threadpool] () { return threadpool.MetricsText(); });
+  EXPECT_EQ(WaitForSample(metrics_text, "threadpool_jobs_completed_total",
+                          100), 100);
+  auto text(threadpool.MetricsText());
+  EXPECT_EQ(SampleValue(text, "threadpool_jobs_submitted_total"), 100);
+  EXPECT_EQ(SampleValue(text, "threadpool_workers"), 2);
+  EXPECT_EQ(SampleValue(text, "threadpool_queued_jobs"), 0);
+  EXPECT_EQ(SampleValue(text, "threadpool_queue_wait_seconds_count"), 100);
+  EXPECT_EQ(SampleValue(text, "threadpool_execution_seconds_count"), 100);
+  EXPECT_GE(SampleValue(text, "threadpool_execution_seconds_sum"), 0.01);
+  auto busy(SampleValue(text, "threadpool_busy_fraction"));
+  EXPECT_GT(busy, 0);
+  EXPECT_LE(busy, 1);
+  EXPECT_GE(SampleValue(text, "threadpool_lock_contentions_total"), 0);
+}
+
+// A delay queue counts its tasks, followed by the metrics of its pool
+TEST(MetricsUnitTest, DelayQueue) {
+  DelayQueueOptions options;
+  options.collect_metrics = true;
+  options.thread_pool_options.collect_metrics = true;
+  DelayQueue delay_queue(options);
+
+  std::vector<TaskFuture<int>> futures;
+  for (int i = 0; i < 10; i++) {
+    futures.push_back(delay_queue.AddTask(5, [i] () { return i; }));
+  }
+  auto cancelled(delay_queue.Post(60000, [] () {}));
+  EXPECT_TRUE(delay_queue.Cancel(cancelled));
+  for (auto& future : futures) {
+    future.wait();
+  }
+
+  auto metrics_text([&delay_queue] () { return delay_queue.MetricsText(); });
+  EXPECT_EQ(WaitForSample(metrics_text, "delay_queue_tasks_completed_total",
+                          10), 10);
+  EXPECT_EQ(WaitForSample(metrics_text, "delay_queue_tasks_added_total",
+                          11), 11);
+  auto text(delay_queue.MetricsText());
+  EXPECT_EQ(SampleValue(text, "delay_queue_tasks_dispatched_total"), 10);
+  EXPECT_EQ(SampleValue(text, "delay_queue_tasks_cancelled_total"), 1);
+  EXPECT_EQ(SampleValue(text, "delay_queue_dispatch_lateness_seconds_count"),
+            10);
+  EXPECT_GE(SampleValue(text, "delay_queue_timer_queue_size"), 0);
+  EXPECT_EQ(SampleValue(text, "threadpool_jobs_submitted_total"), 10);
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/mpsc_queue.h"
+
+class MpscQueueUnitTest : public ::testing::Test {
+ protected:
+  struct Item {
+    int producer;
+    int sequence;
+    Item* next = nullptr;
+  };
+
+  MpscQueue<Item, &Item::next> queue_;
+};
+
+// Items pushed by a single thread come out in the order they went in
+TEST_F(MpscQueueUnitTest, BasicCase) {
+  std::vector<Item> items(100);
+  EXPECT_TRUE(queue_.Empty());
+  for (int i = 0; i < 100; i++) {
+    items[i].sequence = i;
+    // Only the first push finds the queue empty
+    EXPECT_EQ(queue_.Push(&items[i]), i == 0);
+  }
+
+  int expected(0);
+  for (auto item = queue_.PopAll(); item != nullptr; item = item->next) {
+    EXPECT_EQ(item->sequence, expected++);
+  }
+  EXPECT_EQ(expected, 100);
+  EXPECT_TRUE(queue_.Empty());
+}
+
+// A chain linked from newest to oldest comes out oldest first, after the
+// items that were pushed before it
+TEST_F(MpscQueueUnitTest, PushChain) {
+  std::vector<Item> items(10);
+  for (int i = 0; i < 10; i++) {
+    items[i].sequence = i;
+  }
+  queue_.Push(&items[0]);
+  for (int i = 9; i > 1; i--) {
+    items[i].next = &items[i - 1];
+  }
+  EXPECT_FALSE(queue_.Push(&items[9], &items[1]));
+
+  int expected(0);
+  for (auto item = queue_.PopAll(); item != nullptr; item = item->next) {
+    EXPECT_EQ(item->sequence, expected++);
+  }
+  EXPECT_EQ(expected, 10);
+}
+
+// Several producers push while the consumer keeps taking items. Every item
+// comes out exactly once, and the items of each producer stay in order
+TEST_F(MpscQueueUnitTest, ConcurrentProducers) {
+  const int num_producers(8);
+  const int num_items(10000);
+  std::vector<std::vector<Item>> items(num_producers,
+                                       std::vector<Item>(num_items));
+  std::vector<std::thread> threads;
+  for (int p = 0; p < num_producers; p++) {
+    threads.push_back(std::thread([p, &items, this] () {
+      for (int i = 0; i < num_items; i++) {
+        items[p][i].producer = p;
+        items[p][i].sequence = i;
+        queue_.Push(&items[p][i]);
+      }
+    }));
+  }
+
+  std::vector<int> next_sequence(num_producers, 0);
+  int received(0);
+  while (received < num_producers * num_items) {
+    for (auto item = queue_.PopAll(); item != nullptr; item = item->next) {
+      EXPECT_EQ(item->sequence, next_sequence[item->producer]++);
+      received++;
+    }
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  threads.clear();
+  EXPECT_TRUE(queue_.Empty());
+}
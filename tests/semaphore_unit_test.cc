@@ -5,6 +5,7 @@
 #include <atomic>
 #include <chrono>
 #include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "src/semaphore.h"
@@ -76,3 +77,61 @@ TEST_F(SemaphoreUnitTest, InitCountAsTenWithTwentyConsumers) {
 
   EXPECT_EQ(timeouts.load(), 10);
 }
+
+// Many producers and consumers hammer the semaphore at once. Every
+// notification is consumed exactly once, whether the consumer finds it while
+// spinning or has to sleep for it
+TEST_F(SemaphoreUnitTest, ManyProducersAndConsumers) {
+  Semaphore semaphore;
+  int num_threads(4);
+  int num_notifications(20000);
+  std::atomic<int> consumed{0};
+  std::vector<std::thread> threads;
+
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread([&] () {
+      for (int j = 0; j < num_notifications; j++) {
+        semaphore.Wait();
+        consumed++;
+      }
+    }));
+    threads.push_back(std::thread([&] () {
+      for (int j = 0; j < num_notifications; j++) {
+        semaphore.Notify();
+      }
+    }));
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(consumed.load(), num_threads * num_notifications);
+  EXPECT_FALSE(semaphore.WaitUntil(std::chrono::steady_clock::now()));
+}
+
+// Notifications that race with timeouts are never lost: a notification
+// either wakes up a waiter or stays available for the next one
+TEST_F(SemaphoreUnitTest, NotifyRacingWithTimeouts) {
+  Semaphore semaphore;
+  int num_rounds(2000);
+  std::atomic<int> consumed{0};
+
+  std::thread consumer([&] () {
+    while (consumed.load() < num_rounds) {
+      if (semaphore.WaitUntil(std::chrono::steady_clock::now() +
+                              std::chrono::microseconds(50))) {
+        consumed++;
+      }
+    }
+  });
+  for (int i = 0; i < num_rounds; i++) {
+    semaphore.Notify();
+    if (i % 7 == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(60));
+    }
+  }
+
+  consumer.join();
+  EXPECT_EQ(consumed.load(), num_rounds);
+  EXPECT_FALSE(semaphore.WaitUntil(std::chrono::steady_clock::now()));
+}
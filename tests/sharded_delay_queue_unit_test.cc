@@ -0,0 +1,107 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <future>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/sharded_delay_queue.h"
+#include "src/threadsafe_queue.h"
+
+// Run every test with a shared thread pool and with per-shard pools
+class ShardedDelayQueueUnitTest : public ::testing::TestWithParam<bool> {
+ protected:
+  ShardedDelayQueueUnitTest() : delay_queue_(MakeOptions(GetParam())) {}
+
+  static ShardedDelayQueueOptions MakeOptions(bool shared_thread_pool) {
+    ShardedDelayQueueOptions options;
+    options.num_shards = 4;
+    options.shared_thread_pool = shared_thread_pool;
+    return options;
+  }
+
+  ShardedDelayQueue delay_queue_;
+};
+
+// Producer threads add tasks to their own shards, and all tasks run
+TEST_P(ShardedDelayQueueUnitTest, AddTaskFromManyThreads) {
+  EXPECT_EQ(delay_queue_.NumShards(), 4u);
+  int num_threads(8);
+  int num_tasks(1000);
+  std::vector<std::thread> producers;
+  std::vector<std::vector<std::future<int>>> task_futures(num_threads);
+  for (int t = 0; t < num_threads; t++) {
+    producers.emplace_back([&, t] () {
+      for (int i = 0; i < num_tasks; i++) {
+        task_futures[t].push_back(
+            delay_queue_.AddTask(i % 50, [i] () { return i; }));
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_tasks; i++) {
+      EXPECT_EQ(task_futures[t][i].get(), i);
+    }
+  }
+}
+
+// A key always picks the same shard, and keys are spread over all shards
+TEST_P(ShardedDelayQueueUnitTest, ShardForKey) {
+  std::map<DelayQueue*, int> keys_per_shard;
+  for (uint64_t key = 0; key < 1000; key++) {
+    auto shard(&delay_queue_.ShardForKey(key));
+    EXPECT_EQ(shard, &delay_queue_.ShardForKey(key));
+    keys_per_shard[shard]++;
+  }
+  EXPECT_EQ(keys_per_shard.size(), delay_queue_.NumShards());
+  for (auto& shard : keys_per_shard) {
+    EXPECT_GT(shard.second, 150);
+  }
+  EXPECT_EQ(&delay_queue_.ShardForThread(), &delay_queue_.ShardForThread());
+}
+
+// Tasks with the same key run in the order of their start times
+TEST_P(ShardedDelayQueueUnitTest, TasksWithSameKeyKeepOrder) {
+  uint64_t key(42);
+  int num_tasks(10);
+  ThreadsafeQueue<int> results;
+  std::vector<std::future<void>> task_futures;
+  for (int i = 0; i < num_tasks; i++) {
+    task_futures.push_back(delay_queue_.ShardForKey(key).AddTask(
+        (num_tasks - i) * 20, [i, &results] () { results.Push(i); }));
+  }
+  for (auto& task_future : task_futures) {
+    task_future.wait();
+  }
+
+  for (int i = num_tasks - 1; i >= 0; i--) {
+    int value;
+    EXPECT_TRUE(results.TryPop(value));
+    EXPECT_EQ(value, i);
+  }
+}
+
+// A keyed task is cancelled and rescheduled through its shard
+TEST_P(ShardedDelayQueueUnitTest, CancelAndRescheduleThroughShard) {
+  std::atomic<bool> cancelled_ran{false};
+  auto cancelled(delay_queue_.ShardForKey(1).Post(60000,
+      [&cancelled_ran] () { cancelled_ran = true; }));
+  EXPECT_TRUE(delay_queue_.ShardForKey(1).Cancel(cancelled));
+
+  auto rescheduled(delay_queue_.ShardForKey(2).AddTask(60000,
+                                                       [] () { return 7; }));
+  EXPECT_TRUE(delay_queue_.ShardForKey(2).Reschedule(rescheduled.handle(),
+                                                     10));
+  EXPECT_EQ(rescheduled.get(), 7);
+  EXPECT_FALSE(cancelled_ran.load());
+}
+
+INSTANTIATE_TEST_SUITE_P(ThreadPools, ShardedDelayQueueUnitTest,
+                         ::testing::Values(true, false));
@@ -0,0 +1,209 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+#include "src/task_log.h"
+
+namespace {
+
+// A record that owns its payload, to keep what a replay has visited
+struct Replayed {
+  LogRecord::Type type;
+  uint64_t task_id;
+  uint32_t handler_id;
+  int64_t deadline;
+  std::string payload;
+};
+
+// The record does not own {payload}, which must outlive it
+LogRecord Insert(uint64_t task_id, const char* payload) {
+  return LogRecord{LogRecord::kInsert, task_id, 7,
+                   static_cast<int64_t>(task_id) * 1000, payload,
+                   std::strlen(payload)};
+}
+
+LogRecord Remove(uint64_t task_id) {
+  return LogRecord{LogRecord::kRemove, task_id, 0, 0, nullptr, 0};
+}
+
+}  // namespace
+
+class TaskLogUnitTest : public ::testing::Test {
+ protected:
+  TaskLogUnitTest() {
+    char path[] = "/tmp/task_log_unit_test_XXXXXX";
+    directory_ = mkdtemp(path);
+  }
+
+  ~TaskLogUnitTest() {
+    for (auto& name : SegmentNames()) {
+      unlink((directory_ + "/" + name).c_str());
+    }
+    rmdir(directory_.c_str());
+  }
+
+  std::vector<std::string> SegmentNames() const {
+    std::vector<std::string> names;
+    auto dir(opendir(directory_.c_str()));
+    while (auto entry = readdir(dir)) {
+      std::string name(entry->d_name);
+      if (name != "." && name != "..") {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+  }
+
+  std::unique_ptr<TaskLog> Open(std::vector<Replayed>* replayed,
+                                std::size_t segment_bytes = 1 << 20) {
+    return TaskLog::Open(directory_, segment_bytes, false,
+                         [replayed] (const LogRecord& record) {
+      replayed->push_back(Replayed{record.type, record.task_id,
+          record.handler_id, record.deadline,
+          std::string(record.payload, record.payload_size)});
+    });
+  }
+
+  std::string directory_;
+};
+
+// Records come back in the order they were appended, with their fields
+TEST_F(TaskLogUnitTest, AppendAndReplay) {
+  std::vector<Replayed> replayed;
+  auto log(Open(&replayed));
+  ASSERT_NE(log, nullptr);
+  EXPECT_TRUE(replayed.empty());
+  EXPECT_TRUE(log->Append(Insert(1, "first")));
+  EXPECT_TRUE(log->Append(Insert(2, "")));
+  EXPECT_TRUE(log->Append(Remove(1)));
+  EXPECT_EQ(log->Bytes(), TaskLog::RecordSize(Insert(1, "first")) +
+                          TaskLog::RecordSize(Insert(2, "")) +
+                          TaskLog::RecordSize(Remove(1)));
+  log.reset();
+
+  log = Open(&replayed);
+  ASSERT_NE(log, nullptr);
+  ASSERT_EQ(replayed.size(), 3u);
+  EXPECT_EQ(replayed[0].type, LogRecord::kInsert);
+  EXPECT_EQ(replayed[0].task_id, 1u);
+  EXPECT_EQ(replayed[0].handler_id, 7u);
+  EXPECT_EQ(replayed[0].deadline, 1000);
+  EXPECT_EQ(replayed[0].payload, "first");
+  EXPECT_EQ(replayed[1].task_id, 2u);
+  EXPECT_EQ(replayed[1].payload, "");
+  EXPECT_EQ(replayed[2].type, LogRecord::kRemove);
+  EXPECT_EQ(replayed[2].task_id, 1u);
+
+  // A reopened log appends after what it has replayed
+  EXPECT_TRUE(log->Append(Remove(2)));
+  log.reset();
+  replayed.clear();
+  Open(&replayed);
+  ASSERT_EQ(replayed.size(), 4u);
+  EXPECT_EQ(replayed[3].type, LogRecord::kRemove);
+  EXPECT_EQ(replayed[3].task_id, 2u);
+}
+
+// The log rolls over to new segments, and replays all of them in order
+TEST_F(TaskLogUnitTest, Segments) {
+  std::vector<Replayed> replayed;
+  auto log(Open(&replayed, 256));
+  std::string payload(100, 'x');
+  for (uint64_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(log->Append(Insert(i, payload.c_str())));
+  }
+  log.reset();
+  EXPECT_GE(SegmentNames().size(), 5u);
+
+  Open(&replayed, 256);
+  ASSERT_EQ(replayed.size(), 10u);
+  for (uint64_t i = 0; i < 10; i++) {
+    EXPECT_EQ(replayed[i].task_id, i);
+    EXPECT_EQ(replayed[i].payload, payload);
+  }
+}
+
+// A record cut short by a crash, and everything after a corrupt record in
+// the same segment, is dropped
+TEST_F(TaskLogUnitTest, TornAndCorruptRecords) {
+  std::vector<Replayed> replayed;
+  auto log(Open(&replayed));
+  for (uint64_t i = 0; i < 4; i++) {
+    log->Append(Insert(i, "payload"));
+  }
+  log.reset();
+  auto segment(directory_ + "/" + SegmentNames().back());
+  struct stat segment_stat;
+  ASSERT_EQ(stat(segment.c_str(), &segment_stat), 0);
+  ASSERT_EQ(truncate(segment.c_str(), segment_stat.st_size - 3), 0);
+
+  log = Open(&replayed);
+  ASSERT_EQ(replayed.size(), 3u);
+  EXPECT_EQ(replayed.back().task_id, 2u);
+
+  // Flip a byte in the payload of the second record
+  auto record_size(TaskLog::RecordSize(Insert(0, "payload")));
+  auto file(std::fopen(segment.c_str(), "r+b"));
+  ASSERT_NE(file, nullptr);
+  std::fseek(file, record_size + record_size - 1, SEEK_SET);
+  std::fputc('!', file);
+  std::fclose(file);
+
+  log.reset();
+  replayed.clear();
+  Open(&replayed);
+  ASSERT_EQ(replayed.size(), 1u);
+  EXPECT_EQ(replayed[0].task_id, 0u);
+}
+
+// Compaction replaces all segments with one that holds the live records
+TEST_F(TaskLogUnitTest, Compact) {
+  std::vector<Replayed> replayed;
+  auto log(Open(&replayed, 256));
+  for (uint64_t i = 0; i < 20; i++) {
+    log->Append(Insert(i, "payload"));
+    if (i % 2 == 0) {
+      log->Append(Remove(i));
+    }
+  }
+  EXPECT_GT(SegmentNames().size(), 1u);
+
+  std::vector<LogRecord> live;
+  for (uint64_t i = 1; i < 20; i += 2) {
+    live.push_back(Insert(i, "payload"));
+  }
+  EXPECT_TRUE(log->Compact(live));
+  EXPECT_EQ(SegmentNames().size(), 1u);
+  EXPECT_EQ(log->Bytes(), 10 * TaskLog::RecordSize(live[0]));
+
+  // Appends go on after the compacted records
+  log->Append(Remove(1));
+  log.reset();
+  Open(&replayed, 256);
+  ASSERT_EQ(replayed.size(), 11u);
+  for (std::size_t i = 0; i < 10; i++) {
+    EXPECT_EQ(replayed[i].type, LogRecord::kInsert);
+    EXPECT_EQ(replayed[i].task_id, 2 * i + 1);
+  }
+  EXPECT_EQ(replayed[10].type, LogRecord::kRemove);
+}
+
+// Opening fails when the directory cannot be created
+TEST_F(TaskLogUnitTest, OpenFails) {
+  EXPECT_EQ(TaskLog::Open("/proc/no/such/directory", 1 << 20, false,
+                          [] (const LogRecord&) {}), nullptr);
+}
@@ -0,0 +1,220 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/task_tracer.h"
+
+namespace {
+
+std::chrono::steady_clock::time_point Time(int64_t nanoseconds) {
+  return std::chrono::steady_clock::time_point(
+      std::chrono::nanoseconds(nanoseconds));
+}
+
+// The events of {task_id} in {events}
+std::vector<TraceEvent> EventsOf(const std::vector<TraceEvent>& events,
+                                 uint64_t task_id) {
+  std::vector<TraceEvent> res;
+  for (auto& event : events) {
+    if (event.task_id == task_id) {
+      res.push_back(event);
+    }
+  }
+  return res;
+}
+
+// Wait until {tracer} holds {count} events with {phase}, as a worker
+// records kFinished after the future of its task is ready
+void WaitForEvents(const TaskTracer& tracer, TraceEvent::Phase phase,
+                   std::size_t count) {
+  auto retry_until(std::chrono::steady_clock::now() +
+                   std::chrono::seconds(10));
+  while (std::chrono::steady_clock::now() < retry_until) {
+    std::size_t found(0);
+    for (auto& event : tracer.Events()) {
+      found += event.phase == phase;
+    }
+    if (found >= count) {
+      return;
+    }
+    std::this_thread::yield();
+  }
+}
+
+}  // namespace
+
+// Events of several threads are collected by task and time, each tagged
+// with the thread that recorded it
+TEST(TaskTracerUnitTest, RecordAndCollect) {
+  TaskTracer tracer;
+  uint64_t task_ids[4];
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&tracer, &task_ids, i] () {
+      task_ids[i] = tracer.NewTaskId();
+      tracer.Record(task_ids[i], TraceEvent::kFinished, Time(30));
+      tracer.Record(task_ids[i], TraceEvent::kEnqueued, Time(10));
+      tracer.Record(task_ids[i], TraceEvent::kDispatched, Time(20),
+                    Time(15));
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto events(tracer.Events());
+  ASSERT_EQ(events.size(), 12u);
+  std::set<uint64_t> distinct_ids(std::begin(task_ids), std::end(task_ids));
+  EXPECT_EQ(distinct_ids.size(), 4u);
+  std::set<uint32_t> threads_seen;
+  for (auto task_id : task_ids) {
+    auto task_events(EventsOf(events, task_id));
+    ASSERT_EQ(task_events.size(), 3u);
+    EXPECT_EQ(task_events[0].phase, TraceEvent::kEnqueued);
+    EXPECT_EQ(task_events[1].phase, TraceEvent::kDispatched);
+    EXPECT_EQ(task_events[1].due, Time(15));
+    EXPECT_EQ(task_events[2].phase, TraceEvent::kFinished);
+    EXPECT_EQ(task_events[0].thread, task_events[2].thread);
+    threads_seen.insert(task_events[0].thread);
+  }
+  EXPECT_EQ(threads_seen.size(), 4u);
+}
+
+// A full buffer keeps the newest events of its thread
+TEST(TaskTracerUnitTest, Overwrite) {
+  TaskTracer tracer(6);
+  for (int i = 1; i <= 20; i++) {
+    tracer.Record(i, TraceEvent::kEnqueued, Time(i));
+  }
+  auto events(tracer.Events());
+  ASSERT_EQ(events.size(), 8u);
+  EXPECT_EQ(events.front().task_id, 13u);
+  EXPECT_EQ(events.back().task_id, 20u);
+}
+
+// Collecting while a thread keeps recording never returns a torn event
+TEST(TaskTracerUnitTest, CollectWhileRecording) {
+  TaskTracer tracer(64);
+  std::atomic<bool> stop{false};
+  std::thread writer([&tracer, &stop] () {
+    for (uint64_t i = 1; !stop.load(); i++) {
+      tracer.Record(i, TraceEvent::kDispatched, Time(i), Time(2 * i));
+    }
+  });
+
+  for (int i = 0; i < 1000; i++) {
+    for (auto& event : tracer.Events()) {
+      ASSERT_EQ(event.time, Time(event.task_id));
+      ASSERT_EQ(event.due, Time(2 * event.task_id));
+    }
+  }
+  stop = true;
+  writer.join();
+}
+
+// A task of a delay queue goes through its phases in order, and is due at
+// its start time
+TEST(TaskTracerUnitTest, DelayQueueLifecycle) {
+  TaskTracer tracer;
+  DelayQueueOptions options;
+  options.tracer = &tracer;
+  DelayQueue delay_queue(options);
+
+  auto added(TimerClock::now());
+  auto future(delay_queue.AddTask(std::chrono::milliseconds(20),
+                                  [] () { return 1; }));
+  auto cancelled(delay_queue.Post(60000, [] () {}));
+  EXPECT_TRUE(delay_queue.Cancel(cancelled));
+  EXPECT_EQ(future.get(), 1);
+  WaitForEvents(tracer, TraceEvent::kFinished, 1);
+
+  auto events(tracer.Events());
+  ASSERT_EQ(events.size(), 5u);
+  auto task_events(EventsOf(events, events.front().task_id));
+  if (task_events.size() == 1) {
+    task_events = EventsOf(events, events.back().task_id);
+  }
+  ASSERT_EQ(task_events.size(), 4u);
+  EXPECT_EQ(task_events[0].phase, TraceEvent::kEnqueued);
+  EXPECT_EQ(task_events[1].phase, TraceEvent::kDispatched);
+  EXPECT_EQ(task_events[2].phase, TraceEvent::kStarted);
+  EXPECT_EQ(task_events[3].phase, TraceEvent::kFinished);
+  EXPECT_GE(task_events[0].time, added);
+  EXPECT_GE(task_events[1].due,
+            task_events[0].time + std::chrono::milliseconds(19));
+  EXPECT_GE(task_events[1].time, task_events[1].due);
+  EXPECT_GE(task_events[2].time, task_events[1].time);
+  EXPECT_GE(task_events[3].time, task_events[2].time);
+  EXPECT_NE(task_events[0].thread, task_events[1].thread);
+  EXPECT_NE(task_events[1].thread, task_events[2].thread);
+}
+
+// Each run of a periodic task is enqueued, dispatched, started and finished
+TEST(TaskTracerUnitTest, PeriodicRuns) {
+  TaskTracer tracer;
+  DelayQueueOptions options;
+  options.tracer = &tracer;
+  DelayQueue delay_queue(options);
+
+  std::atomic<int> runs{0};
+  auto handle(delay_queue.PostPeriodic(std::chrono::milliseconds(1),
+                                       std::chrono::milliseconds(1),
+                                       [&runs] () { runs++; }));
+  WaitForEvents(tracer, TraceEvent::kFinished, 3);
+  delay_queue.Cancel(handle);
+
+  auto events(tracer.Events());
+  std::size_t enqueued(0);
+  std::size_t finished(0);
+  for (auto& event : events) {
+    EXPECT_EQ(event.task_id, events.front().task_id);
+    enqueued += event.phase == TraceEvent::kEnqueued;
+    finished += event.phase == TraceEvent::kFinished;
+  }
+  EXPECT_GE(finished, 3u);
+  EXPECT_GE(enqueued, finished);
+}
+
+// The Chrome trace of a task shows its slices, and the run on its worker
+TEST(TaskTracerUnitTest, ChromeTrace) {
+  TaskTracer tracer;
+  tracer.Record(7, TraceEvent::kEnqueued, Time(1000));
+  tracer.Record(7, TraceEvent::kDispatched, Time(3500), Time(3000));
+  tracer.Record(7, TraceEvent::kStarted, Time(4000));
+  tracer.Record(7, TraceEvent::kFinished, Time(6000));
+  // A run whose start has been lost only shows up as far as it is known
+  tracer.Record(8, TraceEvent::kFinished, Time(9000));
+
+  auto trace(tracer.ChromeTrace());
+  EXPECT_EQ(trace.find("{\"traceEvents\":["), 0u);
+  EXPECT_NE(trace.find("{\"name\":\"pending\",\"cat\":\"task\",\"ph\":\"b\","
+                       "\"id\":\"0x7\",\"pid\":1,\"tid\":1,\"ts\":0.000}"),
+            std::string::npos);
+  EXPECT_NE(trace.find("\"name\":\"dispatching\",\"cat\":\"task\","
+                       "\"ph\":\"e\",\"id\":\"0x7\",\"pid\":1,\"tid\":1,"
+                       "\"ts\":2.500}"), std::string::npos);
+  EXPECT_NE(trace.find("{\"name\":\"task 0x7\",\"cat\":\"run\",\"ph\":\"X\","
+                       "\"pid\":1,\"tid\":1,\"ts\":3.000,\"dur\":2.000}"),
+            std::string::npos);
+  EXPECT_EQ(trace.find("0x8"), std::string::npos);
+  EXPECT_NE(trace.find("\"ph\":\"M\""), std::string::npos);
+
+  auto path(testing::TempDir() + "task_tracer_unit_test.json");
+  ASSERT_TRUE(tracer.WriteChromeTrace(path));
+  std::ifstream file(path);
+  std::string written((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(written, trace);
+  std::remove(path.c_str());
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+#include <future>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/thread_affinity.h"
+#include "src/threadpool.h"
+
+// Parse the CPU list format of sysfs
+TEST(ThreadAffinityUnitTest, ParseCpuList) {
+  EXPECT_EQ(ParseCpuList("0"), CpuSet({0}));
+  EXPECT_EQ(ParseCpuList("0-3,8,10-11"), CpuSet({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(ParseCpuList(""), CpuSet());
+  EXPECT_EQ(ParseCpuList("0-"), CpuSet());
+  EXPECT_EQ(ParseCpuList("3-1"), CpuSet());
+  EXPECT_EQ(ParseCpuList("a"), CpuSet());
+}
+
+// A thread pinned to a single CPU only runs on that CPU
+TEST(ThreadAffinityUnitTest, PinThread) {
+  auto cpus(CurrentThreadCpus());
+  if (cpus.empty()) {
+    GTEST_SKIP() << "thread affinity is not supported";
+  }
+
+  std::promise<void> pinned;
+  std::promise<CpuSet> result;
+  std::thread thread([&] () {
+    pinned.get_future().wait();
+    result.set_value(CurrentThreadCpus());
+  });
+  EXPECT_TRUE(SetThreadAffinity(thread, CpuSet({cpus.back()})));
+  pinned.set_value();
+  EXPECT_EQ(result.get_future().get(), CpuSet({cpus.back()}));
+  thread.join();
+
+  EXPECT_FALSE(SetThreadAffinity(thread, CpuSet()));
+}
+
+// The pool starts the requested number of workers, pinned to the given CPUs
+TEST(ThreadAffinityUnitTest, ThreadPoolOptions) {
+  auto cpus(CurrentThreadCpus());
+  if (cpus.empty()) {
+    GTEST_SKIP() << "thread affinity is not supported";
+  }
+
+  ThreadPoolOptions options;
+  options.num_threads = 3;
+  options.worker_cpus.push_back(CpuSet({cpus.front()}));
+  ThreadPool threadpool(options);
+  EXPECT_EQ(threadpool.NumThreads(), 3u);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(threadpool.Submit(CurrentThreadCpus).get(),
+              CpuSet({cpus.front()}));
+  }
+}
+
+// A NUMA-local pool starts one worker per CPU of the node, pinned to the node
+TEST(ThreadAffinityUnitTest, NumaNodePool) {
+  auto node_cpus(NumaNodeCpus(0));
+  if (node_cpus.empty()) {
+    GTEST_SKIP() << "NUMA topology is not available";
+  }
+
+  ThreadPoolOptions options;
+  options.numa_node = 0;
+  ThreadPool threadpool(options);
+  EXPECT_EQ(threadpool.NumThreads(), node_cpus.size());
+  EXPECT_EQ(threadpool.Submit(CurrentThreadCpus).get(), node_cpus);
+  EXPECT_TRUE(NumaNodeCpus(-1).empty());
+}
+
+// The options of the pool are passed through the delay queue
+TEST(ThreadAffinityUnitTest, DelayQueueOptions) {
+  auto cpus(CurrentThreadCpus());
+  if (cpus.empty()) {
+    GTEST_SKIP() << "thread affinity is not supported";
+  }
+
+  DelayQueueOptions options;
+  options.thread_pool_options.num_threads = 2;
+  options.thread_pool_options.worker_cpus.push_back(CpuSet({cpus.front()}));
+  options.dispatch_thread_cpus = CpuSet({cpus.back()});
+  DelayQueue delay_queue(options);
+  EXPECT_EQ(delay_queue.AddTask(10, CurrentThreadCpus).get(),
+            CpuSet({cpus.front()}));
+}
@@ -3,9 +3,11 @@
 // found in the LICENSE file.
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <future>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -78,3 +80,256 @@ TEST_F(ThreadPoolUnitTest, MultipleTasks) {
 TEST_F(ThreadPoolUnitTest, LargeNumberTasks) {
   run_multiple_add(10000);
 }
+
+class WorkStealingThreadPoolUnitTest : public ::testing::Test {
+ protected:
+  WorkStealingThreadPoolUnitTest() : threadpool_(MakeOptions()) {}
+
+  static ThreadPoolOptions MakeOptions() {
+    ThreadPoolOptions options;
+    options.work_stealing = true;
+    return options;
+  }
+
+  ThreadPool threadpool_;
+};
+
+// Test that a large number of tasks submitted from outside the pool are all
+// run when each worker has its own queue
+TEST_F(WorkStealingThreadPoolUnitTest, LargeNumberTasks) {
+  int num_tasks(10000);
+  std::vector<std::future<int>> add_futures;
+  for (int i = 0; i < num_tasks; i++) {
+    add_futures.push_back(threadpool_.Submit(std::bind(test_add, i, i + 1)));
+  }
+
+  for (int i = 0; i < num_tasks; i++) {
+    EXPECT_EQ(add_futures[i].get(), 2 * i + 1);
+  }
+}
+
+// Tasks that submit more tasks from the worker threads. The nested tasks go
+// to the local queue of the submitting worker, and idle workers steal them
+TEST_F(WorkStealingThreadPoolUnitTest, NestedSubmit) {
+  int num_parents(100);
+  int num_children(100);
+  std::atomic<int> num_done{0};
+  std::promise<void> all_done;
+
+  for (int i = 0; i < num_parents; i++) {
+    threadpool_.Submit([&, this] () {
+      for (int j = 0; j < num_children; j++) {
+        threadpool_.Submit([&] () {
+          if (++num_done == num_parents * num_children) {
+            all_done.set_value();
+          }
+        });
+      }
+    });
+  }
+
+  all_done.get_future().wait();
+  EXPECT_EQ(num_done.load(), num_parents * num_children);
+}
+
+// Sleeping workers are woken up by later submissions
+TEST_F(WorkStealingThreadPoolUnitTest, SubmitAfterIdle) {
+  for (int i = 0; i < 10; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(threadpool_.Submit(std::bind(test_add, i, 1)).get(), i + 1);
+  }
+}
+
+// A pool with a single worker, which is kept busy while the jobs under test
+// are queued, so that the order in which it takes them is deterministic
+class PriorityThreadPoolUnitTest : public ::testing::TestWithParam<bool> {
+ protected:
+  static ThreadPoolOptions MakeOptions(unsigned int starvation_limit) {
+    ThreadPoolOptions options;
+    options.num_threads = 1;
+    options.work_stealing = GetParam();
+    options.starvation_limit = starvation_limit;
+    return options;
+  }
+
+  // Post {priorities} in order while the worker is busy, and return the
+  // priorities in the order the jobs ran
+  static std::vector<TaskPriority> RunOrder(
+      ThreadPool& threadpool, const std::vector<TaskPriority>& priorities) {
+    std::promise<void> started;
+    std::promise<void> release;
+    auto release_future(release.get_future().share());
+    threadpool.Post([&started, release_future] () {
+      started.set_value();
+      release_future.wait();
+    });
+    started.get_future().wait();
+
+    std::mutex mutex;
+    std::vector<TaskPriority> order;
+    std::promise<void> all_done;
+    for (auto priority : priorities) {
+      threadpool.Post([&, priority] () {
+        // Signal after unlocking, as the mutex is gone once the caller wakes
+        std::unique_lock<std::mutex> lock(mutex);
+        order.push_back(priority);
+        if (order.size() == priorities.size()) {
+          lock.unlock();
+          all_done.set_value();
+        }
+      }, priority);
+    }
+    release.set_value();
+    all_done.get_future().wait();
+    return order;
+  }
+};
+
+// Without starvation protection, workers always take the highest lane first
+TEST_P(PriorityThreadPoolUnitTest, StrictPriorities) {
+  ThreadPool threadpool(MakeOptions(0));
+  std::vector<TaskPriority> priorities;
+  for (int i = 0; i < 10; i++) {
+    priorities.push_back(TaskPriority::kLow);
+    priorities.push_back(TaskPriority::kNormal);
+    priorities.push_back(TaskPriority::kHigh);
+  }
+
+  auto order(RunOrder(threadpool, priorities));
+  for (int i = 0; i < 30; i++) {
+    EXPECT_EQ(order[i], static_cast<TaskPriority>(i / 10)) << i;
+  }
+}
+
+// A lower lane gets a turn every starvation_limit jobs, even while the
+// higher lanes have jobs queued
+TEST_P(PriorityThreadPoolUnitTest, StarvationProtection) {
+  ThreadPool threadpool(MakeOptions(4));
+  std::vector<TaskPriority> priorities(10, TaskPriority::kLow);
+  priorities.insert(priorities.end(), 40, TaskPriority::kHigh);
+
+  auto order(RunOrder(threadpool, priorities));
+  int num_low(0);
+  for (int i = 0; i < 20; i++) {
+    if (order[i] == TaskPriority::kLow) {
+      num_low++;
+    }
+  }
+  EXPECT_GE(num_low, 4);
+  EXPECT_LE(num_low, 6);
+}
+
+// The future of a prioritized submission works like any other
+TEST_P(PriorityThreadPoolUnitTest, SubmitWithPriority) {
+  ThreadPool threadpool(MakeOptions(8));
+  EXPECT_EQ(threadpool.Submit(std::bind(test_add, 1, 2),
+                              TaskPriority::kHigh).get(), 3);
+  EXPECT_EQ(threadpool.Submit(std::bind(test_add, 3, 4),
+                              TaskPriority::kLow).get(), 7);
+}
+
+INSTANTIATE_TEST_SUITE_P(QueueModes, PriorityThreadPoolUnitTest,
+                         ::testing::Values(false, true));
+
+// With a limit on the queued jobs, TryPost() fails once the workers are
+// busy and the queue is full, and Post() waits for room
+TEST(BoundedThreadPoolUnitTest, MaxQueuedJobs) {
+  ThreadPoolOptions options;
+  options.num_threads = 1;
+  options.max_queued_jobs = 2;
+  ThreadPool threadpool(options);
+
+  std::promise<void> started;
+  std::promise<void> release;
+  auto release_future(release.get_future().share());
+  threadpool.Post([&started, release_future] () {
+    started.set_value();
+    release_future.wait();
+  });
+  started.get_future().wait();
+
+  std::atomic<int> num_done(0);
+  EXPECT_TRUE(threadpool.TryPost([&num_done] () { num_done++; }));
+  EXPECT_TRUE(threadpool.TryPost([&num_done] () { num_done++; }));
+  EXPECT_FALSE(threadpool.TryPost([&num_done] () { num_done++; }));
+  EXPECT_EQ(threadpool.QueuedJobs(), 2u);
+
+  std::thread releaser([&release] () {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    release.set_value();
+  });
+  auto last(threadpool.Submit([&num_done] () { num_done++; }));
+  last.wait();
+  releaser.join();
+  EXPECT_EQ(num_done.load(), 3);
+}
+
+// Jobs submitted by the workers of a full pool are queued anyway, instead of
+// waiting for the very workers that submit them
+TEST(BoundedThreadPoolUnitTest, WorkersNeverWait) {
+  for (auto work_stealing : {false, true}) {
+    ThreadPoolOptions options;
+    options.num_threads = 2;
+    options.max_queued_jobs = 1;
+    options.work_stealing = work_stealing;
+    ThreadPool threadpool(options);
+
+    const int num_children(100);
+    std::atomic<int> num_done(0);
+    std::promise<void> all_done;
+    threadpool.Post([&] () {
+      for (int i = 0; i < num_children; i++) {
+        threadpool.Post([&] () {
+          if (++num_done == num_children) {
+            all_done.set_value();
+          }
+        });
+      }
+    });
+    all_done.get_future().wait();
+  }
+}
+
+// Drain() waits for the queued jobs, including the jobs that they submit,
+// and drops the jobs that have not started by the deadline
+TEST(DrainThreadPoolUnitTest, DrainWaitsThenDrops) {
+  for (auto work_stealing : {false, true}) {
+    ThreadPoolOptions options;
+    options.num_threads = 1;
+    options.work_stealing = work_stealing;
+    ThreadPool threadpool(options);
+
+    std::atomic<int> num_done(0);
+    for (int i = 0; i < 10; i++) {
+      threadpool.Post([&] () {
+        threadpool.Post([&num_done] () { num_done++; });
+        num_done++;
+      });
+    }
+    EXPECT_EQ(threadpool.Drain(std::chrono::steady_clock::now() +
+                               std::chrono::seconds(10)), 0u);
+    EXPECT_EQ(num_done.load(), 20);
+    EXPECT_EQ(threadpool.ActiveJobs(), 0u);
+
+    std::vector<std::future<void>> futures;
+    for (int i = 0; i < 10; i++) {
+      futures.push_back(threadpool.Submit([] () {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      }));
+    }
+    auto dropped(threadpool.Drain(std::chrono::steady_clock::now() +
+                                  std::chrono::milliseconds(50)));
+    EXPECT_GT(dropped, 0u);
+    EXPECT_LE(threadpool.ActiveJobs(), 1u);
+    std::size_t broken(0);
+    for (auto& future : futures) {
+      try {
+        future.get();
+      } catch (const std::future_error&) {
+        broken++;
+      }
+    }
+    EXPECT_EQ(broken, dropped);
+    EXPECT_EQ(threadpool.Submit([] () { return 1; }).get(), 1);
+  }
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2020 Xi Cheng. All rights reserved.
+// Use of this source code is governed by a Apache License 2.0 that can be
+// found in the LICENSE file.
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/delay_queue.h"
+#include "src/timing_wheel.h"
+
+class TimingWheelUnitTest : public ::testing::Test {
+ protected:
+  TimingWheelUnitTest() :
+      start_(TimerClock::now()), wheel_(std::chrono::milliseconds(1), start_) {}
+
+  // Push a node that is due {offset} after the start of the wheel. The
+  // node's function records {id} into popped_ids_ when called
+  void PushAt(TimerClock::duration offset, int id) {
+    wheel_.Push(new TimerNode(start_ + offset,
+                              [this, id] () { popped_ids_.push_back(id); }));
+  }
+
+  // Pop every node that is due at {offset} after the start, run it and
+  // check that it is not early. Return the number of popped nodes
+  int PopAllAt(TimerClock::duration offset) {
+    int popped(0);
+    while (auto node = wheel_.PopExpired(start_ + offset)) {
+      EXPECT_LE(node->start_time_, start_ + offset);
+      node->function_wrapper_();
+      node->Release();
+      popped++;
+    }
+    return popped;
+  }
+
+  TimerClock::time_point start_;
+  TimingWheel wheel_;
+  std::vector<int> popped_ids_;
+};
+
+// A node is not popped before its start time, and is popped once due
+TEST_F(TimingWheelUnitTest, SingleNode) {
+  PushAt(std::chrono::milliseconds(10), 1);
+  EXPECT_EQ(wheel_.Size(), 1u);
+  EXPECT_LE(wheel_.NextWakeupTime(), start_ + std::chrono::milliseconds(10));
+  EXPECT_EQ(PopAllAt(std::chrono::milliseconds(9)), 0);
+  EXPECT_EQ(PopAllAt(std::chrono::milliseconds(10)), 1);
+  EXPECT_TRUE(wheel_.Empty());
+}
+
+// A start time between two ticks is rounded up, so the node is never early
+TEST_F(TimingWheelUnitTest, RoundUpToTick) {
+  PushAt(std::chrono::microseconds(2500), 1);
+  EXPECT_EQ(PopAllAt(std::chrono::microseconds(2999)), 0);
+  EXPECT_EQ(PopAllAt(std::chrono::milliseconds(3)), 1);
+}
+
+// Nodes spread over several levels come out in the order of their start time
+// when the wheel is advanced one tick at a time
+TEST_F(TimingWheelUnitTest, CascadeKeepsOrder) {
+  std::vector<int> delays = {70000, 1, 63, 64, 65, 4095, 4096, 4097, 300000};
+  for (unsigned int i = 0; i < delays.size(); i++) {
+    PushAt(std::chrono::milliseconds(delays[i]), delays[i]);
+  }
+
+  for (int ms = 0; ms <= 300000; ms++) {
+    PopAllAt(std::chrono::milliseconds(ms));
+  }
+  std::vector<int> expected = {1, 63, 64, 65, 4095, 4096, 4097, 70000, 300000};
+  EXPECT_EQ(popped_ids_, expected);
+}
+
+// Advancing by following NextWakeupTime() never skips a node and never
+// pops one early, including nodes beyond the span of the top level
+TEST_F(TimingWheelUnitTest, FollowNextWakeupTime) {
+  std::srand(42);
+  int num_nodes(10000);
+  for (int i = 0; i < num_nodes; i++) {
+    PushAt(std::chrono::milliseconds(std::rand() % 10000000), i);
+  }
+  PushAt(std::chrono::hours(24 * 365 * 3), num_nodes);
+
+  int popped(0);
+  while (!wheel_.Empty()) {
+    auto wakeup(wheel_.NextWakeupTime());
+    popped += PopAllAt(wakeup - start_);
+  }
+  EXPECT_EQ(popped, num_nodes + 1);
+}
+
+// A node that is already due when pushed is popped right away
+TEST_F(TimingWheelUnitTest, PushPastNode) {
+  PopAllAt(std::chrono::milliseconds(100));
+  PushAt(std::chrono::milliseconds(50), 1);
+  EXPECT_EQ(PopAllAt(std::chrono::milliseconds(100)), 1);
+}
+
+// A delay queue configured with the timing wheel backend runs its tasks in
+// the order of their delays
+TEST_F(TimingWheelUnitTest, DelayQueueWithTimingWheel) {
+  DelayQueueOptions options;
+  options.timer_backend = TimerBackend::kTimingWheel;
+  DelayQueue delay_queue(options);
+
+  int num_tasks(10);
+  std::vector<std::future<int>> task_futures;
+  for (int i = num_tasks - 1; i >= 0; i--) {
+    task_futures.push_back(delay_queue.AddTask(i * 20, [i] () { return i; }));
+  }
+
+  for (int i = 0; i < num_tasks; i++) {
+    EXPECT_EQ(task_futures[i].get(), num_tasks - 1 - i);
+  }
+}